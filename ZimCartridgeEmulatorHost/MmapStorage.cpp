@@ -0,0 +1,146 @@
+// Zim Cartridge Emulator Host
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#include "MmapStorage.h"
+
+MmapStorage::MmapStorage(unsigned long syncMs) :
+    commits_(0),
+    syncs_(0),
+    syncMs_(syncMs),
+    fd_(-1),
+    pmem_(NULL),
+    size_(0),
+    dirtyLo_(0),
+    dirtyHi_(0),
+    pending_(0),
+    pendingUs_(0)
+{
+}
+
+/// Syncs what is pending
+MmapStorage::~MmapStorage()
+{
+  if(pmem_ != NULL)
+  {
+    sync(true);
+    munmap(pmem_, size_);
+  }
+  if(fd_ >= 0)
+    close(fd_);
+}
+
+/// Maps the file, which is created erased (0xFF) or grown to size
+bool
+MmapStorage::open(const char * path, int size)
+{
+  fd_ = ::open(path, O_RDWR | O_CREAT, 0644);
+  struct stat st;
+  if(fd_ < 0 || fstat(fd_, &st) != 0)
+  {
+    error_ = strerror(errno);
+    return false;
+  }
+  if(st.st_size < size)
+  {
+    std::vector<byte> erased(size - st.st_size, 0xFF);
+    if(pwrite(fd_, &erased[0], erased.size(), st.st_size) != (ssize_t)erased.size())
+    {
+      error_ = strerror(errno);
+      return false;
+    }
+  }
+
+  void * p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if(p == MAP_FAILED)
+  {
+    error_ = strerror(errno);
+    return false;
+  }
+  pmem_ = (byte *)p;
+  size_ = size;
+  return true;
+}
+
+byte
+MmapStorage::read(int loc)
+{
+  return loc < size_ ? pmem_[loc] : 0xFF;
+}
+
+void
+MmapStorage::write(int loc, byte value)
+{
+  if(loc >= size_ || pmem_[loc] == value)
+    return;
+  pmem_[loc] = value;
+  if(dirtyLo_ == dirtyHi_)
+  {
+    dirtyLo_ = loc;
+    dirtyHi_ = loc + 1;
+  }
+  else
+  {
+    dirtyLo_ = std::min(dirtyLo_, loc);
+    dirtyHi_ = std::max(dirtyHi_, loc + 1);
+  }
+}
+
+int
+MmapStorage::length()
+{
+  return size_;
+}
+
+void
+MmapStorage::commit()
+{
+  ++commits_;
+  if(dirtyLo_ == dirtyHi_)
+    return;
+  if(pending_++ == 0)
+    pendingUs_ = nowUs();
+  sync(syncMs_ == 0);
+}
+
+/// msync()s the dirty pages if forced or the batch is due
+void
+MmapStorage::sync(bool force)
+{
+  if(pending_ == 0 && !force)
+    return;
+  if(!force && nowUs() - pendingUs_ < syncMs_ * 1000ULL)
+    return;
+  if(dirtyLo_ != dirtyHi_)
+  {
+    long page = sysconf(_SC_PAGESIZE);
+    int lo = dirtyLo_ / page * page;
+    msync(pmem_ + lo, dirtyHi_ - lo, MS_SYNC);
+    ++syncs_;
+  }
+  dirtyLo_ = dirtyHi_ = 0;
+  pending_ = 0;
+}
+
+uint64_t
+MmapStorage::nowUs()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
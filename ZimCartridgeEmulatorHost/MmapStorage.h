@@ -0,0 +1,53 @@
+// Zim Cartridge Emulator Host
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+#ifndef MmapStorage_h
+#define MmapStorage_h
+
+#include <string>
+#include <Arduino.h>
+#include "Storage.h"
+
+#define MMAP_STORAGE_SYNC_MS    1000  // default msync batch, 0 syncs every commit
+
+/// Sketch storage in a shared mapping of a file, for the host builds. A
+/// write lands in the page cache at once, so it survives the process; the
+/// msync() that makes it survive the machine is batched, sync() issues it
+/// for the dirty pages once the oldest unsynced commit is syncMs old.
+class MmapStorage : public Storage
+{
+public:
+  MmapStorage(unsigned long syncMs = MMAP_STORAGE_SYNC_MS);
+  ~MmapStorage();
+  bool open(const char * path, int size);
+  byte read(int loc);
+  void write(int loc, byte value);
+  int  length();
+  void commit();
+  void sync(bool force = false);
+  bool isPending()                  { return pending_ != 0; }
+
+  std::string     error_;
+  unsigned long   commits_;
+  unsigned long   syncs_;
+
+private:
+  static uint64_t nowUs();
+
+  unsigned long   syncMs_;
+  int             fd_;
+  byte *          pmem_;
+  int             size_;
+  int             dirtyLo_;   // byte range written since the last msync
+  int             dirtyHi_;
+  unsigned long   pending_;   // commits since the last msync
+  uint64_t        pendingUs_; // time of the oldest of them
+};
+
+#endif
@@ -0,0 +1,49 @@
+// Zim Cartridge Emulator Host
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+#ifndef ZimBudgets_h
+#define ZimBudgets_h
+
+// Reply budgets per Zim command, shared by zimreplay and zimsim
+
+struct Budget
+{
+  unsigned int  funcCode;
+  const char *  name;
+  unsigned long us;       // first reply byte after the last request byte
+};
+
+// The worst reply of any sketch to the command in traces/ under zimreplay
+// and zimsim, with the HAL charging the sketch's code per basic block, plus
+// half again because that charge is an estimate, rounded up to 50 us. The
+// Nano sets most of them, its SoftwareSerial blocks 520 us on the first
+// reply byte. The Zim retries after about 50 ms.
+static const Budget Budgets[] =
+{
+  { 0x0101, "initPort",         850 },  // worst 562 us
+  { 0x0102, "setNode",          850 },  // 548
+  { 0x010C, "setAntennaStatus", 850 },  // never replied to, as unknown
+  { 0x0201, "request",          850 },  // 563
+  { 0x0202, "antiCollision",    900 },  // 579
+  { 0x0203, "select",           850 },  // 561
+  { 0x0204, "halt",             850 },  // 553
+  { 0x0208, "readData",         900 },  // 588
+  { 0x0213, "writeData",        900 },  // 587
+  { 0,      "unknown",          900 }   // 580
+};
+
+inline const Budget & budgetFor(unsigned int funcCode)
+{
+  size_t i = 0;
+  while(Budgets[i].funcCode != 0 && Budgets[i].funcCode != funcCode)
+    ++i;
+  return Budgets[i];
+}
+
+#endif
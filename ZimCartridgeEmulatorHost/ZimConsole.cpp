@@ -0,0 +1,423 @@
+// Zim Cartridge Emulator Control
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ZimConsole.h"
+
+static const char * Materials[] = { "PLA", "ABS", "PVA" };
+
+static const struct
+{
+  const char *  name;
+  unsigned long rgb;
+} Colors[] =
+{
+  { "Black",  0x000000 },
+  { "White",  0xFFFFFF },
+  { "Gray",   0xC0C0C0 },
+  { "Cyan",   0x00FFFF },
+  { "Orange", 0xFFA500 },
+  { "Brown",  0xA52A2A },
+  { "Red",    0xFF0000 },
+  { "Yellow", 0xFFFF00 },
+  { "Blue",   0x0000FF },
+  { "Green",  0x008000 },
+  { "Purple", 0x800080 },
+  { "Pink",   0xFFC0CB }
+};
+
+static const int TEMPERATURE_OFFSET = 100;
+
+static long nowMs()
+{
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000L + t.tv_nsec / 1000000L;
+}
+
+static bool parseNumber(const std::string & value, long & result)
+{
+  char * end = NULL;
+  result = strtol(value.c_str(), &end, 0);
+  return !value.empty() && *end == '\0';
+}
+
+// Lengths are mm, or metres with an 'm' suffix
+static bool parseLength(const std::string & value, long & result)
+{
+  if(!value.empty() && value[value.size() - 1] == 'm')
+  {
+    char * end = NULL;
+    double metres = strtod(value.c_str(), &end);
+    if(end != value.c_str() + value.size() - 1)
+      return false;
+    result = (long)(metres * 1000.0 + 0.5);
+    return true;
+  }
+  return parseNumber(value, result);
+}
+
+ZimCartridge::ZimCartridge() :
+    id_(0),
+    magicNum_(0x5C12),
+    type_(1),
+    material_(0),
+    red_(0xFF),
+    green_(0xFF),
+    blue_(0xFF),
+    initLen_(200000),
+    usedLen_(0),
+    tempPrint_(0x5F),
+    tempFirst_(0x55),
+    date_(0x0217)
+{
+}
+
+void
+ZimCartridge::fromImage(const byte * p)
+{
+  magicNum_  = p[0]<<8 | p[1];
+  type_      = p[2]>>4;
+  material_  = p[2] & 0x0F;
+  red_       = p[3];
+  green_     = p[4];
+  blue_      = p[5];
+  initLen_   = (long)p[6]<<12 | (long)p[7]<<4 | (p[8] & 0xF0)>>4;
+  usedLen_   = (long)(p[8] & 0x0F)<<16 | (long)p[9]<<8 | p[10];
+  tempPrint_ = p[11];
+  tempFirst_ = p[12];
+  date_      = p[13]<<8 | p[14];
+}
+
+void
+ZimCartridge::toImage(byte * p) const
+{
+  p[0]  = magicNum_>>8;
+  p[1]  = magicNum_ & 0xFF;
+  p[2]  = (type_<<4 | (material_ & 0x0F)) & 0xFF;
+  p[3]  = red_;
+  p[4]  = green_;
+  p[5]  = blue_;
+  p[6]  = (initLen_>>12) & 0xFF;
+  p[7]  = (initLen_>>4) & 0xFF;
+  p[8]  = (initLen_<<4 | usedLen_>>16) & 0xFF;
+  p[9]  = (usedLen_>>8) & 0xFF;
+  p[10] = usedLen_ & 0xFF;
+  p[11] = tempPrint_;
+  p[12] = tempFirst_;
+  p[13] = date_>>8;
+  p[14] = date_ & 0xFF;
+  p[15] = 0;
+  for(int i=0; i<ZIM_TAG_LENGTH - 1; ++i)
+  {
+    p[15] ^= p[i];
+  }
+}
+
+bool
+ZimCartridge::set(const std::string & field, const std::string & value)
+{
+  long number = 0;
+
+  if(field == "material")
+  {
+    for(int i=0; i<3; ++i)
+    {
+      if(strcasecmp(value.c_str(), Materials[i]) == 0)
+      {
+        material_ = i;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  if(field == "color")
+  {
+    for(size_t i=0; i<sizeof(Colors)/sizeof(Colors[0]); ++i)
+    {
+      if(strcasecmp(value.c_str(), Colors[i].name) == 0)
+      {
+        red_   = Colors[i].rgb>>16;
+        green_ = Colors[i].rgb>>8;
+        blue_  = Colors[i].rgb;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  if(field == "type")
+  {
+    if(value == "normal")
+      type_ = 0;
+    else if(value == "refillable")
+      type_ = 1;
+    else
+      return false;
+    return true;
+  }
+
+  if(field == "rgb")
+  {
+    char * end = NULL;
+    unsigned long rgb = strtoul(value.c_str(), &end, 16);
+    if(value.empty() || *end != '\0' || rgb > 0xFFFFFF)
+      return false;
+    red_   = rgb>>16;
+    green_ = rgb>>8;
+    blue_  = rgb;
+    return true;
+  }
+
+  if(field == "init" || field == "used")
+  {
+    if(!parseLength(value, number) || number < 0 || number > 0xFFFFF)
+      return false;
+    (field == "init" ? initLen_ : usedLen_) = number;
+    return true;
+  }
+
+  if(!parseNumber(value, number))
+    return false;
+
+  if(field == "temp" || field == "tempfirst")
+  {
+    number -= TEMPERATURE_OFFSET;
+    if(number < 0 || number > 0xFF)
+      return false;
+    (field == "temp" ? tempPrint_ : tempFirst_) = number;
+  }
+  else if(field == "id" && number >= 0 && number <= 0xFFFF)
+    id_ = number;
+  else if(field == "magic" && number >= 0 && number <= 0xFFFF)
+    magicNum_ = number;
+  else if(field == "date" && number >= 0 && number <= 0xFFFF)
+    date_ = number;
+  else
+    return false;
+  return true;
+}
+
+std::string
+ZimCartridge::toString() const
+{
+  unsigned long rgb = (unsigned long)red_<<16 | green_<<8 | blue_;
+  const char * color = "?";
+  for(size_t i=0; i<sizeof(Colors)/sizeof(Colors[0]); ++i)
+  {
+    if(Colors[i].rgb == rgb)
+      color = Colors[i].name;
+  }
+
+  char text[256];
+  snprintf(text, sizeof(text),
+           "id=0x%04X magic=0x%04X type=%s material=%s color=%s rgb=%06lX "
+           "init=%ld.%03ldm used=%ld.%03ldm temp=%dC tempfirst=%dC date=0x%04X",
+           id_, magicNum_, type_ == 1 ? "refillable" : "normal",
+           material_ < 3 ? Materials[material_] : "?", color, rgb,
+           initLen_ / 1000, initLen_ % 1000, usedLen_ / 1000, usedLen_ % 1000,
+           tempPrint_ + TEMPERATURE_OFFSET, tempFirst_ + TEMPERATURE_OFFSET,
+           date_);
+  return text;
+}
+
+ZimConsole::ZimConsole(const std::string & device) :
+    device_(device),
+    fd_(-1)
+{
+}
+
+ZimConsole::~ZimConsole()
+{
+  if(fd_ >= 0)
+    ::close(fd_);
+}
+
+bool
+ZimConsole::open()
+{
+  fd_ = ::open(device_.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if(fd_ < 0)
+  {
+    error_ = strerror(errno);
+    return false;
+  }
+
+  termios tio;
+  if(tcgetattr(fd_, &tio) == 0)
+  {
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, B57600);
+    cfsetospeed(&tio, B57600);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cflag &= ~HUPCL; // don't reset the board again on close
+    tcsetattr(fd_, TCSANOW, &tio);
+  }
+  tcflush(fd_, TCIOFLUSH);
+  return true;
+}
+
+// Opening the port resets most boards, poll until the sketch is up
+bool
+ZimConsole::waitReady(Info & info)
+{
+  long deadline = nowMs() + 5000;
+  while(nowMs() < deadline)
+  {
+    if(getInfo(info, 250))
+      return true;
+  }
+  error_ = "no reply from console";
+  return false;
+}
+
+bool
+ZimConsole::readByte(byte & rx, long deadlineMs)
+{
+  for(;;)
+  {
+    ssize_t n = ::read(fd_, &rx, 1);
+    if(n == 1)
+      return true;
+    if(n < 0 && errno != EAGAIN && errno != EINTR)
+      return false;
+
+    long wait = deadlineMs - nowMs();
+    if(wait <= 0)
+      return false;
+    pollfd pfd = { fd_, POLLIN, 0 };
+    poll(&pfd, 1, wait);
+  }
+}
+
+bool
+ZimConsole::transact(byte cmd, byte port, const std::vector<byte> & data,
+                     std::vector<byte> & reply, int timeoutMs)
+{
+  std::vector<byte> frame;
+  frame.push_back(0xAA);
+  frame.push_back(0xBB);
+  frame.push_back(data.size() + 2);
+  frame.push_back(cmd);
+  frame.push_back(port);
+  frame.insert(frame.end(), data.begin(), data.end());
+  byte xorVal = 0;
+  for(size_t i=2; i<frame.size(); ++i)
+    xorVal ^= frame[i];
+  frame.push_back(xorVal);
+
+  if(::write(fd_, &frame[0], frame.size()) != (ssize_t)frame.size())
+  {
+    error_ = "write failed";
+    return false;
+  }
+
+  // Skip debug text and stale replies until our reply turns up
+  long deadline = nowMs() + timeoutMs;
+  byte rx = 0;
+  while(readByte(rx, deadline))
+  {
+    if(rx != 0xAA || !readByte(rx, deadline) || rx != 0xBB)
+      continue;
+
+    byte len = 0;
+    if(!readByte(len, deadline) || len < 3)
+      continue;
+    std::vector<byte> body(len);
+    xorVal = len;
+    bool complete = true;
+    for(int i=0; i<len && complete; ++i)
+    {
+      complete = readByte(body[i], deadline);
+      xorVal ^= body[i];
+    }
+    if(!complete || !readByte(rx, deadline))
+      break;
+    if(rx != xorVal || body[0] != cmd || body[1] != port)
+      continue;
+
+    if(body[2] != 0)
+    {
+      static const char * Status[] = { "ok", "bad command", "bad port",
+                                       "bad length", "bad xor", "reply overflow" };
+      error_ = body[2] < 6 ? Status[body[2]] : "error";
+      return false;
+    }
+    reply.assign(body.begin() + 3, body.end());
+    return true;
+  }
+  error_ = "timeout";
+  return false;
+}
+
+bool
+ZimConsole::getInfo(Info & info, int timeoutMs)
+{
+  std::vector<byte> reply;
+  if(!transact(ZimCommand::info, 0, std::vector<byte>(), reply, timeoutMs) ||
+     reply.size() < 7)
+    return false;
+  info.major = reply[0];
+  info.minor = reply[1];
+  info.ports = reply[2];
+  info.uptime = reply[3] | reply[4]<<8 | reply[5]<<16 | (unsigned long)reply[6]<<24;
+  info.firstResponse.clear();
+  for(size_t i=7; i+4<=reply.size(); i+=4)
+  {
+    info.firstResponse.push_back(reply[i] | reply[i+1]<<8 | reply[i+2]<<16 |
+                                 (unsigned long)reply[i+3]<<24);
+  }
+  return true;
+}
+
+bool
+ZimConsole::getCartridge(byte port, ZimCartridge & cartridge)
+{
+  std::vector<byte> reply;
+  if(!transact(ZimCommand::getCartridge, port, std::vector<byte>(), reply))
+    return false;
+  if(reply.size() != 2 + ZIM_TAG_LENGTH)
+  {
+    error_ = "short reply";
+    return false;
+  }
+  cartridge.id_ = reply[0] | reply[1]<<8;
+  cartridge.fromImage(&reply[2]);
+  return true;
+}
+
+bool
+ZimConsole::setCartridge(byte port, const ZimCartridge & cartridge)
+{
+  std::vector<byte> data(2 + ZIM_TAG_LENGTH);
+  std::vector<byte> reply;
+  data[0] = cartridge.id_ & 0xFF;
+  data[1] = cartridge.id_>>8;
+  cartridge.toImage(&data[2]);
+  return transact(ZimCommand::setCartridge, port, data, reply);
+}
+
+bool
+ZimConsole::simple(byte cmd, byte port)
+{
+  std::vector<byte> reply;
+  return transact(cmd, port, std::vector<byte>(), reply, 1000);
+}
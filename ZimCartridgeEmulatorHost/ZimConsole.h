@@ -0,0 +1,115 @@
+// Zim Cartridge Emulator Control
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+#ifndef ZimConsole_h
+#define ZimConsole_h
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+typedef uint8_t byte;
+
+/// Little endian field of a console reply
+inline unsigned long zimGet(const std::vector<byte> & reply, size_t offset, int size)
+{
+  unsigned long value = 0;
+  for(int i=size-1; i>=0; --i)
+    value = value<<8 | reply[offset + i];
+  return value;
+}
+
+#define ZIM_CONSOLE_BAUD_RATE   57600
+#define ZIM_TAG_LENGTH          16
+
+/// Host copy of the cartridge fields carried by the 16 byte tag image
+class ZimCartridge
+{
+public:
+  ZimCartridge();
+  void fromImage(const byte * pImage);
+  void toImage(byte * pImage) const;
+  bool set(const std::string & field, const std::string & value);
+  std::string toString() const;
+
+  int   id_;
+  int   magicNum_;
+  int   type_;
+  int   material_;
+  byte  red_;
+  byte  green_;
+  byte  blue_;
+  long  initLen_;
+  long  usedLen_;
+  byte  tempPrint_;
+  byte  tempFirst_;
+  int   date_;
+};
+
+// Mirrors ConsoleCommand in the MegaLCD sketch
+namespace ZimCommand
+{
+  enum Type
+  {
+    info          = 0x01,
+    getCartridge  = 0x10,
+    setCartridge  = 0x11,
+    save          = 0x12,
+    reload        = 0x13,
+    reset         = 0x14,
+    power         = 0x20,
+    watchdog      = 0x21,
+    tasks         = 0x22,
+    telemetry     = 0x23,
+    history       = 0x24,
+    memory        = 0x25,
+    cadence       = 0x26,
+    pool          = 0x27,
+    portStats     = 0x28,
+    portFrames    = 0x29,
+    link          = 0x2A
+  };
+}
+
+/// Client for the binary console of one board
+class ZimConsole
+{
+public:
+  struct Info
+  {
+    int           major;
+    int           minor;
+    int           ports;
+    unsigned long uptime;
+    std::vector<unsigned long> firstResponse; // msecs after start, per port
+  };
+
+  ZimConsole(const std::string & device);
+  ~ZimConsole();
+  bool open();
+  bool waitReady(Info & info);
+  bool transact(byte cmd, byte port, const std::vector<byte> & data,
+                std::vector<byte> & reply, int timeoutMs = 500);
+  bool getInfo(Info & info, int timeoutMs = 500);
+  bool getCartridge(byte port, ZimCartridge & cartridge);
+  bool setCartridge(byte port, const ZimCartridge & cartridge);
+  bool simple(byte cmd, byte port);
+
+  const std::string & device() const { return device_; }
+  const std::string & error() const { return error_; }
+
+private:
+  bool readByte(byte & rx, long deadlineMs);
+
+  std::string device_;
+  std::string error_;
+  int         fd_;
+};
+
+#endif
@@ -0,0 +1,110 @@
+// Zim Cartridge Emulator Host
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+#ifndef Arduino_h
+#define Arduino_h
+
+// Host stand in for the parts of the Arduino core the sketches use
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include <avr/pgmspace.h>
+#include "Hal.h"
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HEX 16
+#define DEC 10
+#define F(s) (s)
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+int analogRead(uint8_t pin);
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+class String : public std::string
+{
+public:
+  String() {}
+  String(const char * s) : std::string(s) {}
+  String(const std::string & s) : std::string(s) {}
+};
+
+class Print
+{
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  size_t print(const char * s);
+  size_t print(const String & s)                  { return print(s.c_str()); }
+  size_t print(char c)                            { return write(c); }
+  size_t print(unsigned char v, int base = DEC)   { return print((unsigned long)v, base); }
+  size_t print(int v, int base = DEC)             { return print((long)v, base); }
+  size_t print(unsigned int v, int base = DEC)    { return print((unsigned long)v, base); }
+  size_t print(long v, int base = DEC);
+  size_t print(unsigned long v, int base = DEC);
+  size_t print(double v, int digits = 2);
+  size_t println()                                { return print("\r\n"); }
+  template<typename T> size_t println(T v)        { size_t n = print(v); return n + println(); }
+  template<typename T> size_t println(T v, int b) { size_t n = print(v, b); return n + println(); }
+};
+
+class Stream : public Print
+{
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+};
+
+/// UART with a modelled TX ring. RX bytes are injected with their arrival
+/// time, TX bytes are captured with the time the sketch wrote them.
+class HardwareSerial : public Stream
+{
+public:
+  struct Byte
+  {
+    uint64_t  us;
+    byte      value;
+  };
+
+  HardwareSerial(bool debug = false);
+  void begin(unsigned long baud);
+  void end() {}
+  int available();
+  int read();
+  int peek();
+  size_t write(uint8_t c);
+  void flush();
+  operator bool() { return true; }
+
+  void inject(const byte * pData, int len, uint64_t startUs);
+  void receive(const byte * pData, int len); // bytes already in, live use
+  uint64_t nextRxUs() const;          // UINT64_MAX if nothing is pending
+  uint64_t byteUs() const             { return 10000000ULL / baud_; }
+
+  std::deque<Byte>    rx_;
+  std::vector<Byte>   tx_;
+  unsigned long       baud_;
+  uint64_t            txIdleUs_;      // when the last queued byte leaves the wire
+  bool                debug_;         // the USB port, echoed to Hal::debug
+  bool                blocking_;      // SoftwareSerial, write() holds the CPU
+};
+
+extern HardwareSerial Serial, Serial1, Serial2, Serial3;
+
+#endif
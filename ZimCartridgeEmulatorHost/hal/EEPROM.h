@@ -0,0 +1,44 @@
+// Zim Cartridge Emulator Host
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+#ifndef EEPROM_h
+#define EEPROM_h
+
+#include <Arduino.h>
+
+/// Erased (0xFF) eeprom, put() and update() only program changed bytes like
+/// the AVR library does
+struct EEPROMClass
+{
+  EEPROMClass()                     { memset(mem_, 0xFF, sizeof(mem_)); }
+  uint8_t read(int idx)             { return mem_[idx]; }
+  void write(int idx, uint8_t val)  { mem_[idx] = val; Hal::advance(Hal::costs.eepromWriteUs, HalCost::eeprom); }
+  void update(int idx, uint8_t val) { if(mem_[idx] != val) write(idx, val); }
+  uint16_t length()                 { return HAL_EEPROM_SIZE; }
+
+  template<typename T> T & get(int idx, T & t)
+  {
+    memcpy(&t, &mem_[idx], sizeof(T));
+    return t;
+  }
+
+  template<typename T> const T & put(int idx, const T & t)
+  {
+    const uint8_t * p = (const uint8_t *)&t;
+    for(size_t i=0; i<sizeof(T); ++i)
+      update(idx + i, p[i]);
+    return t;
+  }
+
+  uint8_t mem_[HAL_EEPROM_SIZE];
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
@@ -0,0 +1,317 @@
+// Zim Cartridge Emulator Host
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <time.h>
+#include <algorithm>
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <Wire.h>
+
+HardwareSerial Serial(true), Serial1, Serial2, Serial3;
+EEPROMClass EEPROM;
+TwoWire Wire;
+
+namespace Hal
+{
+  uint64_t  nowUs = 0;
+  bool      live = false;
+  FILE *    debug = NULL;
+  int       analogValue = 1023;
+  HalCosts  costs = { HAL_BLOCK_NS, HAL_SERIAL_WRITE_US, HAL_EEPROM_WRITE_US,
+                      HAL_LCD_WRITE_US, HAL_LCD_CLEAR_US, HAL_LCD_BEGIN_US, HAL_ADC_US };
+  uint64_t  spentUs[HalCost::count];
+  std::vector<HalSpan> * pTimeline = NULL;
+  static uint64_t blocks = 0;     // basic blocks the sketch ran, not yet charged
+  static uint64_t chargedNs = 0;  // below 1 us left over from the last charge
+
+  struct AnalogChange
+  {
+    uint64_t  us;
+    int       value;
+  };
+
+  static std::vector<AnalogChange> & analogChanges()
+  {
+    static std::vector<AnalogChange> changes;
+    return changes;
+  }
+
+  // Every port, and the Zim ports in the order they were begun
+  static std::vector<HardwareSerial *> & allPorts()
+  {
+    static std::vector<HardwareSerial *> ports;
+    return ports;
+  }
+
+  static std::vector<HardwareSerial *> & zimPorts()
+  {
+    static std::vector<HardwareSerial *> ports;
+    return ports;
+  }
+
+  // Monotonic clock from the first call on, so millis() starts near 0
+  static uint64_t liveUs()
+  {
+    static uint64_t startUs = 0;
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    if(startUs == 0)
+      startUs = us;
+    return us - startUs;
+  }
+
+  static void spend(uint64_t us, HalCost::Type cost)
+  {
+    if(us == 0)
+      return;
+    if(pTimeline != NULL)
+    {
+      HalSpan span = { nowUs, (uint32_t)us, cost };
+      pTimeline->push_back(span);
+    }
+    spentUs[cost] += us;
+    nowUs += us;
+  }
+
+  void advance(uint64_t us, HalCost::Type cost)
+  {
+    if(live)
+      return;
+    charge();
+    spend(us, cost);
+  }
+
+  void charge()
+  {
+    if(live)
+      return;
+    chargedNs += blocks * costs.blockNs;
+    blocks = 0;
+    spend(chargedNs / 1000, HalCost::sketch);
+    chargedNs %= 1000;
+  }
+
+  void setAnalog(uint64_t atUs, int value)
+  {
+    AnalogChange change = { atUs, value };
+    std::vector<AnalogChange> & changes = analogChanges();
+    std::vector<AnalogChange>::iterator it = changes.begin();
+    while(it != changes.end() && it->us <= atUs)
+      ++it;
+    changes.insert(it, change);
+  }
+
+  void sleep()
+  {
+    charge();
+    uint64_t wake = (nowUs / HAL_TIMER_TICK_US + 1) * HAL_TIMER_TICK_US;
+    for(size_t i=0; i<allPorts().size(); ++i)
+    {
+      wake = std::min(wake, allPorts()[i]->nextRxUs());
+    }
+    if(wake > nowUs)
+    {
+      advance(wake - nowUs, HalCost::idle);
+    }
+  }
+
+  HardwareSerial * port(int index)
+  {
+    return index < numPorts() ? zimPorts()[index] : NULL;
+  }
+
+  int numPorts()
+  {
+    return zimPorts().size();
+  }
+}
+
+unsigned long millis()                { return micros() / 1000; }
+
+unsigned long micros()
+{
+  if(Hal::live)
+    Hal::nowUs = Hal::liveUs();
+  Hal::charge();
+  return Hal::nowUs;
+}
+
+/// Called by the compiler at every basic block of the sketches' code
+extern "C" void __sanitizer_cov_trace_pc()
+{
+  ++Hal::blocks;
+}
+
+void delay(unsigned long ms)          { Hal::advance(ms * 1000ULL, HalCost::delay); }
+void delayMicroseconds(unsigned int us) { Hal::advance(us, HalCost::delay); }
+
+/// The value is sampled at the start of the conversion
+int analogRead(uint8_t pin)
+{
+  std::vector<Hal::AnalogChange> & changes = Hal::analogChanges();
+  while(!changes.empty() && changes.front().us <= Hal::nowUs)
+  {
+    Hal::analogValue = changes.front().value;
+    changes.erase(changes.begin());
+  }
+  Hal::advance(Hal::costs.adcUs, HalCost::adc);
+  return Hal::analogValue;
+}
+
+size_t Print::print(const char * s)
+{
+  size_t n = 0;
+  while(*s)
+    n += write(*s++);
+  return n;
+}
+
+size_t Print::print(long v, int base)
+{
+  if(base == DEC)
+  {
+    char text[24];
+    snprintf(text, sizeof(text), "%ld", v);
+    return print(text);
+  }
+  return print((unsigned long)v, base);
+}
+
+size_t Print::print(unsigned long v, int base)
+{
+  char text[24];
+  snprintf(text, sizeof(text), base == HEX ? "%lX" : "%lu", v);
+  return print(text);
+}
+
+size_t Print::print(double v, int digits)
+{
+  char text[40];
+  snprintf(text, sizeof(text), "%.*f", digits, v);
+  return print(text);
+}
+
+HardwareSerial::HardwareSerial(bool debug) :
+                                baud_(9600),
+                                txIdleUs_(0),
+                                debug_(debug),
+                                blocking_(false)
+{
+  Hal::allPorts().push_back(this);
+}
+
+void
+HardwareSerial::begin(unsigned long baud)
+{
+  baud_ = baud;
+  if(baud == 19200 &&
+     std::find(Hal::zimPorts().begin(), Hal::zimPorts().end(), this) == Hal::zimPorts().end())
+  {
+    Hal::zimPorts().push_back(this);
+  }
+}
+
+int
+HardwareSerial::available()
+{
+  Hal::charge();
+  int count = 0;
+  for(size_t i=0; i<rx_.size() && rx_[i].us <= Hal::nowUs; ++i)
+    ++count;
+  return count;
+}
+
+int
+HardwareSerial::read()
+{
+  if(!available())
+    return -1;
+  int value = rx_.front().value;
+  rx_.pop_front();
+  return value;
+}
+
+int
+HardwareSerial::peek()
+{
+  return available() ? rx_.front().value : -1;
+}
+
+/// Buffered ports block only while the TX ring is full, SoftwareSerial
+/// blocks for the whole byte
+size_t
+HardwareSerial::write(uint8_t c)
+{
+  if(blocking_)
+  {
+    Hal::advance(byteUs(), HalCost::serial);
+    txIdleUs_ = Hal::nowUs;
+  }
+  else
+  {
+    Hal::advance(Hal::costs.serialWriteUs);
+    uint64_t full = HAL_SERIAL_TX_BUFFER * byteUs();
+    if(txIdleUs_ > Hal::nowUs + full)
+    {
+      Hal::advance(txIdleUs_ - full - Hal::nowUs, HalCost::serial);
+    }
+    txIdleUs_ = std::max(txIdleUs_, Hal::nowUs) + byteUs();
+  }
+
+  Byte b = { Hal::nowUs, c };
+  if(debug_)
+  {
+    if(Hal::debug != NULL)
+      fputc(c, Hal::debug);
+  }
+  else
+  {
+    tx_.push_back(b);
+  }
+  return 1;
+}
+
+void
+HardwareSerial::flush()
+{
+  if(txIdleUs_ > Hal::nowUs)
+  {
+    Hal::advance(txIdleUs_ - Hal::nowUs, HalCost::serial);
+  }
+}
+
+/// Queues bytes that arrive back to back at the port's baud rate
+void
+HardwareSerial::inject(const byte * pData, int len, uint64_t startUs)
+{
+  for(int i=0; i<len; ++i)
+  {
+    Byte b = { startUs + (i + 1) * byteUs(), pData[i] };
+    rx_.push_back(b);
+  }
+}
+
+/// Queues bytes that have arrived by now
+void
+HardwareSerial::receive(const byte * pData, int len)
+{
+  for(int i=0; i<len; ++i)
+  {
+    Byte b = { micros(), pData[i] };
+    rx_.push_back(b);
+  }
+}
+
+uint64_t
+HardwareSerial::nextRxUs() const
+{
+  return rx_.empty() ? UINT64_MAX : rx_.front().us;
+}
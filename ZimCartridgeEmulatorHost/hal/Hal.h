@@ -0,0 +1,95 @@
+// Zim Cartridge Emulator Host
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+#ifndef Hal_h
+#define Hal_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+// Modelled cost of the AVR side effects, in microseconds. The sketches' own
+// code is charged HAL_BLOCK_NS per basic block it runs, counted by the
+// compiler's trace-pc hook, whenever it calls into the HAL, so the work of
+// building a reply lands before its first byte. Everything else is the time
+// the real part would block: a full UART transmit buffer, bit banged
+// SoftwareSerial, eeprom programming and the LCD's enable pulses. These are
+// the defaults of Hal::costs.
+#define HAL_BLOCK_NS            500     // a host basic block, about 8 cycles at 16 MHz
+#define HAL_SERIAL_WRITE_US     2       // Serial.write() into a free buffer slot
+#define HAL_SERIAL_TX_BUFFER    63      // usable bytes in the core's TX ring
+#define HAL_EEPROM_WRITE_US     3400    // per changed byte
+#define HAL_LCD_WRITE_US        250     // 4 bit mode, two enable pulses per byte
+#define HAL_LCD_CLEAR_US        2250
+#define HAL_ADC_US              112
+#define HAL_TIMER_TICK_US       1024    // timer0 overflow, wakes the CPU from idle
+#define HAL_LCD_BEGIN_US        50000
+#define HAL_EEPROM_SIZE         4096
+
+class HardwareSerial;
+
+/// What the virtual time was spent on
+namespace HalCost
+{
+  enum Type
+  {
+    sketch,     // the sketch's own code, per basic block
+    serial,     // blocked on a full TX ring or on SoftwareSerial
+    eeprom,
+    lcd,
+    adc,
+    delay,      // delay() and delayMicroseconds()
+    idle,       // asleep until the next RX byte or timer tick
+    count
+  };
+}
+
+struct HalCosts
+{
+  unsigned long blockNs;
+  unsigned long serialWriteUs;
+  unsigned long eepromWriteUs;
+  unsigned long lcdWriteUs;
+  unsigned long lcdClearUs;
+  unsigned long lcdBeginUs;
+  unsigned long adcUs;
+};
+
+/// Stretch of virtual time spent on one thing, see Hal::pTimeline
+struct HalSpan
+{
+  uint64_t        startUs;
+  uint32_t        us;
+  HalCost::Type   cost;
+};
+
+/// Virtual clock and device registry shared by the host builds of the
+/// sketches. Time only moves when the sketch spends it or sleeps, so runs
+/// are repeatable and independent of the host's speed. With live set the
+/// clock follows the host's monotonic clock instead and nothing is charged,
+/// for tools that serve real ports with the sketch code.
+namespace Hal
+{
+  extern uint64_t   nowUs;
+  extern bool       live;
+  extern FILE *     debug;        // Serial output goes here, NULL drops it
+  extern int        analogValue;  // returned by analogRead(), 1023 is no button
+  extern HalCosts   costs;
+  extern uint64_t   spentUs[HalCost::count];
+  extern std::vector<HalSpan> * pTimeline; // every advance() is appended if set
+
+  void advance(uint64_t us, HalCost::Type cost = HalCost::sketch);
+  void charge();                  // the sketch's blocks run since the last charge
+  void setAnalog(uint64_t atUs, int value); // analogValue from atUs on
+  void sleep();                   // until the next RX byte or timer tick
+  HardwareSerial * port(int index); // index-th port begun at 19200 baud, the Zim links
+  int numPorts();
+}
+
+#endif
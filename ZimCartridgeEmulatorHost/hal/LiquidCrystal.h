@@ -0,0 +1,27 @@
+// Zim Cartridge Emulator Host
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+#ifndef LiquidCrystal_h
+#define LiquidCrystal_h
+
+#include <Arduino.h>
+
+/// HD44780 in 4 bit mode, only the time spent driving it is modelled
+class LiquidCrystal : public Print
+{
+public:
+  LiquidCrystal(uint8_t rs, uint8_t enable, uint8_t d0, uint8_t d1, uint8_t d2, uint8_t d3) {}
+  void begin(uint8_t cols, uint8_t rows)  { Hal::advance(Hal::costs.lcdBeginUs, HalCost::lcd); }
+  void clear()                            { Hal::advance(Hal::costs.lcdClearUs, HalCost::lcd); }
+  void setCursor(uint8_t col, uint8_t row){ Hal::advance(Hal::costs.lcdWriteUs, HalCost::lcd); }
+  void noCursor()                         { Hal::advance(Hal::costs.lcdWriteUs, HalCost::lcd); }
+  size_t write(uint8_t c)                 { Hal::advance(Hal::costs.lcdWriteUs, HalCost::lcd); return 1; }
+};
+
+#endif
@@ -0,0 +1,43 @@
+// Zim Cartridge Emulator Host
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+#ifndef Wire_h
+#define Wire_h
+
+#include <Arduino.h>
+
+/// TWI with nothing else on the bus: every address NAKs and nothing is
+/// ever received. zimbus puts LinkMaster and LinkSlave on its own bus.
+class TwoWire
+{
+public:
+  typedef void (*ReceiveHandler)(int count);
+  typedef void (*RequestHandler)();
+
+  TwoWire() : onReceive_(NULL), onRequest_(NULL) {}
+  void begin()                                    {}
+  void begin(uint8_t address)                     {}
+  void setClock(uint32_t hz)                      {}
+  void beginTransmission(uint8_t address)         {}
+  size_t write(uint8_t c)                         { return 1; }
+  size_t write(const uint8_t * pdata, size_t len) { return len; }
+  uint8_t endTransmission()                       { return 2; }  // NAK on the address
+  uint8_t requestFrom(uint8_t address, uint8_t len) { return 0; }
+  int available()                                 { return 0; }
+  int read()                                      { return -1; }
+  void onReceive(ReceiveHandler handler)          { onReceive_ = handler; }
+  void onRequest(RequestHandler handler)          { onRequest_ = handler; }
+
+  ReceiveHandler    onReceive_;
+  RequestHandler    onRequest_;
+};
+
+extern TwoWire Wire;
+
+#endif
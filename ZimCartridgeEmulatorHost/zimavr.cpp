@@ -0,0 +1,518 @@
+// Zim Cartridge Emulator AVR Bench
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// Replays a zimreplay trace through the real firmware running in simavr,
+// timed in CPU cycles instead of the HAL's cost model. `make avr-bench`
+// builds the MegaLCD and Nano sketches with arduino-cli and runs both, the
+// Nano only on the traces of one port.
+//
+//   zimavr [-v] [-m mcu] [-f hz] [-s ms] [-b us] firmware.elf trace
+//
+// On an atmega328p (the Nano) trace port 0 is SoftwareSerial on D10/D11,
+// bit banged on PB2 and sampled on PB3. Otherwise trace port 0 is Serial1
+// and port 1 Serial2, as on the Mega boards. Serial is the debug console,
+// -v prints it.
+//
+// For each request the reply time is counted from the end of the last
+// request byte's stop bit to the first reply byte: the write to UDR, or the
+// start bit on the soft serial pin. Busy cycles are the ones the CPU did not
+// sleep through from the first request byte to the last reply byte, the
+// loop() passes and interrupts that request cost. Replies are compared with
+// the trace and the reply time with the command's budget like zimreplay,
+// the exit status is 1 on any failure.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sim_avr.h>
+#include <sim_elf.h>
+#include <sim_irq.h>
+#include <sim_cycle_timers.h>
+#include <avr_uart.h>
+#include <avr_ioport.h>
+
+#include "ZimBudgets.h"
+
+typedef unsigned char byte;
+
+#define AVR_BAUD_RATE       19200   // RFID_BAUD_RATE of the sketches
+#define AVR_SOFT_RX_PIN     2       // PB2, D10 on the Nano
+#define AVR_SOFT_TX_PIN     3       // PB3, D11 on the Nano
+
+static void usage()
+{
+  fprintf(stderr, "usage: zimavr [-v] [-m mcu] [-f hz] [-s ms] [-b us] firmware.elf trace\n"
+                  "  -m     mcu, default atmega2560; atmega328p for the Nano\n"
+                  "  -f     clock, default 16000000\n"
+                  "  -s     settle time after setup() and without a reply, default 100 ms\n"
+                  "  -b     reply budget for every command instead of ZimBudgets.h\n");
+  exit(2);
+}
+
+static avr_t *            avr;
+static avr_cycle_count_t  sleepCycles = 0;   // cycles the CPU slept, all run
+
+/// Cycle a frame bit starts at, without accumulating rounding
+static avr_cycle_count_t bitCycle(avr_cycle_count_t start, int bit)
+{
+  return start + (avr_cycle_count_t)bit * avr->frequency / AVR_BAUD_RATE;
+}
+
+struct TxByte
+{
+  byte              value;
+  avr_cycle_count_t cycle;    // UDR write or start bit
+};
+
+/// One Zim port of the firmware
+class Link
+{
+public:
+  virtual ~Link() {}
+
+  /// Puts the value on the wire, its start bit at the current cycle
+  virtual void send(byte value) = 0;
+
+  std::vector<TxByte>   tx_;
+};
+
+/// Hardware USART. simavr clocks a raised byte into UDR one frame later,
+/// so raising it at the start bit times the wire.
+class UartLink : public Link
+{
+public:
+  UartLink(char name, bool echo)
+  {
+    uint32_t flags = 0;
+    avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS(name), &flags);
+    if(echo)
+      flags |= AVR_UART_FLAG_STDIO;
+    else
+      flags &= ~AVR_UART_FLAG_STDIO;
+    avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS(name), &flags);
+
+    pInput_ = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ(name), UART_IRQ_INPUT);
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ(name), UART_IRQ_OUTPUT),
+                            output, this);
+  }
+
+  void send(byte value)
+  {
+    avr_raise_irq(pInput_, value);
+  }
+
+private:
+  static void output(avr_irq_t * pIrq, uint32_t value, void * param)
+  {
+    UartLink * pLink = (UartLink *)param;
+    TxByte tx = { (byte)value, avr->cycle };
+    pLink->tx_.push_back(tx);
+  }
+
+  avr_irq_t *   pInput_;
+};
+
+/// SoftwareSerial on two port B pins. Input frames are driven bit by bit
+/// from cycle timers, output frames are sampled mid bit after a start edge.
+class SoftLink : public Link
+{
+public:
+  SoftLink() :
+      txLevel_(1),
+      txBusy_(false)
+  {
+    pRx_ = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), AVR_SOFT_RX_PIN);
+    avr_raise_irq(pRx_, 1);
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), AVR_SOFT_TX_PIN),
+                            output, this);
+  }
+
+  void send(byte value)
+  {
+    rxValue_ = value;
+    rxBit_ = 0;
+    rxStart_ = avr->cycle;
+    avr_raise_irq(pRx_, 0);
+    avr_cycle_timer_register(avr, bitCycle(rxStart_, 1) - avr->cycle, rxBit, this);
+  }
+
+private:
+  // Data bits LSB first, then the stop bit
+  static avr_cycle_count_t rxBit(avr_t * pAvr, avr_cycle_count_t when, void * param)
+  {
+    SoftLink * pLink = (SoftLink *)param;
+    int bit = pLink->rxBit_++;
+    avr_raise_irq(pLink->pRx_, bit < 8 ? (pLink->rxValue_ >> bit) & 1 : 1);
+    return bit < 8 ? bitCycle(pLink->rxStart_, bit + 2) : 0;
+  }
+
+  static void output(avr_irq_t * pIrq, uint32_t value, void * param)
+  {
+    SoftLink * pLink = (SoftLink *)param;
+    pLink->txLevel_ = value & 1;
+    if(!pLink->txBusy_ && pLink->txLevel_ == 0)
+    {
+      pLink->txBusy_ = true;
+      pLink->txBit_ = 0;
+      pLink->txValue_ = 0;
+      pLink->txStart_ = avr->cycle;
+      avr_cycle_timer_register(avr, bitCycle(pLink->txStart_, 1) +
+                               avr->frequency / AVR_BAUD_RATE / 2 - avr->cycle, txBit, pLink);
+    }
+  }
+
+  static avr_cycle_count_t txBit(avr_t * pAvr, avr_cycle_count_t when, void * param)
+  {
+    SoftLink * pLink = (SoftLink *)param;
+    int bit = pLink->txBit_++;
+    if(bit < 8)
+    {
+      pLink->txValue_ |= pLink->txLevel_ << bit;
+      return bitCycle(pLink->txStart_, bit + 2) + avr->frequency / AVR_BAUD_RATE / 2;
+    }
+    if(pLink->txLevel_ == 0)
+      fprintf(stderr, "zimavr: soft serial framing error at cycle %llu\n",
+              (unsigned long long)when);
+    TxByte tx = { pLink->txValue_, pLink->txStart_ };
+    pLink->tx_.push_back(tx);
+    pLink->txBusy_ = false;
+    return 0;
+  }
+
+  avr_irq_t *         pRx_;
+  byte                rxValue_;
+  int                 rxBit_;
+  avr_cycle_count_t   rxStart_;
+  byte                txLevel_;
+  bool                txBusy_;
+  byte                txValue_;
+  int                 txBit_;
+  avr_cycle_count_t   txStart_;
+};
+
+/// Feeds a request to a link one frame time apart
+struct Sender
+{
+  Link *                pLink;
+  std::vector<byte>     bytes;
+  size_t                next;
+  avr_cycle_count_t     start;
+  avr_cycle_count_t     endCycle;   // stop bit of the last byte done
+};
+
+static avr_cycle_count_t sendByte(avr_t * pAvr, avr_cycle_count_t when, void * param)
+{
+  Sender * pSender = (Sender *)param;
+  pSender->pLink->send(pSender->bytes[pSender->next++]);
+  if(pSender->next < pSender->bytes.size())
+    return bitCycle(pSender->start, pSender->next * 10);
+  return 0;
+}
+
+static avr_cycle_count_t wake(avr_t * pAvr, avr_cycle_count_t when, void * param)
+{
+  return 0;
+}
+
+// Runs the firmware until untilCycle, or until the link has sent
+// replyLen bytes since mark and the last one is on the wire
+static void runUntil(avr_cycle_count_t untilCycle, Link * pLink = NULL,
+                     size_t mark = 0, size_t replyLen = 0)
+{
+  if(untilCycle <= avr->cycle)
+    return;
+  // A sleeping CPU only wakes for a timer or an interrupt
+  avr_cycle_timer_cancel(avr, wake, NULL);
+  avr_cycle_timer_register(avr, untilCycle - avr->cycle, wake, NULL);
+  avr_cycle_count_t frameCycles = bitCycle(0, 10);
+  while(avr->cycle < untilCycle)
+  {
+    if(pLink != NULL && replyLen > 0 && pLink->tx_.size() >= mark + replyLen &&
+       avr->cycle >= pLink->tx_[mark + replyLen - 1].cycle + frameCycles)
+      return;
+    bool asleep = avr->state == cpu_Sleeping;
+    avr_cycle_count_t start = avr->cycle;
+    int state = avr_run(avr);
+    if(asleep)
+      sleepCycles += avr->cycle - start;
+    if(state == cpu_Done || state == cpu_Crashed)
+    {
+      fprintf(stderr, "zimavr: firmware stopped at cycle %llu, pc %04x\n",
+              (unsigned long long)avr->cycle, (unsigned int)avr->pc);
+      exit(1);
+    }
+  }
+}
+
+static bool parseBytes(std::istringstream & words, std::vector<byte> & bytes)
+{
+  std::string word;
+  while(words >> word)
+  {
+    char * end = NULL;
+    unsigned long value = strtoul(word.c_str(), &end, 16);
+    if(*end != '\0' || value > 0xFF)
+      return false;
+    bytes.push_back(value);
+  }
+  return !bytes.empty();
+}
+
+static std::string toHex(const std::vector<byte> & bytes)
+{
+  std::string text;
+  char hex[4];
+  for(size_t i=0; i<bytes.size(); ++i)
+  {
+    snprintf(hex, sizeof(hex), i ? " %02x" : "%02x", bytes[i]);
+    text += hex;
+  }
+  return text;
+}
+
+struct Step
+{
+  int                 line;
+  int                 port;
+  std::vector<byte>   request;
+  bool                hasReply;
+  std::vector<byte>   reply;
+  unsigned long       idleMs;
+};
+
+static bool readTrace(const char * path, std::vector<Step> & steps)
+{
+  std::ifstream in(path);
+  if(!in)
+  {
+    fprintf(stderr, "zimavr: can't open %s\n", path);
+    return false;
+  }
+
+  std::string text;
+  for(int line=1; std::getline(in, text); ++line)
+  {
+    std::istringstream words(text);
+    std::string kind;
+    if(!(words >> kind) || kind[0] == '#')
+      continue;
+
+    Step step;
+    step.line = line;
+    step.port = 0;
+    step.hasReply = false;
+    step.idleMs = 0;
+    bool ok = false;
+    if(kind == "+")
+    {
+      ok = !!(words >> step.idleMs);
+      step.port = -1;
+    }
+    else if(kind == ">")
+    {
+      ok = (words >> step.port) && parseBytes(words, step.request);
+    }
+    else if(kind == "<" && !steps.empty() && !steps.back().request.empty())
+    {
+      int port = 0;
+      ok = (words >> port) && port == steps.back().port &&
+           parseBytes(words, steps.back().reply);
+      steps.back().hasReply = true;
+      if(ok)
+        continue;
+    }
+    if(!ok)
+    {
+      fprintf(stderr, "%s:%d: bad line: %s\n", path, line, text.c_str());
+      return false;
+    }
+    steps.push_back(step);
+  }
+  return true;
+}
+
+struct Stats
+{
+  Stats() : count(0), replies(0), totalCycles(0), worstCycles(0), worstBusy(0),
+            over(0), mismatches(0) {}
+
+  int                 count;
+  int                 replies;
+  avr_cycle_count_t   totalCycles;    // reply cycles of all replies
+  avr_cycle_count_t   worstCycles;
+  avr_cycle_count_t   worstBusy;
+  int                 over;
+  int                 mismatches;
+};
+
+int main(int argc, char ** argv)
+{
+  bool verbose = false;
+  const char * mcu = "atmega2560";
+  unsigned long frequency = 16000000;
+  unsigned long settleMs = 100;
+  long budgetUs = -1;
+  int opt;
+  while((opt = getopt(argc, argv, "vm:f:s:b:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'v': verbose = true; break;
+      case 'm': mcu = optarg; break;
+      case 'f': frequency = strtoul(optarg, NULL, 0); break;
+      case 's': settleMs = atol(optarg); break;
+      case 'b': budgetUs = atol(optarg); break;
+      default:  usage();
+    }
+  }
+  if(optind != argc - 2)
+    usage();
+
+  std::vector<Step> steps;
+  if(!readTrace(argv[optind + 1], steps))
+    return 2;
+
+  elf_firmware_t firmware;
+  memset(&firmware, 0, sizeof(firmware));
+  if(elf_read_firmware(argv[optind], &firmware) != 0)
+  {
+    fprintf(stderr, "zimavr: can't load %s\n", argv[optind]);
+    return 2;
+  }
+  // Arduino builds have no .mmcu section
+  if(firmware.mmcu[0] == '\0')
+    snprintf(firmware.mmcu, sizeof(firmware.mmcu), "%s", mcu);
+  if(firmware.frequency == 0)
+    firmware.frequency = frequency;
+
+  avr = avr_make_mcu_by_name(firmware.mmcu);
+  if(avr == NULL)
+  {
+    fprintf(stderr, "zimavr: unknown mcu %s\n", firmware.mmcu);
+    return 2;
+  }
+  avr_init(avr);
+  avr_load_firmware(avr, &firmware);
+
+  std::vector<Link *> links;
+  if(strcmp(firmware.mmcu, "atmega328p") == 0 || strcmp(firmware.mmcu, "atmega328") == 0)
+  {
+    links.push_back(new SoftLink());
+  }
+  else
+  {
+    links.push_back(new UartLink('1', false));
+    links.push_back(new UartLink('2', false));
+  }
+  UartLink console('0', verbose);
+
+  avr_cycle_count_t msCycles = avr->frequency / 1000;
+  runUntil(avr->cycle + settleMs * msCycles);
+  avr_cycle_count_t benchStart = avr->cycle;
+  avr_cycle_count_t benchSleep = sleepCycles;
+
+  std::map<unsigned int, Stats> stats;
+  int failures = 0;
+  for(size_t i=0; i<steps.size(); ++i)
+  {
+    Step & step = steps[i];
+    if(step.port < 0)
+    {
+      runUntil(avr->cycle + step.idleMs * msCycles);
+      continue;
+    }
+    if(step.port >= (int)links.size())
+    {
+      fprintf(stderr, "line %d: this firmware has %d ports\n", step.line, (int)links.size());
+      return 2;
+    }
+
+    Link * pLink = links[step.port];
+    size_t mark = pLink->tx_.size();
+    avr_cycle_count_t startSleep = sleepCycles;
+    Sender sender;
+    sender.pLink = pLink;
+    sender.bytes = step.request;
+    sender.next = 0;
+    sender.start = avr->cycle + 1;
+    sender.endCycle = bitCycle(sender.start, step.request.size() * 10);
+    avr_cycle_timer_register(avr, 1, sendByte, &sender);
+    runUntil(sender.endCycle);
+    runUntil(sender.endCycle + settleMs * msCycles, pLink, mark,
+             step.hasReply ? step.reply.size() : 0);
+
+    std::vector<byte> reply;
+    for(size_t b=mark; b<pLink->tx_.size(); ++b)
+      reply.push_back(pLink->tx_[b].value);
+    avr_cycle_count_t replyCycles = reply.empty() ? 0 :
+                                    pLink->tx_[mark].cycle - sender.endCycle;
+    avr_cycle_count_t busyCycles = (avr->cycle - sender.start) - (sleepCycles - startSleep);
+
+    unsigned int funcCode = step.request.size() >= 8 ?
+                            step.request[6] | step.request[7] << 8 : 0;
+    const Budget & budget = budgetFor(funcCode);
+    Stats & s = stats[budget.funcCode ? funcCode : 0];
+    ++s.count;
+    if(!reply.empty())
+    {
+      ++s.replies;
+      s.totalCycles += replyCycles;
+    }
+    if(replyCycles > s.worstCycles)
+      s.worstCycles = replyCycles;
+    if(busyCycles > s.worstBusy)
+      s.worstBusy = busyCycles;
+
+    unsigned long replyUs = avr_cycles_to_usec(avr, replyCycles);
+    if(replyUs > (budgetUs >= 0 ? (unsigned long)budgetUs : budget.us))
+    {
+      ++s.over;
+      ++failures;
+      fprintf(stderr, "line %d: %s replied after %llu cycles, %lu us\n", step.line,
+              budget.name, (unsigned long long)replyCycles, replyUs);
+    }
+    if(reply != step.reply)
+    {
+      ++s.mismatches;
+      ++failures;
+      fprintf(stderr, "line %d: %s reply differs\n  expected: %s\n  got:      %s\n",
+              step.line, budget.name, toHex(step.reply).c_str(), toHex(reply).c_str());
+    }
+  }
+
+  fprintf(stderr, "%-18s %6s %12s %12s %10s %12s %6s %10s\n", "command", "count",
+          "mean cycles", "worst cycles", "worst us", "worst busy", "over", "mismatch");
+  for(std::map<unsigned int, Stats>::iterator it=stats.begin(); it!=stats.end(); ++it)
+  {
+    const Stats & s = it->second;
+    fprintf(stderr, "%-18s %6d %12llu %12llu %10llu %12llu %6d %10d\n",
+            budgetFor(it->first).name, s.count,
+            (unsigned long long)(s.replies ? s.totalCycles / s.replies : 0),
+            (unsigned long long)s.worstCycles,
+            (unsigned long long)avr_cycles_to_usec(avr, s.worstCycles),
+            (unsigned long long)s.worstBusy, s.over, s.mismatches);
+  }
+
+  avr_cycle_count_t total = avr->cycle - benchStart;
+  avr_cycle_count_t slept = sleepCycles - benchSleep;
+  fprintf(stderr, "\n%s at %lu Hz: %llu cycles, %llu busy (%.1f%%), %llu asleep\n",
+          firmware.mmcu, (unsigned long)avr->frequency, (unsigned long long)total,
+          (unsigned long long)(total - slept), total ? 100.0 * (total - slept) / total : 0.0,
+          (unsigned long long)slept);
+  return failures ? 1 : 0;
+}
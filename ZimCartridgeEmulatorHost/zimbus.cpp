@@ -0,0 +1,372 @@
+// Zim Cartridge Emulator Link Simulator
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// The MegaLCD sketch's master/slave link, see Link.h, on a simulated I2C
+// bus in virtual time. Each slave runs two Rfid ports the way its sketch
+// does, fed a Zim that polls the tag and now and then writes a new used
+// length. A LinkMaster keeps mirrors of every port, as the master board
+// does for its menu and console.
+//
+//   zimbus [-n slaves] [-t seconds] [-w ms]
+//
+// Runs 1, 2, 4 ... up to -n slaves, each with dirty bit polling and with
+// full dumps, and prints the bus traffic of each at LINK_CLOCK_HZ. Every
+// run then checks that the mirrors match the slaves once the Zims stop, that
+// an edit on the master reaches the slave, that one made while the slave's
+// Zim writes the tag keeps both, and that a save and reload of a mirror goes
+// through LinkStorage to the slave's storage. Exits 1 if a check fails.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include <Arduino.h>
+#include "Rfid.h"
+#include "Storage.h"
+#include "FramePool.h"
+#include "Link.h"
+
+#define ZIMBUS_ZIM_POLL_MS    250   // a Zim's request and readData pair
+#define ZIMBUS_FRAME_GAP_MS   5     // between the frames of a poll or a write
+#define ZIMBUS_LINK_TASK_MS   10    // the slave sketch's link task period
+#define ZIMBUS_USED_STEP      100   // mm of filament per tag write
+#define ZIMBUS_SETTLE_MS      (2 * LINK_STATS_MS + 2 * LINK_POLL_MS)
+
+static void usage()
+{
+  fprintf(stderr, "usage: zimbus [-n slaves] [-t seconds] [-w ms]\n"
+                  "  -n     most slaves, up to %d, default 8\n"
+                  "  -t     seconds of Zim traffic per run, default 60\n"
+                  "  -w     msecs between tag writes per port, default 3000\n",
+                  LINK_SLAVES);
+  exit(2);
+}
+
+/// A slave board: its ports, storage and link end
+struct Slave
+{
+  Slave(int index);
+  ~Slave();
+
+  HardwareSerial    serial[LINK_PORTS];
+  byte              eeprom[LINK_STORAGE_SIZE];
+  RamStorage        storage;
+  byte              frameBuffers[FRAME_POOL_SIZE * FRAME_BUFFER_SIZE];
+  FramePool         pool;
+  Rfid *            pRfid[LINK_PORTS];
+  LinkSlave *       pLink;
+};
+
+Slave::Slave(int index) :
+                                storage(eeprom, sizeof(eeprom)),
+                                pool(frameBuffers, FRAME_POOL_SIZE, FRAME_POOL_RESERVE)
+{
+  memset(eeprom, 0xFF, sizeof(eeprom));
+  for(int port=0; port<LINK_PORTS; ++port)
+  {
+    char name[32];
+    snprintf(name, sizeof(name), "slave %d port %d", index, port);
+    serial[port].begin(RFID_BAUD_RATE);
+    pRfid[port] = new Rfid(name, port, &serial[port],
+                           Cartridge(port & 1 ? CARTRIDGE_ID_RIGHT : CARTRIDGE_ID_LEFT,
+                                     port & 1 ? CARTRIDGE_RIGHT_EEPROM_LOC : CARTRIDGE_LEFT_EEPROM_LOC,
+                                     &storage),
+                           &pool);
+    pRfid[port]->loadCartridgeData();
+  }
+  pLink = new LinkSlave(pRfid, LINK_PORTS, &storage);
+}
+
+Slave::~Slave()
+{
+  delete pLink;
+  for(int port=0; port<LINK_PORTS; ++port)
+    delete pRfid[port];
+}
+
+/// The bus with the slaves on it. A slave's loop applies the master's
+/// writes between transfers, the way its link task would.
+class SimBus : public LinkBus
+{
+public:
+  SimBus(std::vector<Slave *> & slaves) : slaves_(slaves)  {}
+
+  bool transmit(byte address, const byte * pdata, int len)
+  {
+    LinkSlave * pLink = slave(address);
+    if(pLink == NULL)
+      return false;
+    pLink->onReceive(pdata, len);
+    return true;
+  }
+
+  int receive(byte address, byte * pdata, int len)
+  {
+    LinkSlave * pLink = slave(address);
+    if(pLink == NULL)
+      return 0;
+    byte reply[LINK_MAX_FRAME];
+    int got = pLink->onRequest(reply);
+    if(got > len)
+      got = len;
+    memcpy(pdata, reply, got);
+    return got;
+  }
+
+private:
+  LinkSlave * slave(byte address)
+  {
+    int index = address - LINK_FIRST_ADDRESS;
+    if(index < 0 || index >= (int)slaves_.size())
+      return NULL;
+    LinkSlave * pLink = slaves_[index]->pLink;
+    if(pLink->isReady())
+      pLink->runFsm();
+    return pLink;
+  }
+
+  std::vector<Slave *> & slaves_;
+};
+
+// One Zim request frame, see Rfid.h
+static void inject(HardwareSerial & serial, unsigned int funcCode,
+                   const byte * pdata, int len, uint64_t atUs)
+{
+  std::vector<byte> req;
+  req.push_back(0xAA);
+  req.push_back(0xBB);
+  req.push_back((len + 5) & 0xFF);
+  req.push_back((len + 5) >> 8);
+  req.push_back(0);
+  req.push_back(0);
+  req.push_back(funcCode & 0xFF);
+  req.push_back(funcCode >> 8);
+  req.insert(req.end(), pdata, pdata + len);
+  byte xorVal = 0;
+  for(size_t i=4; i<req.size(); ++i)
+    xorVal ^= req[i];
+  req.push_back(xorVal);
+  serial.inject(&req[0], req.size(), atUs);
+}
+
+// The tag write of a Zim that has used ZIMBUS_USED_STEP more filament
+static void injectWrite(Rfid * pRfid, uint64_t atUs)
+{
+  byte image[CARTRIDGE_DATA_LENGTH];
+  uint32_t usedLen = pRfid->cartridge_.data_.usedLen_ + ZIMBUS_USED_STEP;
+  pRfid->buildCartridgePayload(image);
+  image[8] = (image[8] & 0xF0) | ((usedLen >> 16) & 0x0F);
+  image[9] = (usedLen >> 8) & 0xFF;
+  image[10] = usedLen & 0xFF;
+  image[CARTRIDGE_DATA_LENGTH - 1] = 0;
+  for(int i=0; i<CARTRIDGE_DATA_LENGTH - 1; ++i)
+    image[CARTRIDGE_DATA_LENGTH - 1] ^= image[i];
+
+  for(int page=STAGE_FIRST_PAGE; page<=STAGE_LAST_PAGE; ++page)
+  {
+    byte req[5];
+    req[0] = page;
+    memcpy(&req[1], &image[(page - STAGE_FIRST_PAGE) * 4], 4);
+    inject(*pRfid->serial_, RfidCommand::writeData, req, sizeof(req),
+           atUs + (page - STAGE_FIRST_PAGE) * ZIMBUS_FRAME_GAP_MS * 1000ULL);
+  }
+}
+
+// Runs the slaves' ports and link tasks and the master's link task for ms,
+// with the Zims sending if zim is set
+static void run(std::vector<Slave *> & slaves, LinkMaster & master,
+                unsigned long ms, bool zim, unsigned long writeMs)
+{
+  for(unsigned long step=0; step<ms; ++step)
+  {
+    unsigned long nowMs = millis();
+    for(size_t s=0; s<slaves.size(); ++s)
+    {
+      Slave * pSlave = slaves[s];
+      for(int port=0; port<LINK_PORTS; ++port)
+      {
+        Rfid * pRfid = pSlave->pRfid[port];
+        // The Zims aren't in step with each other
+        unsigned long phaseMs = nowMs + 37 * (s * LINK_PORTS + port);
+        if(zim && phaseMs % ZIMBUS_ZIM_POLL_MS == 0)
+        {
+          byte page = STAGE_FIRST_PAGE;
+          inject(*pRfid->serial_, RfidCommand::request, NULL, 0, Hal::nowUs);
+          inject(*pRfid->serial_, RfidCommand::readData, &page, 1,
+                 Hal::nowUs + ZIMBUS_FRAME_GAP_MS * 1000ULL);
+        }
+        if(zim && phaseMs % writeMs == writeMs / 2)
+        {
+          injectWrite(pRfid, Hal::nowUs + 2 * ZIMBUS_FRAME_GAP_MS * 1000ULL);
+        }
+        while(pRfid->isReady())
+          pRfid->runFsm();
+        pRfid->serial_->tx_.clear();
+      }
+      if(nowMs % ZIMBUS_LINK_TASK_MS == s % ZIMBUS_LINK_TASK_MS || pSlave->pLink->isReady())
+        pSlave->pLink->runFsm();
+    }
+    if(master.isReady())
+      master.runFsm();
+    Hal::advance(1000, HalCost::idle);
+  }
+}
+
+// Tag image and first response of a port
+static bool samePort(Rfid * pMirror, Rfid * pRfid)
+{
+  byte mirror[CARTRIDGE_DATA_LENGTH];
+  byte slave[CARTRIDGE_DATA_LENGTH];
+  pMirror->buildCartridgePayload(mirror);
+  pRfid->buildCartridgePayload(slave);
+  return pMirror->cartridge_.data_.id_ == pRfid->cartridge_.data_.id_ &&
+         memcmp(mirror, slave, sizeof(mirror)) == 0 &&
+         pMirror->firstResponse_ == pRfid->firstResponse_ &&
+         pMirror->stats_.requests_ == pRfid->stats_.requests_ &&
+         pMirror->stats_.bytesIn_ == pRfid->stats_.bytesIn_ &&
+         pMirror->stats_.errors() == pRfid->stats_.errors();
+}
+
+static const char * check(bool ok, int & failures)
+{
+  if(!ok)
+    ++failures;
+  return ok ? "ok" : "FAIL";
+}
+
+// One run, returns the failed checks
+static int run(int numSlaves, bool fullDumps, unsigned long seconds, unsigned long writeMs)
+{
+  std::vector<Slave *> slaves;
+  for(int s=0; s<numSlaves; ++s)
+    slaves.push_back(new Slave(s));
+  SimBus bus(slaves);
+
+  std::vector<LinkStorage> storage(numSlaves);
+  std::vector<Rfid *> mirrors;
+  for(int index=0; index<numSlaves * LINK_PORTS; ++index)
+  {
+    bool right = index & 1;
+    mirrors.push_back(new Rfid("mirror", index, NULL,
+                               Cartridge(right ? CARTRIDGE_ID_RIGHT : CARTRIDGE_ID_LEFT,
+                                         right ? CARTRIDGE_RIGHT_EEPROM_LOC : CARTRIDGE_LEFT_EEPROM_LOC,
+                                         &storage[index / LINK_PORTS]),
+                               NULL));
+  }
+  LinkMaster master(&bus, &mirrors[0], mirrors.size());
+  for(int s=0; s<numSlaves; ++s)
+    storage[s].attach(&master, s);
+  master.fullDumps_ = fullDumps;
+
+  uint64_t startUs = Hal::nowUs;
+  run(slaves, master, seconds * 1000, true, writeMs);
+  double runSeconds = (Hal::nowUs - startUs) / 1e6;
+  unsigned long bytes = master.bytes_;
+  unsigned long busUs = master.busUs_;
+  unsigned long polls = master.polls_;
+  unsigned int errors = master.errors_;
+
+  int failures = 0;
+  run(slaves, master, ZIMBUS_SETTLE_MS, false, writeMs);
+  bool same = true;
+  for(size_t index=0; index<mirrors.size(); ++index)
+    same = same && samePort(mirrors[index], slaves[index / LINK_PORTS]->pRfid[index % LINK_PORTS]);
+  const char * mirrorsOk = check(same, failures);
+
+  // An edit on the master, as the menu or the console makes it
+  Rfid * pEdited = mirrors[0];
+  pEdited->cartridge_.data_.usedLen_ += 12345;
+  run(slaves, master, 2 * LINK_POLL_MS, false, writeMs);
+  const char * editOk = check(samePort(pEdited, slaves[0]->pRfid[0]), failures);
+
+  // Another edit on the master while the slave's Zim writes the tag, before
+  // the master has polled either
+  Rfid * pZim = slaves[0]->pRfid[0];
+  byte tempPrint = pEdited->cartridge_.data_.tempPrint_ + 5;
+  long usedLen = pZim->cartridge_.data_.usedLen_ + ZIMBUS_USED_STEP;
+  pEdited->cartridge_.data_.tempPrint_ = tempPrint;
+  injectWrite(pZim, Hal::nowUs);
+  for(int ms=0; ms<(STAGE_LAST_PAGE - STAGE_FIRST_PAGE + 2) * ZIMBUS_FRAME_GAP_MS; ++ms)
+  {
+    while(pZim->isReady())
+      pZim->runFsm();
+    pZim->serial_->tx_.clear();
+    Hal::advance(1000, HalCost::idle);
+  }
+  run(slaves, master, 2 * LINK_POLL_MS, false, writeMs);
+  const char * raceOk = check(pZim->cartridge_.data_.usedLen_ == usedLen &&
+                              pZim->cartridge_.data_.tempPrint_ == tempPrint &&
+                              pEdited->cartridge_.data_.usedLen_ == usedLen &&
+                              pEdited->cartridge_.data_.tempPrint_ == tempPrint, failures);
+
+  // Saved over the link, the slave reloads what the master saved
+  Rfid * pSaved = mirrors[mirrors.size() - 1];
+  Slave * pOwner = slaves[numSlaves - 1];
+  unsigned long commits = pOwner->storage.commits_;
+  pSaved->saveCartridgeData();
+  run(slaves, master, LINK_POLL_MS, false, writeMs);
+  CartridgeData saved = pSaved->cartridge_.data_;
+  bool reloaded = pOwner->storage.commits_ > commits &&
+                  pOwner->pRfid[LINK_PORTS - 1]->loadCartridgeData() &&
+                  memcmp(&pOwner->pRfid[LINK_PORTS - 1]->cartridge_.data_, &saved, sizeof(saved)) == 0 &&
+                  pSaved->loadCartridgeData() &&
+                  memcmp(&pSaved->cartridge_.data_, &saved, sizeof(saved)) == 0;
+  const char * saveOk = check(reloaded, failures);
+
+  printf("%6d  %-7s %11.0f %10.0f %8.2f%% %8.1f %7u  %-7s %-5s %-5s %s\n",
+         numSlaves, fullDumps ? "full" : "dirty", bytes / runSeconds,
+         busUs / runSeconds, busUs / runSeconds / 1e4, polls / runSeconds,
+         errors, mirrorsOk, editOk, raceOk, saveOk);
+
+  for(size_t index=0; index<mirrors.size(); ++index)
+    delete mirrors[index];
+  for(int s=0; s<numSlaves; ++s)
+    delete slaves[s];
+  return failures;
+}
+
+int main(int argc, char ** argv)
+{
+  int maxSlaves = 8;
+  unsigned long seconds = 60;
+  unsigned long writeMs = 3000;
+  int opt;
+  while((opt = getopt(argc, argv, "n:t:w:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'n': maxSlaves = atoi(optarg); break;
+      case 't': seconds = strtoul(optarg, NULL, 0); break;
+      case 'w': writeMs = strtoul(optarg, NULL, 0); break;
+      default:  usage();
+    }
+  }
+  if(optind != argc || maxSlaves <= 0 || maxSlaves > LINK_SLAVES ||
+     seconds == 0 || writeMs < 4 * ZIMBUS_FRAME_GAP_MS)
+    usage();
+
+  printf("LINK_CLOCK_HZ %d, a summary poll of each slave every %d ms\n",
+         LINK_CLOCK_HZ, LINK_POLL_MS);
+  printf("slaves  polling   bytes/s    bus us/s     util  polls/s  errors  mirrors edit  race  save\n");
+  int failures = 0;
+  for(int numSlaves=1; ; numSlaves*=2)
+  {
+    if(numSlaves > maxSlaves)
+      numSlaves = maxSlaves;
+    failures += run(numSlaves, false, seconds, writeMs);
+    failures += run(numSlaves, true, seconds, writeMs);
+    if(numSlaves == maxSlaves)
+      break;
+  }
+  return failures == 0 ? 0 : 1;
+}
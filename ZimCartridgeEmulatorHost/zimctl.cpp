@@ -0,0 +1,582 @@
+// Zim Cartridge Emulator Control
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// Host side of the binary console (see Console.h in the MegaLCD sketch).
+//
+//   zimctl -d /dev/ttyACM0 [-d /dev/ttyACM1 ...] <command> [args]
+//
+//   info
+//   get <port|all>
+//   set <port|all> field=value ...
+//   save|reload|reset <port|all>
+//   provision <profile>
+//   power [reset]
+//   watchdog [reset]
+//   tasks [reset]
+//   telemetry [reset]
+//   history
+//   memory
+//   cadence [reset]
+//   pool [reset]
+//   stats [reset]
+//   link [reset]
+//
+// Fields: id, magic, type, material, color, rgb, init, used, temp, tempfirst,
+// date. Lengths are in mm, or metres with an 'm' suffix. Temperatures are in
+// degrees C. A provision profile holds one "<port|all> field=value ..." line
+// per port, each port is written and saved to eeprom. All devices are served
+// in parallel.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ZimConsole.h"
+#include "ZimBudgets.h"
+
+static std::mutex outputMutex;
+
+static void report(const std::string & device, const std::string & text)
+{
+  std::lock_guard<std::mutex> lock(outputMutex);
+  printf("%s: %s\n", device.c_str(), text.c_str());
+}
+
+static void usage()
+{
+  fprintf(stderr,
+          "usage: zimctl -d device [-d device ...] <command> [args]\n"
+          "  info\n"
+          "  get <port|all>\n"
+          "  set <port|all> field=value ...\n"
+          "  save|reload|reset <port|all>\n"
+          "  provision <profile>\n"
+          "  power [reset]\n"
+          "  watchdog [reset]\n"
+          "  tasks [reset]\n"
+          "  telemetry [reset]\n"
+          "  history\n"
+          "  memory\n"
+          "  cadence [reset]\n"
+          "  pool [reset]\n"
+          "  stats [reset]\n"
+          "  link [reset]\n");
+  exit(2);
+}
+
+// Applies "field=value" assignments to a cartridge
+static bool applyFields(ZimCartridge & cartridge,
+                        const std::vector<std::string> & fields,
+                        std::string & error)
+{
+  for(size_t i=0; i<fields.size(); ++i)
+  {
+    size_t eq = fields[i].find('=');
+    if(eq == std::string::npos ||
+       !cartridge.set(fields[i].substr(0, eq), fields[i].substr(eq + 1)))
+    {
+      error = "bad field: " + fields[i];
+      return false;
+    }
+  }
+  return true;
+}
+
+struct Job
+{
+  std::string               port;   // port index or "all"
+  std::vector<std::string>  fields;
+};
+
+// Runs a command against every port selected by job.port
+static bool runJob(ZimConsole & console, const std::string & command,
+                   const Job & job, int numPorts)
+{
+  int first = 0;
+  int last = numPorts - 1;
+  if(job.port != "all")
+  {
+    char * end = NULL;
+    first = last = strtol(job.port.c_str(), &end, 0);
+    if(*end != '\0' || first < 0 || first >= numPorts)
+    {
+      report(console.device(), "bad port " + job.port);
+      return false;
+    }
+  }
+
+  for(int port=first; port<=last; ++port)
+  {
+    std::string prefix = "port " + std::to_string(port) + ": ";
+    ZimCartridge cartridge;
+    std::string error;
+
+    if(command == "get")
+    {
+      if(!console.getCartridge(port, cartridge))
+      {
+        report(console.device(), prefix + console.error());
+        return false;
+      }
+      report(console.device(), prefix + cartridge.toString());
+    }
+    else if(command == "set" || command == "provision")
+    {
+      if(!console.getCartridge(port, cartridge))
+      {
+        report(console.device(), prefix + console.error());
+        return false;
+      }
+      if(!applyFields(cartridge, job.fields, error))
+      {
+        report(console.device(), prefix + error);
+        return false;
+      }
+      if(!console.setCartridge(port, cartridge) ||
+         (command == "provision" &&
+          !console.simple(ZimCommand::save, port)))
+      {
+        report(console.device(), prefix + console.error());
+        return false;
+      }
+      report(console.device(), prefix + cartridge.toString());
+    }
+    else
+    {
+      byte cmd = command == "save"   ? ZimCommand::save :
+                 command == "reload" ? ZimCommand::reload :
+                                       ZimCommand::reset;
+      if(!console.simple(cmd, port))
+      {
+        report(console.device(), prefix + console.error());
+        return false;
+      }
+      report(console.device(), prefix + command + " ok");
+    }
+  }
+  return true;
+}
+
+static void runDevice(const std::string & device, const std::string & command,
+                      const std::vector<Job> & jobs, bool * pResult)
+{
+  ZimConsole console(device);
+  ZimConsole::Info info;
+  *pResult = false;
+
+  if(!console.open() || !console.waitReady(info))
+  {
+    report(device, console.error());
+    return;
+  }
+
+  if(command == "info")
+  {
+    char text[96];
+    snprintf(text, sizeof(text), "console v%d.%d, %d ports, up %lu ms",
+             info.major, info.minor, info.ports, (unsigned long)info.uptime);
+    report(device, text);
+    for(size_t i=0; i<info.firstResponse.size(); ++i)
+    {
+      if(info.firstResponse[i] == 0)
+        snprintf(text, sizeof(text), "port %d: no response sent yet", (int)i);
+      else
+        snprintf(text, sizeof(text), "port %d: first response after %lu ms",
+                 (int)i, info.firstResponse[i]);
+      report(device, text);
+    }
+    *pResult = true;
+    return;
+  }
+
+  if(command == "power")
+  {
+    std::vector<byte> request(1, jobs.empty() ? 0 : 1);
+    std::vector<byte> reply;
+    if(!console.transact(ZimCommand::power, 0, request, reply) || reply.size() < 24)
+    {
+      report(device, "power: " + console.error());
+      return;
+    }
+    unsigned long window = zimGet(reply, 0, 4);
+    unsigned long asleep = zimGet(reply, 4, 4);
+    char text[200];
+    snprintf(text, sizeof(text),
+             "asleep %lu of %lu ms (%lu%%), %lu sleeps, %lu work wakes, "
+             "max service %lu us, wake latency max %lu mean %lu us, est. %lu.%03lu mA",
+             asleep, window, window ? asleep * 100 / window : 0,
+             zimGet(reply, 8, 4), zimGet(reply, 12, 4), zimGet(reply, 16, 2),
+             zimGet(reply, 20, 2), zimGet(reply, 22, 2),
+             zimGet(reply, 18, 2) / 1000, zimGet(reply, 18, 2) % 1000);
+    report(device, text);
+    *pResult = true;
+    return;
+  }
+
+  if(command == "watchdog")
+  {
+    static const char * Names[] = { "none", "rfidLeft", "rfidRight", "menu",
+                                    "console", "persistence", "logging", "telemetry",
+                                    "link" };
+    std::vector<byte> request(1, jobs.empty() ? 0 : 1);
+    std::vector<byte> reply;
+    if(!console.transact(ZimCommand::watchdog, 0, request, reply) || reply.size() < 9)
+    {
+      report(device, "watchdog: " + console.error());
+      return;
+    }
+    char text[160];
+    byte subsystem = reply[1];
+    snprintf(text, sizeof(text),
+             "%s: %s stalled for %lu ms at %lu ms uptime, %d resets since power up",
+             reply[0] ? "last reset was a stall" : "no stall at last reset",
+             subsystem < 9 ? Names[subsystem] : "?",
+             zimGet(reply, 6, 2), zimGet(reply, 2, 4), reply[8]);
+    report(device, text);
+    for(size_t i=9, s=1; i+4<=reply.size(); i+=4, ++s)
+    {
+      snprintf(text, sizeof(text), "%-12s %5lu deadline misses, worst %lu ms",
+               s < 9 ? Names[s] : "?", zimGet(reply, i, 2), zimGet(reply, i+2, 2));
+      report(device, text);
+    }
+    *pResult = true;
+    return;
+  }
+
+  if(command == "tasks")
+  {
+    static const char * Priorities[] = { "realtime", "normal", "slack" };
+    std::vector<byte> request(1, jobs.empty() ? 0 : 1);
+    std::vector<byte> reply;
+    for(int task=0; console.transact(ZimCommand::tasks, task, request, reply); ++task)
+    {
+      if(reply.size() < 19)
+        break;
+      char text[200];
+      snprintf(text, sizeof(text),
+               "%-12s %-8s %10lu runs, %5lu deadline misses (%lu us), max late %lu us, "
+               "mean run %lu us, %lu deferrals",
+               std::string(reply.begin() + 19, reply.end()).c_str(),
+               reply[0] < 3 ? Priorities[reply[0]] : "?",
+               zimGet(reply, 1, 4), zimGet(reply, 5, 2), zimGet(reply, 11, 4),
+               zimGet(reply, 7, 4), zimGet(reply, 15, 2), zimGet(reply, 17, 2));
+      report(device, text);
+    }
+    *pResult = true;
+    return;
+  }
+
+  if(command == "telemetry")
+  {
+    std::vector<byte> request(1, jobs.empty() ? 0 : 1);
+    std::vector<byte> reply;
+    for(int port=0; port<info.ports; ++port)
+    {
+      if(!console.transact(ZimCommand::telemetry, port, request, reply) || reply.size() < 19)
+      {
+        report(device, "telemetry: " + console.error());
+        return;
+      }
+      char text[160];
+      if(reply[0])
+        snprintf(text, sizeof(text),
+                 "port %d: printing, %lu mm in %lu s, %lu mm/min (peak %lu), "
+                 "%lu mm in %lu jobs",
+                 port, zimGet(reply, 1, 4), zimGet(reply, 5, 4), zimGet(reply, 9, 2),
+                 zimGet(reply, 11, 2), zimGet(reply, 13, 4), zimGet(reply, 17, 2));
+      else
+        snprintf(text, sizeof(text), "port %d: idle, %lu mm in %lu jobs",
+                 port, zimGet(reply, 13, 4), zimGet(reply, 17, 2));
+      report(device, text);
+    }
+    *pResult = true;
+    return;
+  }
+
+  if(command == "cadence")
+  {
+    std::vector<byte> request(1, jobs.empty() ? 0 : 1);
+    std::vector<byte> reply;
+    for(int port=0; port<info.ports; ++port)
+    {
+      if(!console.transact(ZimCommand::cadence, port, request, reply) || reply.size() < 22)
+      {
+        report(device, "cadence: " + console.error());
+        return;
+      }
+      unsigned long hits = zimGet(reply, 6, 4);
+      unsigned long misses = zimGet(reply, 10, 4);
+      unsigned long prestaged = zimGet(reply, 14, 4);
+      unsigned long saved = zimGet(reply, 18, 4);
+      char text[200];
+      int n = snprintf(text, sizeof(text), "port %d: %lu hits, %lu misses (%lu%%), "
+                       "%lu prestaged replies, %lu us saved (%lu us each), ",
+                       port, hits, misses, hits + misses ? hits * 100 / (hits + misses) : 0,
+                       prestaged, saved, prestaged ? saved / prestaged : 0);
+      unsigned long until = zimGet(reply, 2, 4);
+      if(zimGet(reply, 0, 2) == 0)
+        snprintf(text + n, sizeof(text) - n, "nothing expected");
+      else if(until == 0xFFFFFFFFUL)
+        snprintf(text + n, sizeof(text) - n, "expecting %04lx, overdue", zimGet(reply, 0, 2));
+      else
+        snprintf(text + n, sizeof(text) - n, "expecting %04lx in %lu us",
+                 zimGet(reply, 0, 2), until);
+      report(device, text);
+    }
+    *pResult = true;
+    return;
+  }
+
+  if(command == "pool")
+  {
+    std::vector<byte> request(1, jobs.empty() ? 0 : 1);
+    std::vector<byte> reply;
+    if(!console.transact(ZimCommand::pool, 0, request, reply) || reply.size() < 8)
+    {
+      report(device, "pool: " + console.error());
+      return;
+    }
+    char text[160];
+    snprintf(text, sizeof(text),
+             "%d frame buffers of %d bytes, %d in use, peak %d, %lu failed acquires, "
+             "%d bytes reclaimed",
+             reply[0], reply[1], reply[2], reply[3], zimGet(reply, 4, 2),
+             (int)(int16_t)zimGet(reply, 6, 2));
+    report(device, text);
+    *pResult = true;
+    return;
+  }
+
+  if(command == "link")
+  {
+    std::vector<byte> request(1, jobs.empty() ? 0 : 1);
+    std::vector<byte> reply;
+    if(!console.transact(ZimCommand::link, 0, request, reply) || reply.size() < 19)
+    {
+      report(device, "link: " + console.error());
+      return;
+    }
+    int slaves = reply[0];
+    unsigned long online = zimGet(reply, 1, 4);
+    int answering = 0;
+    for(int slave=0; slave<slaves; ++slave)
+    {
+      if(online & (1UL << slave))
+        ++answering;
+    }
+    char text[160];
+    snprintf(text, sizeof(text),
+             "%d of %d slaves answering, %lu polls, %lu bus bytes, %lu us on the bus, "
+             "%lu errors",
+             answering, slaves, zimGet(reply, 5, 4), zimGet(reply, 9, 4),
+             zimGet(reply, 13, 4), zimGet(reply, 17, 2));
+    report(device, text);
+    *pResult = true;
+    return;
+  }
+
+  if(command == "stats")
+  {
+    std::vector<byte> request(1, jobs.empty() ? 0 : 1);
+    std::vector<byte> reply;
+    for(int port=0; port<info.ports; ++port)
+    {
+      // frames first, a reset clears them too
+      std::string frames;
+      for(int index=0, count=1; index<count; ++index)
+      {
+        if(!console.transact(ZimCommand::portFrames, port, std::vector<byte>(1, index), reply) ||
+           reply.size() < 7)
+        {
+          report(device, "stats: " + console.error());
+          return;
+        }
+        count = reply[0];
+        unsigned long requests = zimGet(reply, 3, 4);
+        if(requests != 0)
+        {
+          char text[64];
+          snprintf(text, sizeof(text), ", %s %lu",
+                   budgetFor(zimGet(reply, 1, 2)).name, requests);
+          frames += text;
+        }
+      }
+      if(!console.transact(ZimCommand::portStats, port, request, reply) || reply.size() < 26)
+      {
+        report(device, "stats: " + console.error());
+        return;
+      }
+      char text[240];
+      snprintf(text, sizeof(text),
+               "port %d: %lu requests, %lu bytes in, %lu bytes out, %lu timeouts, "
+               "%lu bad xor, %lu oversize, %lu resyncs, %lu unhandled, "
+               "%lu us mean, %lu us max%s",
+               port, zimGet(reply, 0, 4), zimGet(reply, 4, 4), zimGet(reply, 8, 4),
+               zimGet(reply, 12, 2), zimGet(reply, 14, 2), zimGet(reply, 16, 2),
+               zimGet(reply, 18, 2), zimGet(reply, 20, 2), zimGet(reply, 22, 2),
+               zimGet(reply, 24, 2), frames.c_str());
+      report(device, text);
+    }
+    *pResult = true;
+    return;
+  }
+
+  if(command == "history")
+  {
+    std::vector<byte> reply;
+    for(int index=0; console.transact(ZimCommand::history, index,
+                                      std::vector<byte>(), reply); ++index)
+    {
+      if(reply.size() < 15)
+        break;
+      char text[160];
+      snprintf(text, sizeof(text),
+               "job %5lu port %d: %8lu mm in %7lu s, avg %5lu mm/min, peak %5lu mm/min",
+               zimGet(reply, 0, 2), reply[2], zimGet(reply, 3, 4), zimGet(reply, 7, 4),
+               zimGet(reply, 11, 2), zimGet(reply, 13, 2));
+      report(device, text);
+    }
+    *pResult = true;
+    return;
+  }
+
+  if(command == "memory")
+  {
+    std::vector<byte> reply;
+    if(!console.transact(ZimCommand::memory, 0, std::vector<byte>(), reply) || reply.size() < 19)
+    {
+      report(device, "memory: " + console.error());
+      return;
+    }
+    char text[160];
+    snprintf(text, sizeof(text), "ram %lu bytes, static %lu, free %lu now, %lu never used",
+             zimGet(reply, 0, 2), zimGet(reply, 2, 2), zimGet(reply, 15, 2), zimGet(reply, 17, 2));
+    report(device, text);
+    snprintf(text, sizeof(text), "stack %lu bytes, high-water %lu",
+             zimGet(reply, 11, 2), zimGet(reply, 13, 2));
+    report(device, text);
+    snprintf(text, sizeof(text), "heap %lu bytes, %lu free in %d blocks, largest %lu",
+             zimGet(reply, 4, 2), zimGet(reply, 6, 2), reply[10], zimGet(reply, 8, 2));
+    report(device, text);
+    *pResult = true;
+    return;
+  }
+
+  for(size_t i=0; i<jobs.size(); ++i)
+  {
+    if(!runJob(console, command, jobs[i], info.ports))
+      return;
+  }
+  *pResult = true;
+}
+
+static bool readProfile(const char * path, std::vector<Job> & jobs)
+{
+  std::ifstream in(path);
+  if(!in)
+  {
+    fprintf(stderr, "zimctl: can't open %s\n", path);
+    return false;
+  }
+
+  std::string line;
+  while(std::getline(in, line))
+  {
+    size_t hash = line.find('#');
+    if(hash != std::string::npos)
+      line.erase(hash);
+
+    std::istringstream words(line);
+    Job job;
+    if(!(words >> job.port))
+      continue;
+    std::string field;
+    while(words >> field)
+      job.fields.push_back(field);
+    jobs.push_back(job);
+  }
+  return true;
+}
+
+int main(int argc, char ** argv)
+{
+  std::vector<std::string> devices;
+  int opt;
+  while((opt = getopt(argc, argv, "d:")) != -1)
+  {
+    if(opt == 'd')
+      devices.push_back(optarg);
+    else
+      usage();
+  }
+  if(devices.empty() || optind >= argc)
+    usage();
+
+  std::string command = argv[optind++];
+  std::vector<Job> jobs;
+  if(command == "provision")
+  {
+    if(optind >= argc || !readProfile(argv[optind], jobs))
+      usage();
+  }
+  else if(command == "get" || command == "set" || command == "save" ||
+          command == "reload" || command == "reset")
+  {
+    if(optind >= argc)
+      usage();
+    Job job;
+    job.port = argv[optind++];
+    while(optind < argc)
+      job.fields.push_back(argv[optind++]);
+    jobs.push_back(job);
+  }
+  else if(command == "power" || command == "watchdog" || command == "tasks" ||
+          command == "telemetry" || command == "cadence" || command == "pool" ||
+          command == "stats" || command == "link")
+  {
+    if(optind < argc && std::string(argv[optind]) == "reset")
+      jobs.push_back(Job());
+  }
+  else if(command != "info" && command != "history" && command != "memory")
+  {
+    usage();
+  }
+
+  // Each board resets when its port is opened, so serve them in parallel
+  std::vector<std::thread> threads;
+  bool * results = new bool[devices.size()];
+  for(size_t i=0; i<devices.size(); ++i)
+  {
+    threads.push_back(std::thread(runDevice, devices[i], command, jobs, &results[i]));
+  }
+
+  int failed = 0;
+  for(size_t i=0; i<threads.size(); ++i)
+  {
+    threads[i].join();
+    failed += results[i] ? 0 : 1;
+  }
+  delete[] results;
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,480 @@
+// Zim Cartridge Emulator Daemon
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// Serves Zim cartridge ports on Linux, one USB-serial adapter per cartridge
+// slot instead of an Arduino per printer. The MegaLCD sketch's Rfid and
+// Cartridge code runs unchanged on the host HAL in live mode, one Rfid per
+// device, all from a single epoll loop. The sketch's globals (eeprom, trace,
+// event queue) aren't thread safe, and at 19200 baud one thread has time to
+// spare for far more ports than a USB hub takes.
+//
+//   zimd [-l file] [-s file] [-p count] [device ...]
+//
+// Devices are given in left/right pairs, one pair per printer; even ports get
+// the left cartridge id, odd ports the right one. -p adds count pseudo
+// terminals and prints the slave of each, so a Zim side can be run without
+// hardware. -s keeps the cartridges in a memory mapped file across restarts,
+// an eeprom image with a slot per port, msync()ed at most once a second. -l writes the sketch's debug
+// records, zimtrace decodes them. The records carry two bits of port, so -l
+// takes at most four ports.
+//
+// SIGUSR1 prints the per-port latency, from the read() that completed a
+// request to the write() that finished its reply, and the protocol errors
+// Rfid counted. SIGINT and SIGTERM print it and exit.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <Arduino.h>
+#include "Rfid.h"
+#include "EventQueue.h"
+#include "Storage.h"
+#include "MmapStorage.h"
+#include "FramePool.h"
+#include "Trace.h"
+
+#define ZIMD_MAX_PORTS      64
+#define ZIMD_TICK_MS        100   // epoll timeout while a frame or staged write is open
+#define ZIMD_BUCKETS        24    // latency histogram, bucket n holds < 2^n us
+#define ZIMD_STORAGE_SIZE   4096  // bytes of cartridge storage, a Mega's eeprom
+#define ZIMD_FRAME_POOL     (2 * ZIMD_MAX_PORTS + 1) // a request and a prestaged reply per port, one reply
+
+/// Reply latency of one port
+struct Latency
+{
+  Latency() : count(0), totalUs(0), maxUs(0)  { memset(buckets, 0, sizeof(buckets)); }
+  void add(uint64_t us);
+  uint64_t percentile(int percent) const;   // upper bound of the bucket
+
+  unsigned long count;
+  uint64_t      totalUs;
+  uint64_t      maxUs;
+  unsigned long buckets[ZIMD_BUCKETS];
+};
+
+struct Port
+{
+  std::string         path;
+  int                 fd;
+  int                 slaveFd;    // our own open slave keeps a pty from hanging up
+  HardwareSerial *    pSerial;
+  Rfid *              pRfid;
+  std::vector<byte>   out;        // reply bytes the device hasn't taken yet
+  uint64_t            rxUs;       // micros() of the last read
+  uint64_t            replyRxUs;  // rxUs of the reply in out, 0 if none
+  unsigned long       rxBytes;
+  unsigned long       txBytes;
+  Latency             latency;
+};
+
+static std::vector<Port> ports;
+static int epollFd = -1;
+
+static void usage()
+{
+  fprintf(stderr, "usage: zimd [-l file] [-s file] [-p count] [device ...]\n"
+                  "  -l     write the debug records to file, see zimtrace, 4 ports at most\n"
+                  "  -s     keep the cartridges in file\n"
+                  "  -p     serve count pseudo terminals, their slaves are printed\n");
+  exit(2);
+}
+
+void
+Latency::add(uint64_t us)
+{
+  int bucket = 0;
+  while(bucket < ZIMD_BUCKETS - 1 && us >= (1ULL << bucket))
+    ++bucket;
+  ++buckets[bucket];
+  ++count;
+  totalUs += us;
+  if(us > maxUs)
+    maxUs = us;
+}
+
+uint64_t
+Latency::percentile(int percent) const
+{
+  unsigned long need = (count * percent + 99) / 100;
+  unsigned long seen = 0;
+  for(int bucket=0; bucket<ZIMD_BUCKETS; ++bucket)
+  {
+    seen += buckets[bucket];
+    if(seen >= need && seen != 0)
+      return std::min<uint64_t>(1ULL << bucket, maxUs);
+  }
+  return 0;
+}
+
+// 19200 8N1, raw
+static void setRaw(int fd)
+{
+  termios tio;
+  if(tcgetattr(fd, &tio) == 0)
+  {
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, B19200);
+    cfsetospeed(&tio, B19200);
+    tio.c_cflag &= ~(CSTOPB | PARENB);
+    tio.c_cflag |= CS8 | CLOCAL | CREAD;
+    tcsetattr(fd, TCSANOW, &tio);
+  }
+}
+
+static bool openDevice(Port & port)
+{
+  port.fd = open(port.path.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if(port.fd < 0)
+  {
+    fprintf(stderr, "%s: %s\n", port.path.c_str(), strerror(errno));
+    return false;
+  }
+  setRaw(port.fd);
+  tcflush(port.fd, TCIOFLUSH);
+  return true;
+}
+
+static bool openPty(Port & port)
+{
+  port.fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if(port.fd < 0 || grantpt(port.fd) != 0 || unlockpt(port.fd) != 0)
+  {
+    fprintf(stderr, "pty: %s\n", strerror(errno));
+    return false;
+  }
+  port.path = ptsname(port.fd);
+  port.slaveFd = open(port.path.c_str(), O_RDWR | O_NOCTTY);
+  if(port.slaveFd < 0)
+  {
+    fprintf(stderr, "%s: %s\n", port.path.c_str(), strerror(errno));
+    return false;
+  }
+  setRaw(port.slaveFd);
+  return true;
+}
+
+static void closePort(Port & port, const char * why)
+{
+  fprintf(stderr, "port %d: %s %s, no longer served\n",
+          (int)(&port - &ports[0]), port.path.c_str(), why);
+  epoll_ctl(epollFd, EPOLL_CTL_DEL, port.fd, NULL);
+  close(port.fd);
+  port.fd = -1;
+  port.out.clear();
+}
+
+// Writes what the device takes, waits for EPOLLOUT for the rest
+static void flushPort(Port & port)
+{
+  while(!port.out.empty())
+  {
+    ssize_t n = write(port.fd, &port.out[0], port.out.size());
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n < 0 && errno == EAGAIN)
+      break;
+    if(n <= 0)
+    {
+      closePort(port, strerror(errno));
+      return;
+    }
+    port.txBytes += n;
+    port.out.erase(port.out.begin(), port.out.begin() + n);
+  }
+
+  if(port.out.empty() && port.replyRxUs != 0)
+  {
+    port.latency.add(micros() - port.replyRxUs);
+    port.replyRxUs = 0;
+  }
+
+  epoll_event ev;
+  ev.events = EPOLLIN | (port.out.empty() ? 0 : EPOLLOUT);
+  ev.data.u32 = &port - &ports[0];
+  epoll_ctl(epollFd, EPOLL_CTL_MOD, port.fd, &ev);
+}
+
+// Runs the port's Rfid over what has arrived, and its timeouts
+static void runPort(Port & port)
+{
+  Rfid * pRfid = port.pRfid;
+  while(pRfid->isReady())
+  {
+    pRfid->runFsm();
+  }
+  if(pRfid->logPending_)
+  {
+    pRfid->printLog();
+  }
+
+  std::vector<HardwareSerial::Byte> & tx = port.pSerial->tx_;
+  if(!tx.empty() && port.fd >= 0)
+  {
+    for(size_t i=0; i<tx.size(); ++i)
+      port.out.push_back(tx[i].value);
+    if(port.replyRxUs == 0)
+      port.replyRxUs = port.rxUs;
+    flushPort(port);
+  }
+  tx.clear();
+}
+
+static void readPort(Port & port)
+{
+  byte buffer[256];
+  for(;;)
+  {
+    ssize_t n = read(port.fd, buffer, sizeof(buffer));
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n < 0 && errno == EAGAIN)
+      return;
+    if(n <= 0)
+    {
+      closePort(port, n == 0 ? "closed" : strerror(errno));
+      return;
+    }
+    port.rxUs = micros();
+    port.rxBytes += n;
+    port.pSerial->receive(buffer, n);
+    runPort(port);
+  }
+}
+
+static void printStats()
+{
+  printf("port  device                 replies  rx bytes  tx bytes   mean us    p99 us    max us    errors\n");
+  for(size_t i=0; i<ports.size(); ++i)
+  {
+    const Port & port = ports[i];
+    const Latency & latency = port.latency;
+    printf("%4d  %-20s %9lu %9lu %9lu %9llu %9llu %9llu %9lu%s\n",
+           (int)i, port.path.c_str(), latency.count, port.rxBytes, port.txBytes,
+           (unsigned long long)(latency.count ? latency.totalUs / latency.count : 0),
+           (unsigned long long)latency.percentile(99),
+           (unsigned long long)latency.maxUs,
+           port.pRfid->stats_.errors(),
+           port.fd < 0 ? "  lost" : "");
+  }
+  fflush(stdout);
+}
+
+// The daemon is the persister, see runPersistence() in the sketch
+static void runSaves(byte consumer)
+{
+  Event event;
+  while(events.poll(consumer, event))
+  {
+    if(event.type_ == EventType::saveRequested && event.port_ < ports.size())
+    {
+      ports[event.port_].pRfid->saveCartridgeData();
+    }
+    else if(event.type_ == EventType::overflow)
+    {
+      for(size_t i=0; i<ports.size(); ++i)
+        ports[i].pRfid->saveCartridgeData();
+    }
+  }
+}
+
+int main(int argc, char ** argv)
+{
+  const char * logPath = NULL;
+  const char * statePath = NULL;
+  int ptys = 0;
+  int opt;
+  while((opt = getopt(argc, argv, "l:s:p:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'l': logPath = optarg; break;
+      case 's': statePath = optarg; break;
+      case 'p': ptys = atoi(optarg); break;
+      default:  usage();
+    }
+  }
+  int numPorts = argc - optind + ptys;
+  if(numPorts <= 0)
+    usage();
+  if(numPorts > ZIMD_MAX_PORTS ||
+     numPorts * (int)CARTRIDGE_EEPROM_SIZE > ZIMD_STORAGE_SIZE)
+  {
+    fprintf(stderr, "zimd: at most %d ports\n", ZIMD_MAX_PORTS);
+    return 2;
+  }
+  if(logPath != NULL && numPorts > 1 << (8 - TRACE_PORT_SHIFT))
+  {
+    fprintf(stderr, "zimd: -l takes at most %d ports, the records carry two bits of port\n",
+            1 << (8 - TRACE_PORT_SHIFT));
+    return 2;
+  }
+
+  Hal::live = true;
+  if(logPath != NULL)
+  {
+    Hal::debug = fopen(logPath, "wb");
+    if(Hal::debug == NULL)
+    {
+      fprintf(stderr, "%s: %s\n", logPath, strerror(errno));
+      return 1;
+    }
+  }
+
+  // Without a file the cartridges only live as long as the daemon
+  static byte ram[ZIMD_STORAGE_SIZE];
+  RamStorage ramStorage(ram, sizeof(ram));
+  MmapStorage fileStorage;
+  Storage * pStorage = &ramStorage;
+  if(statePath != NULL)
+  {
+    if(!fileStorage.open(statePath, ZIMD_STORAGE_SIZE))
+    {
+      fprintf(stderr, "%s: %s\n", statePath, fileStorage.error_.c_str());
+      return 1;
+    }
+    pStorage = &fileStorage;
+  }
+
+  // Every port can be part way through a request at once
+  static byte frameBuffers[ZIMD_FRAME_POOL * FRAME_BUFFER_SIZE];
+  FramePool framePool(frameBuffers, ZIMD_FRAME_POOL, numPorts + 1);
+
+  ports.resize(numPorts);
+  for(int i=0; i<numPorts; ++i)
+  {
+    Port & port = ports[i];
+    port.fd = -1;
+    port.slaveFd = -1;
+    port.rxUs = 0;
+    port.replyRxUs = 0;
+    port.rxBytes = 0;
+    port.txBytes = 0;
+    if(i < argc - optind)
+    {
+      port.path = argv[optind + i];
+      if(!openDevice(port))
+        return 1;
+    }
+    else if(!openPty(port))
+    {
+      return 1;
+    }
+
+    port.pSerial = new HardwareSerial();
+    port.pSerial->begin(RFID_BAUD_RATE);
+    Cartridge cartridge(i % 2 == 0 ? CARTRIDGE_ID_LEFT : CARTRIDGE_ID_RIGHT,
+                        i * CARTRIDGE_EEPROM_SIZE, pStorage);
+    port.pRfid = new Rfid(port.path.c_str(), i, port.pSerial, cartridge, &framePool);
+    bool restored = port.pRfid->loadCartridgeData();
+    printf("port %d: %s, %s\n", i, port.path.c_str(),
+           restored ? "restored" : "defaults");
+  }
+  byte saves = events.subscribe();
+
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGUSR1);
+  sigprocmask(SIG_BLOCK, &signals, NULL);
+  int signalFd = signalfd(-1, &signals, SFD_NONBLOCK);
+
+  epollFd = epoll_create1(0);
+  for(int i=0; i<numPorts; ++i)
+  {
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = i;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, ports[i].fd, &ev);
+  }
+  epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.u32 = numPorts;
+  epoll_ctl(epollFd, EPOLL_CTL_ADD, signalFd, &ev);
+  fflush(stdout);
+
+  for(;;)
+  {
+    // A tick only while some port has a timeout to raise or an msync is due
+    int timeout = fileStorage.isPending() ? ZIMD_TICK_MS : -1;
+    int open = 0;
+    for(size_t i=0; i<ports.size(); ++i)
+    {
+      if(ports[i].fd < 0)
+        continue;
+      ++open;
+      if(!ports[i].pRfid->isIdle() || ports[i].pRfid->stagedPages_ != 0)
+        timeout = ZIMD_TICK_MS;
+    }
+    if(open == 0)
+    {
+      fprintf(stderr, "zimd: no ports left\n");
+      printStats();
+      return 1;
+    }
+
+    epoll_event ready[16];
+    int count = epoll_wait(epollFd, ready, sizeof(ready)/sizeof(ready[0]), timeout);
+    if(count < 0 && errno != EINTR)
+    {
+      perror("epoll_wait");
+      return 1;
+    }
+
+    for(int i=0; i<count; ++i)
+    {
+      unsigned int index = ready[i].data.u32;
+      if(index == (unsigned int)numPorts)
+      {
+        signalfd_siginfo info;
+        while(read(signalFd, &info, sizeof(info)) == sizeof(info))
+        {
+          printStats();
+          if(info.ssi_signo != SIGUSR1)
+          {
+            return 0;
+          }
+        }
+        continue;
+      }
+
+      Port & port = ports[index];
+      if(port.fd >= 0 && (ready[i].events & EPOLLOUT))
+        flushPort(port);
+      if(port.fd >= 0 && (ready[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+        readPort(port);
+    }
+
+    // timeouts and staged writes that expired
+    for(size_t i=0; i<ports.size(); ++i)
+    {
+      runPort(ports[i]);
+    }
+
+    runSaves(saves);
+    fileStorage.sync();
+    if(Hal::debug != NULL)
+    {
+      fflush(Hal::debug);
+    }
+  }
+}
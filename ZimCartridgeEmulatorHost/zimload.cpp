@@ -0,0 +1,523 @@
+// Zim Cartridge Emulator Load Generator
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// Printer farm against zimd. For every run zimd is started with -p ports,
+// and a thread per pseudo terminal plays a Zim: it sends a request, waits for
+// the reply and sends the next, for the -t seconds of the run. Both
+// processes are kept to the first cpus cores, so the sweep shows how the
+// daemon scales with readers and cores.
+//
+//   zimload [-z zimd] [-n ports,...] [-c cpus,...] [-t s] [-g ms] [-m mix]
+//
+// A mix is a preset or weights of the operations, e.g. read=8,write=1:
+//   handshake   initPort, setAntennaStatus, request, antiCollision, select,
+//               halt, the Zim's connect sequence
+//   read        one readData
+//   write       pages 6 to 9 with usedLen_ 100 mm up, then a readData that
+//               must return it
+// Presets: handshake, read and write run that operation only, print (the
+// default) is read=8,write=2,handshake=1.
+//
+// Latency is per request, from write() to the last byte of the reply. CPU is
+// the user plus system time of each process over the run, 100% is one core.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ZimConsole.h"
+
+#define LOAD_REPLY_TIMEOUT_MS   1000
+#define LOAD_USED_STEP          100   // mm per write burst
+
+namespace LoadOp
+{
+  enum Type
+  {
+    handshake,
+    read,
+    write,
+    count
+  };
+}
+
+static const char * OpNames[LoadOp::count] = { "handshake", "read", "write" };
+
+struct Mix
+{
+  unsigned int weights[LoadOp::count];
+  unsigned int total;
+};
+
+/// What one simulated Zim did
+struct ZimResult
+{
+  std::vector<uint32_t>   latencyUs;
+  unsigned long           timeouts;
+  unsigned long           errors;     // replies that don't match
+};
+
+static void usage()
+{
+  fprintf(stderr, "usage: zimload [-z zimd] [-n ports,...] [-c cpus,...] [-t s] [-g ms] [-m mix]\n"
+                  "  -z     zimd to start, default the one next to zimload\n"
+                  "  -n     simulated Zims per run, default 1,4,16,64\n"
+                  "  -c     cores per run, default 1 and all\n"
+                  "  -t     seconds per run, default 5\n"
+                  "  -g     msecs between a reply and the next request, default 0\n"
+                  "  -m     handshake, read, write, print or op=weight,...\n");
+  exit(2);
+}
+
+static uint64_t nowUs()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static std::vector<int> parseList(const char * text)
+{
+  std::vector<int> values;
+  std::stringstream stream(text);
+  std::string item;
+  while(std::getline(stream, item, ','))
+  {
+    int value = atoi(item.c_str());
+    if(value <= 0)
+      usage();
+    values.push_back(value);
+  }
+  return values;
+}
+
+static Mix parseMix(const std::string & text)
+{
+  Mix mix;
+  memset(&mix, 0, sizeof(mix));
+  if(text == "print")
+    return parseMix("read=8,write=2,handshake=1");
+  for(int op=0; op<LoadOp::count; ++op)
+  {
+    if(text == OpNames[op])
+    {
+      mix.weights[op] = mix.total = 1;
+      return mix;
+    }
+  }
+
+  std::stringstream stream(text);
+  std::string item;
+  while(std::getline(stream, item, ','))
+  {
+    size_t eq = item.find('=');
+    int op = 0;
+    while(op < LoadOp::count && item.substr(0, eq) != OpNames[op])
+      ++op;
+    if(eq == std::string::npos || op == LoadOp::count)
+      usage();
+    mix.weights[op] = atoi(item.c_str() + eq + 1);
+    mix.total += mix.weights[op];
+  }
+  if(mix.total == 0)
+    usage();
+  return mix;
+}
+
+/// Plays the Zim side of one port
+class Zim
+{
+public:
+  Zim(const std::string & path, const Mix & mix, int gapMs, unsigned int seed);
+  void run(uint64_t untilUs, ZimResult * pResult);
+
+private:
+  bool transact(unsigned int funcCode, const byte * pdata, int len,
+                bool reply, std::vector<byte> & rsp);
+  void handshake();
+  void read();
+  void write();
+
+  std::string   path_;
+  Mix           mix_;
+  int           gapMs_;
+  unsigned int  seed_;
+  int           fd_;
+  ZimResult *   pResult_;
+  ZimCartridge  cartridge_;   // what the Zim last wrote
+};
+
+Zim::Zim(const std::string & path, const Mix & mix, int gapMs, unsigned int seed) :
+    path_(path),
+    mix_(mix),
+    gapMs_(gapMs),
+    seed_(seed),
+    fd_(-1),
+    pResult_(NULL)
+{
+}
+
+// True if the 0x00 last received escapes a 0xAA that arrives now. It can
+// also be the last data byte with 0xAA as the XOR, the XOR tells which.
+static bool isEscape(const std::vector<byte> & rsp, size_t want)
+{
+  size_t n = rsp.size();
+  if(n <= 9 || n >= want || rsp.back() != 0x00)
+    return false;
+  if(n < want - 1)
+    return true;
+  byte xorVal = 0;
+  for(size_t i=6; i<n; ++i)
+    xorVal ^= rsp[i];
+  return xorVal != 0xAA;
+}
+
+// One YET-MF2 frame: aa bb, uint16 len, uint16 node, uint16 func code,
+// data, xor of node to data. Replies carry a status byte before the data.
+bool
+Zim::transact(unsigned int funcCode, const byte * pdata, int len,
+              bool reply, std::vector<byte> & rsp)
+{
+  std::vector<byte> req;
+  req.push_back(0xAA);
+  req.push_back(0xBB);
+  req.push_back((len + 5) & 0xFF);
+  req.push_back((len + 5) >> 8);
+  req.push_back(0);
+  req.push_back(0);
+  req.push_back(funcCode & 0xFF);
+  req.push_back(funcCode >> 8);
+  req.insert(req.end(), pdata, pdata + len);
+  byte xorVal = 0;
+  for(size_t i=4; i<req.size(); ++i)
+    xorVal ^= req[i];
+  req.push_back(xorVal);
+
+  if(gapMs_ > 0)
+    usleep(gapMs_ * 1000);
+  uint64_t startUs = nowUs();
+  if(::write(fd_, &req[0], req.size()) != (ssize_t)req.size())
+  {
+    ++pResult_->errors;
+    return false;
+  }
+  if(!reply)
+    return true;
+
+  // The sketch sends a 0x00 before each 0xAA of the reply data, outside the
+  // length, see Rfid::buildFrame()
+  rsp.clear();
+  size_t want = 4;
+  while(rsp.size() < want)
+  {
+    pollfd pfd = { fd_, POLLIN, 0 };
+    if(poll(&pfd, 1, LOAD_REPLY_TIMEOUT_MS) <= 0)
+    {
+      ++pResult_->timeouts;
+      return false;
+    }
+    byte buffer[64];
+    ssize_t n = ::read(fd_, buffer, std::min(sizeof(buffer), want - rsp.size()));
+    for(ssize_t i=0; i<n; ++i)
+    {
+      if(buffer[i] == 0xAA && isEscape(rsp, want))
+        rsp.pop_back();
+      rsp.push_back(buffer[i]);
+      if(rsp.size() == 4)
+        want = 4 + (rsp[2] | rsp[3] << 8);
+    }
+  }
+  pResult_->latencyUs.push_back(nowUs() - startUs);
+
+  // header, len, node, func code, status
+  if(rsp[0] != 0xAA || rsp[1] != 0xBB || rsp.size() < 9 ||
+     (unsigned int)(rsp[6] | rsp[7] << 8) != funcCode || rsp[8] != 0)
+  {
+    ++pResult_->errors;
+    return false;
+  }
+  return true;
+}
+
+void
+Zim::handshake()
+{
+  static const byte Antenna[] = { 0x01 };
+  static const byte Request[] = { 0x52 };
+  static const byte AntiCollision[] = { 0x04 };
+  std::vector<byte> rsp;
+  transact(0x0101, NULL, 0, true, rsp);
+  transact(0x010C, Antenna, sizeof(Antenna), false, rsp);
+  transact(0x0201, Request, sizeof(Request), true, rsp);
+  if(!transact(0x0202, AntiCollision, sizeof(AntiCollision), true, rsp) || rsp.size() < 13)
+    return;
+  byte uid[] = { rsp[9], rsp[10], rsp[11], rsp[12] };
+  transact(0x0203, uid, sizeof(uid), true, rsp);
+  transact(0x0204, NULL, 0, true, rsp);
+}
+
+void
+Zim::read()
+{
+  static const byte Page[] = { 0x04 };
+  std::vector<byte> rsp;
+  if(transact(0x0208, Page, sizeof(Page), true, rsp) && rsp.size() >= 9 + ZIM_TAG_LENGTH)
+    cartridge_.fromImage(&rsp[9]);
+}
+
+void
+Zim::write()
+{
+  byte image[ZIM_TAG_LENGTH];
+  cartridge_.usedLen_ = (cartridge_.usedLen_ + LOAD_USED_STEP) & 0xFFFFF;
+  cartridge_.toImage(image);
+  std::vector<byte> rsp;
+  for(int page=0; page<ZIM_TAG_LENGTH/4; ++page)
+  {
+    byte data[5] = { (byte)(6 + page) };
+    memcpy(&data[1], &image[page * 4], 4);
+    if(!transact(0x0213, data, sizeof(data), true, rsp))
+      return;
+  }
+
+  long expected = cartridge_.usedLen_;
+  read();
+  if(cartridge_.usedLen_ != expected)
+    ++pResult_->errors;
+}
+
+void
+Zim::run(uint64_t untilUs, ZimResult * pResult)
+{
+  pResult_ = pResult;
+  fd_ = open(path_.c_str(), O_RDWR | O_NOCTTY);
+  if(fd_ < 0)
+  {
+    fprintf(stderr, "%s: %s\n", path_.c_str(), strerror(errno));
+    ++pResult_->errors;
+    return;
+  }
+  termios tio;
+  if(tcgetattr(fd_, &tio) == 0)
+  {
+    cfmakeraw(&tio);
+    tcsetattr(fd_, TCSANOW, &tio);
+  }
+
+  handshake();
+  read();
+  while(nowUs() < untilUs)
+  {
+    unsigned int pick = rand_r(&seed_) % mix_.total;
+    int op = 0;
+    while(pick >= mix_.weights[op])
+      pick -= mix_.weights[op++];
+    switch(op)
+    {
+      case LoadOp::handshake: handshake(); break;
+      case LoadOp::read:      read(); break;
+      case LoadOp::write:     write(); break;
+    }
+  }
+  close(fd_);
+}
+
+// user plus system seconds of a process
+static double cpuSeconds(pid_t pid)
+{
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+  FILE * pFile = fopen(path, "r");
+  if(pFile == NULL)
+    return 0;
+  char text[1024];
+  size_t n = fread(text, 1, sizeof(text) - 1, pFile);
+  fclose(pFile);
+  text[n] = 0;
+  // the fields after the command name, which may hold spaces
+  const char * p = strrchr(text, ')');
+  unsigned long utime = 0, stime = 0;
+  if(p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                         &utime, &stime) != 2)
+    return 0;
+  return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static double selfCpuSeconds()
+{
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+         usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+// Starts zimd with ports ptys, returns its pid and the slaves
+static pid_t startZimd(const std::string & zimd, int ports, std::vector<std::string> & slaves)
+{
+  int pipeFds[2];
+  if(pipe(pipeFds) != 0)
+    return -1;
+  pid_t pid = fork();
+  if(pid == 0)
+  {
+    dup2(pipeFds[1], 1);
+    close(pipeFds[0]);
+    close(pipeFds[1]);
+    char count[16];
+    snprintf(count, sizeof(count), "%d", ports);
+    execl(zimd.c_str(), zimd.c_str(), "-p", count, (char *)NULL);
+    fprintf(stderr, "%s: %s\n", zimd.c_str(), strerror(errno));
+    _exit(127);
+  }
+  close(pipeFds[1]);
+
+  // "port <n>: <slave>, <restored|defaults>"
+  FILE * pOut = fdopen(pipeFds[0], "r");
+  char line[256];
+  slaves.clear();
+  while((int)slaves.size() < ports && fgets(line, sizeof(line), pOut) != NULL)
+  {
+    char slave[200];
+    if(sscanf(line, "port %*d: %199[^,]", slave) == 1)
+      slaves.push_back(slave);
+  }
+  fclose(pOut);
+  if((int)slaves.size() != ports)
+  {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return -1;
+  }
+  return pid;
+}
+
+static uint32_t percentile(const std::vector<uint32_t> & sorted, double fraction)
+{
+  if(sorted.empty())
+    return 0;
+  size_t index = (size_t)(fraction * (sorted.size() - 1) + 0.5);
+  return sorted[index];
+}
+
+int main(int argc, char ** argv)
+{
+  std::string zimd = argv[0];
+  size_t slash = zimd.rfind('/');
+  zimd = (slash == std::string::npos ? std::string(".") : zimd.substr(0, slash)) + "/zimd";
+  int online = sysconf(_SC_NPROCESSORS_ONLN);
+  std::vector<int> portCounts = parseList("1,4,16,64");
+  std::vector<int> cpuCounts;
+  cpuCounts.push_back(1);
+  if(online > 1)
+    cpuCounts.push_back(online);
+  int seconds = 5;
+  int gapMs = 0;
+  Mix mix = parseMix("print");
+
+  int opt;
+  while((opt = getopt(argc, argv, "z:n:c:t:g:m:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'z': zimd = optarg; break;
+      case 'n': portCounts = parseList(optarg); break;
+      case 'c': cpuCounts = parseList(optarg); break;
+      case 't': seconds = atoi(optarg); break;
+      case 'g': gapMs = atoi(optarg); break;
+      case 'm': mix = parseMix(optarg); break;
+      default:  usage();
+    }
+  }
+  if(optind != argc || seconds <= 0)
+    usage();
+
+  printf("ports  cpus   requests     req/s   p50 us   p99 us  p999 us  zimd cpu  load cpu  timeouts  errors\n");
+  int failed = 0;
+  for(size_t c=0; c<cpuCounts.size(); ++c)
+  {
+    int cpus = std::min(cpuCounts[c], online);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(int cpu=0; cpu<cpus; ++cpu)
+      CPU_SET(cpu, &set);
+    // zimd inherits it, the threads are started after
+    sched_setaffinity(0, sizeof(set), &set);
+
+    for(size_t p=0; p<portCounts.size(); ++p)
+    {
+      int ports = portCounts[p];
+      std::vector<std::string> slaves;
+      pid_t pid = startZimd(zimd, ports, slaves);
+      if(pid < 0)
+      {
+        fprintf(stderr, "zimload: %s didn't start %d ports\n", zimd.c_str(), ports);
+        return 1;
+      }
+
+      std::vector<ZimResult> results(ports);
+      std::vector<Zim *> zims;
+      std::vector<std::thread> threads;
+      double zimdCpu = cpuSeconds(pid);
+      double selfCpu = selfCpuSeconds();
+      uint64_t startUs = nowUs();
+      uint64_t untilUs = startUs + seconds * 1000000ULL;
+      for(int i=0; i<ports; ++i)
+      {
+        ZimResult & result = results[i];
+        result.timeouts = result.errors = 0;
+        zims.push_back(new Zim(slaves[i], mix, gapMs, i + 1));
+        threads.push_back(std::thread(&Zim::run, zims[i], untilUs, &result));
+      }
+      for(int i=0; i<ports; ++i)
+      {
+        threads[i].join();
+        delete zims[i];
+      }
+      double wallS = (nowUs() - startUs) / 1e6;
+      zimdCpu = cpuSeconds(pid) - zimdCpu;
+      selfCpu = selfCpuSeconds() - selfCpu;
+      kill(pid, SIGTERM);
+      waitpid(pid, NULL, 0);
+
+      std::vector<uint32_t> all;
+      unsigned long timeouts = 0, errors = 0;
+      for(int i=0; i<ports; ++i)
+      {
+        all.insert(all.end(), results[i].latencyUs.begin(), results[i].latencyUs.end());
+        timeouts += results[i].timeouts;
+        errors += results[i].errors;
+      }
+      std::sort(all.begin(), all.end());
+      printf("%5d %5d %10lu %9.0f %8u %8u %8u %8.0f%% %8.0f%% %9lu %7lu\n",
+             ports, cpus, (unsigned long)all.size(), all.size() / wallS,
+             percentile(all, 0.50), percentile(all, 0.99), percentile(all, 0.999),
+             100 * zimdCpu / wallS, 100 * selfCpu / wallS, timeouts, errors);
+      fflush(stdout);
+      failed += timeouts + errors != 0;
+    }
+  }
+  return failed ? 1 : 0;
+}
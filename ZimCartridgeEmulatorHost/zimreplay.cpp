@@ -0,0 +1,260 @@
+// Zim Cartridge Emulator Replay
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// Replays YET-MF2 traces through a host build of one of the sketches, see
+// hal/Hal.h for the time model. The Makefile links one binary per sketch:
+// zimreplay-nano, zimreplay-mega and zimreplay-megalcd.
+//
+//   zimreplay-<sketch> [-r] [-v] [-b us] [-s ms] trace
+//
+// Trace lines, bytes in hex:
+//   > <port> <bytes>   request from the Zim
+//   < <port> <bytes>   reply expected to the request above, no line means none
+//   + <ms>             idle time
+//   # ...              comment
+//
+// By default each reply is compared byte for byte with the trace and the
+// time from the last request byte to the first reply byte is checked
+// against the command's budget; the exit status is 1 on any failure. -r
+// writes the trace with this build's replies instead, so a trace recorded
+// with one sketch checks the others.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <Arduino.h>
+#include "ZimBudgets.h"
+
+void setup();
+void loop();
+
+struct Stats
+{
+  Stats() : count(0), worstUs(0), over(0), mismatches(0) {}
+  int           count;
+  unsigned long worstUs;
+  int           over;
+  int           mismatches;
+};
+
+static void usage()
+{
+  fprintf(stderr, "usage: zimreplay [-r] [-v] [-b us] [-s ms] trace\n"
+                  "  -r     record this build's replies into the trace on stdout\n"
+                  "  -v     echo the sketch's debug output to stderr\n"
+                  "  -b us  budget for every command instead of the built in ones\n"
+                  "  -s ms  time allowed for each reply, default 100\n");
+  exit(2);
+}
+
+static std::string toHex(const std::vector<byte> & bytes)
+{
+  std::string text;
+  char hex[4];
+  for(size_t i=0; i<bytes.size(); ++i)
+  {
+    snprintf(hex, sizeof(hex), i ? " %02x" : "%02x", bytes[i]);
+    text += hex;
+  }
+  return text;
+}
+
+static bool parseBytes(std::istringstream & words, std::vector<byte> & bytes)
+{
+  std::string word;
+  while(words >> word)
+  {
+    char * end = NULL;
+    unsigned long value = strtoul(word.c_str(), &end, 16);
+    if(*end != '\0' || value > 0xFF)
+      return false;
+    bytes.push_back(value);
+  }
+  return !bytes.empty();
+}
+
+// Runs the sketch until the virtual clock reaches untilUs
+static void runUntil(uint64_t untilUs)
+{
+  while(Hal::nowUs < untilUs)
+  {
+    loop();
+    Hal::charge();
+  }
+}
+
+struct Step
+{
+  int                 line;
+  int                 port;
+  std::vector<byte>   request;
+  bool                hasReply;
+  std::vector<byte>   reply;
+  unsigned long       idleMs;
+};
+
+static bool readTrace(const char * path, std::vector<Step> & steps)
+{
+  std::ifstream in(path);
+  if(!in)
+  {
+    fprintf(stderr, "zimreplay: can't open %s\n", path);
+    return false;
+  }
+
+  std::string text;
+  for(int line=1; std::getline(in, text); ++line)
+  {
+    std::istringstream words(text);
+    std::string kind;
+    if(!(words >> kind) || kind[0] == '#')
+      continue;
+
+    Step step;
+    step.line = line;
+    step.port = 0;
+    step.hasReply = false;
+    step.idleMs = 0;
+    bool ok = false;
+    if(kind == "+")
+    {
+      ok = !!(words >> step.idleMs);
+      step.port = -1;
+    }
+    else if(kind == ">")
+    {
+      ok = (words >> step.port) && parseBytes(words, step.request);
+    }
+    else if(kind == "<" && !steps.empty() && !steps.back().request.empty())
+    {
+      int port = 0;
+      ok = (words >> port) && port == steps.back().port &&
+           parseBytes(words, steps.back().reply);
+      steps.back().hasReply = true;
+      if(ok)
+        continue;
+    }
+    if(!ok)
+    {
+      fprintf(stderr, "%s:%d: bad line: %s\n", path, line, text.c_str());
+      return false;
+    }
+    steps.push_back(step);
+  }
+  return true;
+}
+
+int main(int argc, char ** argv)
+{
+  bool record = false;
+  long budgetUs = -1;
+  unsigned long settleMs = 100;
+  int opt;
+  while((opt = getopt(argc, argv, "rvb:s:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'r': record = true; break;
+      case 'v': Hal::debug = stderr; break;
+      case 'b': budgetUs = atol(optarg); break;
+      case 's': settleMs = atol(optarg); break;
+      default:  usage();
+    }
+  }
+  if(optind != argc - 1)
+    usage();
+
+  std::vector<Step> steps;
+  if(!readTrace(argv[optind], steps))
+    return 2;
+
+  setup();
+  runUntil(Hal::nowUs + settleMs * 1000);
+
+  std::map<unsigned int, Stats> stats;
+  int failures = 0;
+  for(size_t i=0; i<steps.size(); ++i)
+  {
+    Step & step = steps[i];
+    if(step.port < 0)
+    {
+      runUntil(Hal::nowUs + step.idleMs * 1000);
+      if(record)
+        printf("+ %lu\n", step.idleMs);
+      continue;
+    }
+
+    HardwareSerial * pPort = Hal::port(step.port);
+    if(pPort == NULL)
+    {
+      fprintf(stderr, "line %d: this sketch has %d ports\n", step.line, Hal::numPorts());
+      return 2;
+    }
+
+    size_t mark = pPort->tx_.size();
+    pPort->inject(&step.request[0], step.request.size(), Hal::nowUs);
+    uint64_t endUs = pPort->rx_.back().us;
+    runUntil(endUs + settleMs * 1000);
+
+    std::vector<byte> reply;
+    for(size_t b=mark; b<pPort->tx_.size(); ++b)
+      reply.push_back(pPort->tx_[b].value);
+    unsigned long costUs = reply.empty() ? 0 : pPort->tx_[mark].us - endUs;
+
+    unsigned int funcCode = step.request.size() >= 8 ?
+                            step.request[6] | step.request[7] << 8 : 0;
+    const Budget & budget = budgetFor(funcCode);
+    Stats & s = stats[budget.funcCode ? funcCode : 0];
+    ++s.count;
+    if(costUs > s.worstUs)
+      s.worstUs = costUs;
+
+    if(record)
+    {
+      printf("> %d %s\n", step.port, toHex(step.request).c_str());
+      if(!reply.empty())
+        printf("< %d %s\n", step.port, toHex(reply).c_str());
+      continue;
+    }
+
+    if(costUs > (budgetUs >= 0 ? (unsigned long)budgetUs : budget.us))
+    {
+      ++s.over;
+      ++failures;
+      fprintf(stderr, "line %d: %s replied after %lu us\n", step.line, budget.name, costUs);
+    }
+    if(reply != step.reply)
+    {
+      ++s.mismatches;
+      ++failures;
+      fprintf(stderr, "line %d: %s reply differs\n  expected: %s\n  got:      %s\n",
+              step.line, budget.name, toHex(step.reply).c_str(), toHex(reply).c_str());
+    }
+  }
+
+  fprintf(stderr, "%-18s %6s %10s %10s %6s %10s\n",
+          "command", "count", "worst us", "budget us", "over", "mismatch");
+  for(std::map<unsigned int, Stats>::iterator it=stats.begin(); it!=stats.end(); ++it)
+  {
+    const Budget & budget = budgetFor(it->first);
+    fprintf(stderr, "%-18s %6d %10lu %10lu %6d %10d\n", budget.name, it->second.count,
+            it->second.worstUs, budgetUs >= 0 ? (unsigned long)budgetUs : budget.us,
+            it->second.over, it->second.mismatches);
+  }
+  return failures ? 1 : 0;
+}
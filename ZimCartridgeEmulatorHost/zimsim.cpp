@@ -0,0 +1,424 @@
+// Zim Cartridge Emulator Simulator
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// Discrete event simulation of a sketch on the HAL's virtual clock. Unlike
+// zimreplay, the whole script is scheduled up front: Zim requests arrive at
+// their script time whether or not the last one was answered, and button
+// presses overlap them, so the menu, the eeprom saves and the frame
+// handling compete as they would on the board. Runs are repeatable, the
+// same script and costs always give the same numbers.
+//
+//   zimsim-<sketch> [-v] [-g ms] [-s ms] [-b us] [-c cost=us ...] script
+//
+// Script lines, bytes in hex:
+//   > <port> <bytes>         request from the Zim at the script time
+//   < <port> <bytes>         ignored, so zimreplay traces run as is
+//   + <ms>                   advance the script time
+//   key <button> [ms]        press right, up, down, left or select for ms,
+//                            default 200, without advancing the script time
+//   # ...                    comment
+//
+// After each request the script time moves on by the request's wire time
+// plus the -g gap. For every reply the time from the last request byte to
+// the first reply byte is split by what the virtual time went on (see
+// HalCost), the report shows the worst reply of each command and exits 1
+// if one is over budget. It ends with the loop() period, the time each pass
+// was busy.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <Arduino.h>
+#include "ZimBudgets.h"
+
+void setup();
+void loop();
+
+#define SIM_SLICE_US    100000  // timeline spans are folded into the replies this often
+
+static const char * CostNames[HalCost::count] =
+{
+  "sketch", "serial", "eeprom", "lcd", "adc", "delay", "idle"
+};
+
+struct Button
+{
+  const char *  name;
+  int           adc;    // LCD keypad shield divider
+};
+
+static const Button Buttons[] =
+{
+  { "right",    0 },
+  { "up",     144 },
+  { "down",   329 },
+  { "left",   505 },
+  { "select", 741 }
+};
+
+/// One request of the script and what became of it
+struct Request
+{
+  int                 line;
+  int                 port;
+  std::vector<byte>   bytes;
+  unsigned int        funcCode;
+  uint64_t            endUs;      // last request byte received
+  uint64_t            limitUs;    // a reply must start before this
+  bool                done;
+  bool                replied;
+  uint64_t            replyUs;    // first reply byte written
+  uint64_t            spentUs[HalCost::count];
+};
+
+struct Worst
+{
+  Worst() : count(0), replies(0), over(0), pRequest(NULL) {}
+  int             count;
+  int             replies;
+  int             over;
+  const Request * pRequest;
+};
+
+static void usage()
+{
+  fprintf(stderr, "usage: zimsim [-v] [-g ms] [-s ms] [-b us] [-c cost=us ...] script\n"
+                  "  -v          echo the sketch's debug output to stderr\n"
+                  "  -g ms       gap after each request, default 100\n"
+                  "  -s ms       time after setup before the script starts, default 100\n"
+                  "  -b us       budget for every command instead of the built in ones\n"
+                  "  -c cost=us  override a modelled cost: block (in ns), serial,\n"
+                  "              eeprom, lcdwrite, lcdclear, adc\n");
+  exit(2);
+}
+
+static bool setCost(const char * text)
+{
+  const char * eq = strchr(text, '=');
+  if(eq == NULL)
+    return false;
+  std::string name(text, eq - text);
+  unsigned long us = strtoul(eq + 1, NULL, 10);
+  if(name == "block" && us == 0)
+    return false; // time would stand still in a pass that doesn't sleep
+  if(name == "block")         Hal::costs.blockNs = us;
+  else if(name == "serial")   Hal::costs.serialWriteUs = us;
+  else if(name == "eeprom")   Hal::costs.eepromWriteUs = us;
+  else if(name == "lcdwrite") Hal::costs.lcdWriteUs = us;
+  else if(name == "lcdclear") Hal::costs.lcdClearUs = us;
+  else if(name == "adc")      Hal::costs.adcUs = us;
+  else return false;
+  return true;
+}
+
+static bool parseBytes(std::istringstream & words, std::vector<byte> & bytes)
+{
+  std::string word;
+  while(words >> word)
+  {
+    char * end = NULL;
+    unsigned long value = strtoul(word.c_str(), &end, 16);
+    if(*end != '\0' || value > 0xFF)
+      return false;
+    bytes.push_back(value);
+  }
+  return !bytes.empty();
+}
+
+// Schedules the script from startUs on, requests are injected straight away
+static bool readScript(const char * path, uint64_t startUs, unsigned long gapMs,
+                       std::vector<Request> & requests, uint64_t & endUs)
+{
+  std::ifstream in(path);
+  if(!in)
+  {
+    fprintf(stderr, "zimsim: can't open %s\n", path);
+    return false;
+  }
+
+  uint64_t nowUs = startUs;
+  std::string text;
+  for(int line=1; std::getline(in, text); ++line)
+  {
+    std::istringstream words(text);
+    std::string kind;
+    if(!(words >> kind) || kind[0] == '#' || kind == "<")
+      continue;
+
+    bool ok = false;
+    if(kind == "+")
+    {
+      unsigned long ms = 0;
+      ok = !!(words >> ms);
+      nowUs += ms * 1000ULL;
+    }
+    else if(kind == "key")
+    {
+      std::string name;
+      unsigned long ms = 200;
+      ok = !!(words >> name);
+      if(ok && !(words >> ms))
+        ms = 200;
+      const Button * pButton = NULL;
+      for(size_t i=0; i<sizeof(Buttons)/sizeof(Buttons[0]); ++i)
+      {
+        if(name == Buttons[i].name)
+          pButton = &Buttons[i];
+      }
+      ok = ok && pButton != NULL;
+      if(ok)
+      {
+        Hal::setAnalog(nowUs, pButton->adc);
+        Hal::setAnalog(nowUs + ms * 1000ULL, 1023);
+        endUs = std::max<uint64_t>(endUs, nowUs + ms * 1000ULL);
+      }
+    }
+    else if(kind == ">")
+    {
+      Request request;
+      memset(request.spentUs, 0, sizeof(request.spentUs));
+      request.line = line;
+      request.done = false;
+      request.replied = false;
+      request.replyUs = 0;
+      ok = (words >> request.port) && parseBytes(words, request.bytes);
+      request.funcCode = request.bytes.size() >= 8 ?
+                         request.bytes[6] | request.bytes[7] << 8 : 0;
+      HardwareSerial * pPort = ok ? Hal::port(request.port) : NULL;
+      if(ok && pPort == NULL)
+      {
+        fprintf(stderr, "%s:%d: this sketch has %d ports\n", path, line, Hal::numPorts());
+        return false;
+      }
+      if(ok)
+      {
+        // a request can't start before the last one on its port has arrived
+        uint64_t sendUs = std::max<uint64_t>(nowUs, pPort->rx_.empty() ? 0 : pPort->rx_.back().us);
+        pPort->inject(&request.bytes[0], request.bytes.size(), sendUs);
+        request.endUs = pPort->rx_.back().us;
+        request.limitUs = UINT64_MAX;
+        for(size_t i=requests.size(); i-- > 0; )
+        {
+          if(requests[i].port == request.port)
+          {
+            requests[i].limitUs = request.endUs;
+            break;
+          }
+        }
+        requests.push_back(request);
+        nowUs = request.endUs + gapMs * 1000ULL;
+      }
+    }
+    if(!ok)
+    {
+      fprintf(stderr, "%s:%d: bad line: %s\n", path, line, text.c_str());
+      return false;
+    }
+  }
+  endUs = std::max(endUs, nowUs);
+  return true;
+}
+
+// Adds the part of each span inside [fromUs, toUs) to spentUs
+static void charge(const std::vector<HalSpan> & timeline, uint64_t fromUs, uint64_t toUs,
+                   uint64_t * spentUs)
+{
+  for(size_t i=0; i<timeline.size(); ++i)
+  {
+    const HalSpan & span = timeline[i];
+    uint64_t start = std::max(span.startUs, fromUs);
+    uint64_t end = std::min(span.startUs + span.us, toUs);
+    if(start < end)
+      spentUs[span.cost] += end - start;
+  }
+}
+
+// Finds the replies to the requests that can be settled by now, charges
+// their time and drops the spans no open request needs any more
+static void settle(std::vector<Request> & requests, size_t & first,
+                   std::vector<HalSpan> & timeline)
+{
+  for(size_t i=first; i<requests.size(); ++i)
+  {
+    Request & request = requests[i];
+    if(request.done || request.endUs > Hal::nowUs)
+      continue;
+
+    const std::vector<HardwareSerial::Byte> & tx = Hal::port(request.port)->tx_;
+    for(size_t b=0; b<tx.size(); ++b)
+    {
+      if(tx[b].us >= request.endUs && tx[b].us < request.limitUs)
+      {
+        request.replied = true;
+        request.replyUs = tx[b].us;
+        break;
+      }
+    }
+    if(request.replied || Hal::nowUs >= request.limitUs)
+    {
+      if(request.replied)
+        charge(timeline, request.endUs, request.replyUs, request.spentUs);
+      request.done = true;
+    }
+  }
+
+  while(first < requests.size() && requests[first].done)
+    ++first;
+  uint64_t keepUs = Hal::nowUs;
+  for(size_t i=first; i<requests.size(); ++i)
+  {
+    if(!requests[i].done)
+      keepUs = std::min(keepUs, requests[i].endUs);
+  }
+  size_t drop = 0;
+  while(drop < timeline.size() && timeline[drop].startUs + timeline[drop].us <= keepUs)
+    ++drop;
+  timeline.erase(timeline.begin(), timeline.begin() + drop);
+}
+
+static void printSpent(const uint64_t * spentUs)
+{
+  for(int c=0; c<HalCost::count; ++c)
+    fprintf(stderr, " %8lu", (unsigned long)spentUs[c]);
+  fprintf(stderr, "\n");
+}
+
+int main(int argc, char ** argv)
+{
+  long budgetUs = -1;
+  unsigned long gapMs = 100;
+  unsigned long settleMs = 100;
+  int opt;
+  while((opt = getopt(argc, argv, "vg:s:b:c:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'v': Hal::debug = stderr; break;
+      case 'g': gapMs = atol(optarg); break;
+      case 's': settleMs = atol(optarg); break;
+      case 'b': budgetUs = atol(optarg); break;
+      case 'c': if(!setCost(optarg)) usage(); break;
+      default:  usage();
+    }
+  }
+  if(optind != argc - 1)
+    usage();
+
+  setup();
+  uint64_t startUs = Hal::nowUs + settleMs * 1000;
+  while(Hal::nowUs < startUs)
+  {
+    loop();
+    Hal::charge();
+  }
+
+  std::vector<Request> requests;
+  uint64_t endUs = 0;
+  if(!readScript(argv[optind], startUs, gapMs, requests, endUs))
+    return 2;
+  endUs += settleMs * 1000;
+
+  std::vector<HalSpan> timeline;
+  Hal::pTimeline = &timeline;
+  uint64_t spentStart[HalCost::count];
+  memcpy(spentStart, Hal::spentUs, sizeof(spentStart));
+  size_t first = 0;
+  unsigned long passes = 0;
+  uint64_t busyUs = 0;
+  uint64_t worstPassUs = 0;
+  while(Hal::nowUs < endUs)
+  {
+    uint64_t sliceUs = std::min(endUs, Hal::nowUs + SIM_SLICE_US);
+    while(Hal::nowUs < sliceUs)
+    {
+      // a pass's period is what it didn't sleep
+      uint64_t passUs = Hal::nowUs - Hal::spentUs[HalCost::idle];
+      loop();
+      Hal::charge();
+      passUs = Hal::nowUs - Hal::spentUs[HalCost::idle] - passUs;
+      ++passes;
+      busyUs += passUs;
+      worstPassUs = std::max(worstPassUs, passUs);
+    }
+    settle(requests, first, timeline);
+  }
+  for(size_t i=first; i<requests.size(); ++i)
+    requests[i].limitUs = std::min(requests[i].limitUs, Hal::nowUs);
+  settle(requests, first, timeline);
+  Hal::pTimeline = NULL;
+
+  std::map<unsigned int, Worst> worst;
+  const Request * pWorst = NULL;
+  int failures = 0;
+  for(size_t i=0; i<requests.size(); ++i)
+  {
+    const Request & request = requests[i];
+    const Budget & budget = budgetFor(request.funcCode);
+    Worst & w = worst[budget.funcCode];
+    ++w.count;
+    if(!request.replied)
+      continue;
+    ++w.replies;
+    uint64_t us = request.replyUs - request.endUs;
+    if(us > (budgetUs >= 0 ? (unsigned long)budgetUs : budget.us))
+    {
+      ++w.over;
+      ++failures;
+    }
+    if(w.pRequest == NULL || us > w.pRequest->replyUs - w.pRequest->endUs)
+      w.pRequest = &request;
+    if(pWorst == NULL || us > pWorst->replyUs - pWorst->endUs)
+      pWorst = &request;
+  }
+
+  fprintf(stderr, "%-18s %6s %7s %6s %9s %6s", "command", "count", "replies", "over", "worst us", "line");
+  for(int c=0; c<HalCost::count; ++c)
+    fprintf(stderr, " %8s", CostNames[c]);
+  fprintf(stderr, "\n");
+  for(std::map<unsigned int, Worst>::iterator it=worst.begin(); it!=worst.end(); ++it)
+  {
+    const Worst & w = it->second;
+    fprintf(stderr, "%-18s %6d %7d %6d", budgetFor(it->first).name, w.count, w.replies, w.over);
+    if(w.pRequest == NULL)
+    {
+      fprintf(stderr, "\n");
+      continue;
+    }
+    fprintf(stderr, " %9lu %6d", (unsigned long)(w.pRequest->replyUs - w.pRequest->endUs),
+            w.pRequest->line);
+    printSpent(w.pRequest->spentUs);
+  }
+
+  uint64_t total[HalCost::count];
+  for(int c=0; c<HalCost::count; ++c)
+    total[c] = Hal::spentUs[c] - spentStart[c];
+  fprintf(stderr, "%-18s %6s %7s %6s %9lu %6s", "whole run", "", "", "",
+          (unsigned long)(Hal::nowUs - startUs), "");
+  printSpent(total);
+  fprintf(stderr, "loop: %lu passes, %lu us mean, %lu us worst, idle time excluded\n",
+          passes, (unsigned long)(passes ? busyUs / passes : 0), (unsigned long)worstPassUs);
+
+  if(pWorst != NULL)
+  {
+    fprintf(stderr, "worst reply: line %d, %s on port %d, %lu us\n", pWorst->line,
+            budgetFor(pWorst->funcCode).name, pWorst->port,
+            (unsigned long)(pWorst->replyUs - pWorst->endUs));
+  }
+  return failures ? 1 : 0;
+}
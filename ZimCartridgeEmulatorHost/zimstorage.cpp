@@ -0,0 +1,176 @@
+// Zim Cartridge Emulator Storage Benchmark
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// Commit cost of the sketch's storage backends. Each commit is what a tag
+// write costs: usedLen_ goes up 100 mm and Cartridge::save() runs.
+//
+//   zimstorage [-n commits] [-b ms] [-f file]
+//
+// eeprom is the AVR EEPROM as the HAL models it, in virtual time. rewrite
+// writes the whole image to a new file and renames it, what zimd did before
+// it had a storage backend. mmap-sync msync()s every commit, mmap-batch
+// every -b msecs; the final msync is part of its total.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <Arduino.h>
+#include "Cartridge.h"
+#include "Storage.h"
+#include "MmapStorage.h"
+
+#define BENCH_STORAGE_SIZE  4096
+
+static void usage()
+{
+  fprintf(stderr, "usage: zimstorage [-n commits] [-b ms] [-f file]\n"
+                  "  -n     commits per backend, default 1000\n"
+                  "  -b     msync batch of mmap-batch, default %d ms\n"
+                  "  -f     file for the file backends, default zimstorage.bin\n",
+                  MMAP_STORAGE_SYNC_MS);
+  exit(2);
+}
+
+static uint64_t nowUs()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/// RAM image written out whole on every commit
+class RewriteStorage : public RamStorage
+{
+public:
+  RewriteStorage(byte * pmem, int size, const std::string & path) :
+      RamStorage(pmem, size),
+      path_(path)
+  {
+  }
+
+  void commit()
+  {
+    RamStorage::commit();
+    std::string temp = path_ + ".new";
+    FILE * pFile = fopen(temp.c_str(), "wb");
+    if(pFile == NULL ||
+       fwrite(pmem_, 1, size_, pFile) != (size_t)size_ ||
+       fclose(pFile) != 0 ||
+       rename(temp.c_str(), path_.c_str()) != 0)
+    {
+      fprintf(stderr, "%s: %s\n", path_.c_str(), strerror(errno));
+      exit(1);
+    }
+  }
+
+  std::string path_;
+};
+
+struct Result
+{
+  const char *  name;
+  uint64_t      totalUs;
+  uint64_t      maxUs;
+  unsigned long syncs;
+};
+
+// Wall time of each save(), or the HAL's eeprom time for the eeprom backend
+static Result run(const char * name, Storage * pStorage, int commits, bool modelled)
+{
+  Result result = { name, 0, 0, 0 };
+  Cartridge cartridge(CARTRIDGE_ID_LEFT, CARTRIDGE_LEFT_EEPROM_LOC, pStorage);
+  cartridge.save();
+  for(int i=0; i<commits; ++i)
+  {
+    cartridge.data_.usedLen_ += 100;
+    uint64_t startUs = modelled ? Hal::spentUs[HalCost::eeprom] : nowUs();
+    cartridge.save();
+    uint64_t us = (modelled ? Hal::spentUs[HalCost::eeprom] : nowUs()) - startUs;
+    result.totalUs += us;
+    result.maxUs = std::max(result.maxUs, us);
+  }
+  return result;
+}
+
+static void print(const Result & result, int commits, const char * note = "")
+{
+  printf("%-12s %8d %12.1f %10llu %8lu %12.3f%s\n", result.name, commits,
+         (double)result.totalUs / commits, (unsigned long long)result.maxUs,
+         result.syncs, result.totalUs / 1000.0, note);
+}
+
+int main(int argc, char ** argv)
+{
+  int commits = 1000;
+  unsigned long batchMs = MMAP_STORAGE_SYNC_MS;
+  std::string path = "zimstorage.bin";
+  int opt;
+  while((opt = getopt(argc, argv, "n:b:f:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'n': commits = atoi(optarg); break;
+      case 'b': batchMs = strtoul(optarg, NULL, 0); break;
+      case 'f': path = optarg; break;
+      default:  usage();
+    }
+  }
+  if(optind != argc || commits <= 0)
+    usage();
+
+  printf("backend       commits   mean us/commit   max us    syncs     total ms\n");
+
+  EepromStorage eeprom;
+  print(run("eeprom", &eeprom, commits, true), commits, "  (modelled)");
+
+  static byte ram[BENCH_STORAGE_SIZE];
+  RamStorage ramStorage(ram, sizeof(ram));
+  print(run("ram", &ramStorage, commits, false), commits);
+
+  RewriteStorage rewrite(ram, sizeof(ram), path);
+  print(run("rewrite", &rewrite, commits, false), commits);
+  unlink(path.c_str());
+
+  {
+    MmapStorage mmapSync(0);
+    if(!mmapSync.open(path.c_str(), BENCH_STORAGE_SIZE))
+    {
+      fprintf(stderr, "%s: %s\n", path.c_str(), mmapSync.error_.c_str());
+      return 1;
+    }
+    Result result = run("mmap-sync", &mmapSync, commits, false);
+    result.syncs = mmapSync.syncs_;
+    print(result, commits);
+  }
+  unlink(path.c_str());
+
+  {
+    MmapStorage mmapBatch(batchMs);
+    mmapBatch.open(path.c_str(), BENCH_STORAGE_SIZE);
+    Result result = run("mmap-batch", &mmapBatch, commits, false);
+    uint64_t startUs = nowUs();
+    mmapBatch.sync(true);
+    uint64_t us = nowUs() - startUs;
+    result.totalUs += us;
+    result.maxUs = std::max(result.maxUs, us);
+    result.syncs = mmapBatch.syncs_;
+    print(result, commits);
+  }
+  unlink(path.c_str());
+  return 0;
+}
@@ -0,0 +1,209 @@
+// Zim Cartridge Emulator Tag Codec Check
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// Compares the MegaLCD sketch's TagCodec, see TagCodec.h, with the hand
+// written packing Rfid.cpp had before it, on random cartridges and tag
+// images.
+//
+//   zimtagcheck [-n cases] [-s seed]
+//
+// Each case checks that
+//   - encode() gives the old bytes for values that fit their field
+//   - encode() of values wider than their field gives the bytes of the
+//     values cut to it, nothing spills into the next field
+//   - decode() of a random image gives the old fields
+//   - decode() of a staged commit, some pages written over the live image,
+//     gives the old fields
+// Exits 1 on any mismatch.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <Arduino.h>
+#include "TagCodec.h"
+
+static void usage()
+{
+  fprintf(stderr, "usage: zimtagcheck [-n cases] [-s seed]\n"
+                  "  -n     random cases, default 1000000\n"
+                  "  -s     seed, default 1\n");
+  exit(2);
+}
+
+// Rfid::buildCartridgePayload() before TagCodec
+static void oldEncode(const CartridgeData & data, byte * pdata)
+{
+  int index = 0;
+  pdata[index++] = data.magicNum_>>8;
+  pdata[index++] = data.magicNum_ & 0xFF;
+  pdata[index++] = data.type_<<4 | (data.material_ & Material::Mask);
+  pdata[index++] = data.red_;
+  pdata[index++] = data.green_;
+  pdata[index++] = data.blue_;
+  pdata[index++] = (data.initLen_>>12) & 0xFF;
+  pdata[index++] = (data.initLen_>>4) & 0xFF;
+  pdata[index++] = (data.initLen_<<4 | data.usedLen_>>16) & 0xFF;
+  pdata[index++] = (data.usedLen_>>8) & 0xFF;
+  pdata[index++] = (data.usedLen_) & 0xFF;
+  pdata[index++] = data.tempPrint_;
+  pdata[index++] = data.tempFirst_;
+  pdata[index++] = data.date_>>8;
+  pdata[index++] = data.date_ & 0xFF;
+
+  byte xorVal = 0;
+  for(int i=0; i<index; ++i)
+    xorVal ^= pdata[i];
+  pdata[index++] = xorVal;
+}
+
+// Rfid::applyCartridgePayload() before TagCodec
+static void oldDecode(const byte * pdata, CartridgeData & data)
+{
+  data.magicNum_  = pdata[0]<<8;
+  data.magicNum_ |= pdata[1];
+  data.type_      = CartridgeType::Type(pdata[2]>>4);
+  data.material_  = Material::Type(pdata[2] & Material::Mask);
+  data.red_       = pdata[3];
+  data.green_     = pdata[4];
+  data.blue_      = pdata[5];
+  data.initLen_   = ((long)pdata[6])<<12;
+  data.initLen_  |= ((long)pdata[7])<<4;
+  data.initLen_  |= ((long)pdata[8]&0xF0)>>4;
+  data.usedLen_   = ((long)pdata[8]&0x0F)<<16;
+  data.usedLen_  |= ((long)pdata[9])<<8;
+  data.usedLen_  |= ((long)pdata[10]);
+  data.tempPrint_ = pdata[11];
+  data.tempFirst_ = pdata[12];
+  data.date_      = pdata[13]<<8;
+  data.date_     |= pdata[14];
+  data.xor_       = pdata[15];
+}
+
+static uint32_t random32()
+{
+  return (uint32_t)rand() << 16 ^ (uint32_t)rand();
+}
+
+// A cartridge with every field in range, or with the wider ones past it
+static CartridgeData randomCartridge(bool wide)
+{
+  CartridgeData data(random32() & 0xFFFF);
+  uint32_t mask = wide ? 0xFFFFFFFFUL : 0;
+  data.magicNum_  = random32() & (0xFFFF | mask);
+  data.type_      = CartridgeType::Type(random32() & (0x0F | (mask & 0xFF)));
+  data.material_  = Material::Type(random32() & (0x0F | (mask & 0xFF)));
+  data.red_       = random32();
+  data.green_     = random32();
+  data.blue_      = random32();
+  data.initLen_   = random32() & (0xFFFFF | mask);
+  data.usedLen_   = random32() & (0xFFFFF | mask);
+  data.tempPrint_ = random32();
+  data.tempFirst_ = random32();
+  data.date_      = random32() & (0xFFFF | mask);
+  return data;
+}
+
+// The cartridge with each field cut to its width in TagLayout
+static CartridgeData cutToFields(const CartridgeData & data)
+{
+  CartridgeData cut = data;
+  for(byte field=0; field<TagField::count; ++field)
+    tagSetField(cut, field, tagGetField(data, field) & tagValueMask(field));
+  return cut;
+}
+
+static bool sameFields(const CartridgeData & a, const CartridgeData & b)
+{
+  return a.id_ == b.id_ && a.magicNum_ == b.magicNum_ && a.type_ == b.type_ &&
+         a.material_ == b.material_ && a.red_ == b.red_ && a.green_ == b.green_ &&
+         a.blue_ == b.blue_ && a.initLen_ == b.initLen_ && a.usedLen_ == b.usedLen_ &&
+         a.tempPrint_ == b.tempPrint_ && a.tempFirst_ == b.tempFirst_ &&
+         a.date_ == b.date_ && a.xor_ == b.xor_;
+}
+
+static bool check(bool ok, const char * what, long n, long & failures)
+{
+  if(!ok && failures++ < 10)
+    fprintf(stderr, "case %ld: %s mismatch\n", n, what);
+  return ok;
+}
+
+int main(int argc, char ** argv)
+{
+  long cases = 1000000;
+  unsigned int seed = 1;
+  int opt;
+  while((opt = getopt(argc, argv, "n:s:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'n': cases = strtol(optarg, NULL, 0); break;
+      case 's': seed = strtoul(optarg, NULL, 0); break;
+      default:  usage();
+    }
+  }
+  if(optind != argc || cases <= 0)
+    usage();
+  srand(seed);
+
+  long failures = 0;
+  for(long n=0; n<cases; ++n)
+  {
+    // encode() leaves nothing of what the buffer held
+    byte expected[CARTRIDGE_DATA_LENGTH];
+    byte image[CARTRIDGE_DATA_LENGTH];
+    memset(image, random32(), sizeof(image));
+
+    CartridgeData data = randomCartridge(false);
+    oldEncode(data, expected);
+    TagCodec::encode(data, image);
+    check(memcmp(expected, image, sizeof(image)) == 0, "encode", n, failures);
+
+    CartridgeData wide = randomCartridge(true);
+    oldEncode(cutToFields(wide), expected);
+    memset(image, random32(), sizeof(image));
+    TagCodec::encode(wide, image);
+    check(memcmp(expected, image, sizeof(image)) == 0, "wide encode", n, failures);
+    CartridgeData back(wide.id_);
+    TagCodec::decode(image, back);
+    CartridgeData cut = cutToFields(wide);
+    cut.xor_ = image[CARTRIDGE_DATA_LENGTH - 1];
+    check(sameFields(back, cut), "wide decode", n, failures);
+
+    for(int i=0; i<CARTRIDGE_DATA_LENGTH; ++i)
+      image[i] = random32();
+    CartridgeData oldData(data.id_);
+    CartridgeData newData(data.id_);
+    oldDecode(image, oldData);
+    TagCodec::decode(image, newData);
+    check(sameFields(oldData, newData), "decode", n, failures);
+
+    // A staged commit, the shadow starts from the live image and the last
+    // page is always written, see Rfid::stagePage()
+    byte pages = (random32() & (TagCodec::allPages >> 1)) | (TagCodec::allPages ^ (TagCodec::allPages >> 1));
+    byte stage[CARTRIDGE_DATA_LENGTH];
+    oldEncode(data, stage);
+    for(int page=0; page<CARTRIDGE_DATA_LENGTH / TAG_PAGE_BYTES; ++page)
+    {
+      if(pages & (1 << page))
+        memcpy(&stage[page * TAG_PAGE_BYTES], &image[page * TAG_PAGE_BYTES], TAG_PAGE_BYTES);
+    }
+    oldData = data;
+    newData = data;
+    oldDecode(stage, oldData);
+    TagCodec::decode(stage, newData, pages);
+    check(sameFields(oldData, newData), "staged decode", n, failures);
+  }
+
+  printf("%ld cases, %ld mismatches\n", cases, failures);
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,389 @@
+// Zim Cartridge Emulator Trace
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// Decodes the binary debug records of the MegaLCD sketch (see Trace.h) back
+// into the text the sketch prints with TRACE_BINARY set to 0. Text output is
+// passed through, console frames are skipped.
+//
+//   zimtrace [-t] [-d device | file]
+//
+// Reads the debug port given with -d, a capture file, or stdin. -t prefixes
+// each decoded record with its millis().
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "ZimConsole.h"
+
+#define TRACE_SYNC          0xA5
+#define TRACE_ESCAPE        0xA6
+#define TRACE_ESCAPE_XOR    0x20
+#define TRACE_PORT_SHIFT    6
+
+// Mirrors TraceEvent in the MegaLCD sketch
+namespace TraceEvent
+{
+  enum Type
+  {
+    time          = 0x01,
+    rxTimeout     = 0x10,
+    stageDropped  = 0x11,
+    logsDropped   = 0x12,
+    frame         = 0x13,
+    cartridge     = 0x14,
+    firstResponse = 0x15,
+    save          = 0x16,
+    overflow      = 0x17
+  };
+}
+
+// Rfid names in the sketch, by port
+static const char * PortNames[] = { "Left Cartridge", "Right Cartridge" };
+
+static void usage()
+{
+  fprintf(stderr, "usage: zimtrace [-t] [-d device | file]\n"
+                  "  -t     prefix decoded records with millis()\n"
+                  "  -d     read the debug port of a board\n");
+  exit(2);
+}
+
+static std::string portName(int port)
+{
+  if(port < (int)(sizeof(PortNames)/sizeof(PortNames[0])))
+    return PortNames[port];
+  char text[16];
+  snprintf(text, sizeof(text), "Port %d", port);
+  return text;
+}
+
+// Same text as formatMetres() in the sketch
+static std::string metres(long mm)
+{
+  char text[24];
+  unsigned long value = mm < 0 ? 0UL - (unsigned long)mm : (unsigned long)mm;
+  snprintf(text, sizeof(text), "%s%lu.%03lu", mm < 0 ? "-" : "", value / 1000, value % 1000);
+  return text;
+}
+
+/// Turns the byte stream into text
+class Decoder
+{
+public:
+  Decoder(bool timestamps);
+  void feed(byte rx);
+
+private:
+  enum State
+  {
+    text,
+    consoleStart,   // 0xAA seen
+    consoleLen,
+    console,        // skipping a console frame
+    record,
+    recordEscape
+  };
+
+  void onRecord();
+  void onCartridge(const byte * p, bool received);
+  void stamp();
+
+  bool              timestamps_;
+  State             state_;
+  int               skip_;
+  std::vector<byte> record_;
+  unsigned long     high_;        // millis() >> 16 from the last time record
+  unsigned long     ms_;
+  int               pendingPort_; // port of a frame waiting for its cartridge record
+};
+
+Decoder::Decoder(bool timestamps) :
+    timestamps_(timestamps),
+    state_(text),
+    skip_(0),
+    high_(0),
+    ms_(0),
+    pendingPort_(-1)
+{
+}
+
+void
+Decoder::feed(byte rx)
+{
+  // a sync byte always starts over, the sketch escapes them in records
+  if(rx == TRACE_SYNC && state_ != console)
+  {
+    if(state_ == record || state_ == recordEscape)
+      printf("<truncated trace record>\n");
+    record_.clear();
+    state_ = record;
+    return;
+  }
+
+  switch(state_)
+  {
+    case text:
+      if(rx == 0xAA)
+        state_ = consoleStart;
+      else
+        putchar(rx);
+      break;
+
+    case consoleStart:
+      if(rx == 0xBB)
+      {
+        state_ = consoleLen;
+      }
+      else
+      {
+        putchar(0xAA);
+        state_ = text;
+        feed(rx);
+      }
+      break;
+
+    case consoleLen:
+      skip_ = rx + 1; // and the XOR
+      state_ = console;
+      break;
+
+    case console:
+      if(--skip_ == 0)
+        state_ = text;
+      break;
+
+    case record:
+      if(rx == TRACE_ESCAPE)
+      {
+        state_ = recordEscape;
+        break;
+      }
+      if(rx == 0xAA)
+      {
+        printf("<truncated trace record>\n");
+        state_ = consoleStart;
+        break;
+      }
+      // falls through...
+
+    case recordEscape:
+      if(state_ == recordEscape)
+      {
+        rx ^= TRACE_ESCAPE_XOR;
+        state_ = record;
+      }
+      record_.push_back(rx);
+      // event, msecs, len, fields, xor
+      if(record_.size() >= 4 && record_.size() == 5u + record_[3])
+      {
+        onRecord();
+        state_ = text;
+      }
+      break;
+  }
+  if(state_ == text && rx == '\n')
+    fflush(stdout);
+}
+
+void
+Decoder::stamp()
+{
+  if(timestamps_)
+    printf("[%10lu] ", ms_);
+}
+
+void
+Decoder::onRecord()
+{
+  byte xorVal = 0;
+  for(size_t i=0; i<record_.size() - 1; ++i)
+    xorVal ^= record_[i];
+  if(xorVal != record_.back())
+  {
+    printf("<bad trace record XOR>\n");
+    return;
+  }
+
+  int event = record_[0] & ((1 << TRACE_PORT_SHIFT) - 1);
+  int port = record_[0] >> TRACE_PORT_SHIFT;
+  ms_ = high_ << 16 | zimGet(record_, 1, 2);
+  const byte * p = &record_[4];
+  int len = record_[3];
+  std::string name = portName(port);
+
+  switch(event)
+  {
+    case TraceEvent::time:
+      ms_ = zimGet(record_, 4, 4);
+      high_ = ms_ >> 16;
+      break;
+
+    case TraceEvent::rxTimeout:
+      stamp();
+      printf("Rx timeout\n");
+      break;
+
+    case TraceEvent::stageDropped:
+      stamp();
+      printf("Staged tag write dropped for %s\n", name.c_str());
+      break;
+
+    case TraceEvent::logsDropped:
+      stamp();
+      printf("%lu frame logs dropped for %s\n", zimGet(record_, 4, 2), name.c_str());
+      break;
+
+    case TraceEvent::frame:
+    {
+      int count = len - 6;
+      stamp();
+      printf("Received %d bytes from Zim for %s\n", count, name.c_str());
+      printf("FuncCode:%lX\n", zimGet(record_, 4, 2));
+      printf("Payload Length:%X\n", p[2]);
+      printf("Data:");
+      for(int i=0; i<count; ++i)
+        printf("0x%X ", p[6 + i]);
+      printf("\n");
+      if(p[4] != 0)
+        printf("%s%d bytes to Zim for %s\n", p[3] == 0 ? "Sent " : "Sent NAK, ", p[4], name.c_str());
+      if(p[5] & 0x01)
+        pendingPort_ = port;
+      else
+        printf("\n");
+      break;
+    }
+
+    case TraceEvent::cartridge:
+      if(pendingPort_ == port)
+      {
+        printf("Cartridge data received from Zim for %s:\n", name.c_str());
+        onCartridge(p, true);
+        pendingPort_ = -1;
+      }
+      else
+      {
+        stamp();
+        onCartridge(p, false);
+      }
+      break;
+
+    case TraceEvent::firstResponse:
+      stamp();
+      printf("First response for %s after %lu ms\n", name.c_str(), zimGet(record_, 4, 4));
+      break;
+
+    case TraceEvent::save:
+      stamp();
+      printf("Saving cartridge data to eeprom for: %s at location: %lX\n",
+             name.c_str(), zimGet(record_, 4, 2));
+      break;
+
+    case TraceEvent::overflow:
+      stamp();
+      printf("Your spool runneth over\n");
+      break;
+
+    default:
+      stamp();
+      printf("<unknown trace event 0x%02X>\n", event);
+      break;
+  }
+  fflush(stdout);
+}
+
+// Fields as Trace::cartridge() sends them, printed like Rfid::printCartridgeData()
+void
+Decoder::onCartridge(const byte * p, bool received)
+{
+  std::vector<byte> f(p, p + 24);
+  printf("Name: %s\n", portName(record_[0] >> TRACE_PORT_SHIFT).c_str());
+  printf("ID: 0x%lX\n", zimGet(f, 2, 2));
+  printf("EEPROM Location: 0x%lX\n", zimGet(f, 0, 2));
+  printf("Magic Number: 0x%lX\n", zimGet(f, 4, 2));
+  printf("Type:%d\n", f[6]);
+  printf("Material:%d\n", f[7]);
+  printf("Red: 0x%X\n", f[8]);
+  printf("Green: 0x%X\n", f[9]);
+  printf("Blue: 0x%X\n", f[10]);
+  printf("Initial Length: %s m\n", metres((int32_t)zimGet(f, 11, 4)).c_str());
+  printf("Used Length: %s m\n", metres((int32_t)zimGet(f, 15, 4)).c_str());
+  printf("Temp Print: %d C\n", f[19] + 100);
+  printf("Temp Start: %d C\n", f[20] + 100);
+  printf("Date: 0x%lX\n", zimGet(f, 21, 2));
+  printf("Xor: 0x%X\n", f[23]);
+  printf("\n");
+  if(received)
+    printf("\n");
+}
+
+int main(int argc, char ** argv)
+{
+  bool timestamps = false;
+  const char * device = NULL;
+  int opt;
+  while((opt = getopt(argc, argv, "td:")) != -1)
+  {
+    switch(opt)
+    {
+      case 't': timestamps = true; break;
+      case 'd': device = optarg; break;
+      default:  usage();
+    }
+  }
+  if(optind < argc - 1 || (device && optind != argc))
+    usage();
+
+  int fd = 0;
+  const char * path = device ? device : optind < argc ? argv[optind] : NULL;
+  if(path && strcmp(path, "-") != 0)
+  {
+    fd = open(path, O_RDONLY | O_NOCTTY);
+    if(fd < 0)
+    {
+      fprintf(stderr, "%s: %s\n", path, strerror(errno));
+      return 1;
+    }
+  }
+
+  termios tio;
+  if(device && tcgetattr(fd, &tio) == 0)
+  {
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, B57600);
+    cfsetospeed(&tio, B57600);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cflag &= ~HUPCL;
+    tcsetattr(fd, TCSANOW, &tio);
+  }
+
+  Decoder decoder(timestamps);
+  byte buffer[256];
+  for(;;)
+  {
+    ssize_t n = read(fd, buffer, sizeof(buffer));
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n <= 0)
+      break;
+    for(ssize_t i=0; i<n; ++i)
+      decoder.feed(buffer[i]);
+  }
+  fflush(stdout);
+  return 0;
+}
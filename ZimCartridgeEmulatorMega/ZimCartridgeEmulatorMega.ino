@@ -22,6 +22,8 @@
 #define CARTRIDGE_MAGIC_NUMBER      0x5C12 // should be 0x5C12. You can change->run->change back to reset EEPROM though.
 #define RFID_BAUD_RATE              19200
 #define RX_TIMEOUT                  2000 // msecs timeout on receives
+#define STAGE_TIMEOUT               2000 // msecs from the first page write to page 9 before the staged pages are dropped
+#define RFID_STATUS_NAK             0x01 // reply status for unknown commands
 
 
 namespace CartridgeType
@@ -104,13 +106,13 @@ Cartridge::Cartridge(int id, int eepromLoc) :
     magicNum_(0x5C12),
     type_(CartridgeType::refillable),
     material_(Material::PLA),
-    red_(0x00),
-    green_(0x00),
-    blue_(0x00),
+    red_(0xFF),
+    green_(0xFF),
+    blue_(0xFF),
     initLen_(200000),
     usedLen_(0),
-    tempPrint_(0x55),
-    tempStart_(0x5F),
+    tempPrint_(0x5F),
+    tempStart_(0x55),
     date_(0x0217),
     xor_(0)
 {  
@@ -144,8 +146,9 @@ public:
   Rfid(String name, HardwareSerial * serial, Cartridge cartridge);
   void runFsm();
   void handleRequest(RfidCommand::Type funcCode, byte * preq, int len);
-  void sendResponse(byte * pPayload, int len);
+  void sendResponse(byte * pPayload, int len, byte status = 0);
   int  buildCartridgePayload(byte * pdata);
+  void applyCartridgePayload(const byte * pdata);
   void printCartridgeData();
 
   String name_;
@@ -154,6 +157,9 @@ public:
   Payload payload_;
   HardwareSerial * serial_;
   unsigned long timeout;
+  byte stage_[CARTRIDGE_DATA_LENGTH]; // tag image being written by the Zim
+  byte stagedPages_;                  // bit per page written since page 9
+  unsigned long stageMs_;
   
 };
 
@@ -203,7 +209,9 @@ Rfid::Rfid(String name, HardwareSerial * serial, Cartridge cartridge) :
                                 cartridge_(cartridge),
                                 state_(SerialState::idle),
                                 serial_(serial),
-                                timeout(0)
+                                timeout(0),
+                                stagedPages_(0),
+                                stageMs_(0)
 {  
 }
 
@@ -220,11 +228,16 @@ Rfid::runFsm()
     state_ = SerialState::idle;
   }
 
+  if(stagedPages_ != 0 &&
+     (millis() - stageMs_) > STAGE_TIMEOUT)
+  {
+    Serial.println("Staged tag write dropped");
+    stagedPages_ = 0;
+  }
+
   if(serial_->available())
   {
     rx = (byte)serial_->read();
-    Serial.print(rx, HEX);
-    Serial.print(" ");
   
     switch(state_)
     {
@@ -316,6 +329,8 @@ Rfid::runFsm()
         // falls through...
       
       case SerialState::complete:  
+        // reply first, the dump would hold it up
+        handleRequest(payload_.funcCode_, payload_.payload_, payload_.len_);
         Serial.print("\nReceived ");
         Serial.print(payload_.index_);
         Serial.print(" bytes from Zim for ");
@@ -332,8 +347,6 @@ Rfid::runFsm()
           Serial.print(" ");
         }
         Serial.println("");
-           
-        handleRequest(payload_.funcCode_, payload_.payload_, payload_.len_);
         state_ = SerialState::idle;
         break;
   
@@ -346,7 +359,7 @@ Rfid::runFsm()
 // Generates responses for Mifare protocol.
 // Format is: uint16 header (0xAABB) - uint16 len - uint16 nodeId - uint16 func code - uint8 status - uint8 n data - uint8 XOR
 void 
-Rfid::sendResponse(byte * pPayload, int len)
+Rfid::sendResponse(byte * pPayload, int len, byte status)
 {
   int  index = 0;
   int  pktLen = 0;
@@ -362,7 +375,7 @@ Rfid::sendResponse(byte * pPayload, int len)
   rsp[index++] = payload_.addr_>>8;
   rsp[index++] = payload_.funcCode_ & 0xFF;
   rsp[index++] = payload_.funcCode_>>8;
-  rsp[index++] = 0; // status: success
+  rsp[index++] = status; // 0 is success
 
   // stuff payload
   if(pPayload != NULL)
@@ -387,15 +400,15 @@ Rfid::sendResponse(byte * pPayload, int len)
   rsp[index++] = xorVal;
   rspLen = index;
 
-  Serial.print("Sending ");
-  Serial.print(rspLen);
-  Serial.print(" bytes to Zim for ");
-  Serial.println(name_);
-
   for(int i=0; i<rspLen; ++i)
   {
       serial_->write(rsp[i]);
   }
+
+  Serial.print("Sent ");
+  Serial.print(rspLen);
+  Serial.print(" bytes to Zim for ");
+  Serial.println(name_);
 }
 
 // Handles Mifare requests specific to Zim, and sends appropriate responses
@@ -412,6 +425,13 @@ Rfid::handleRequest(RfidCommand::Type funcCode, byte * preq, int len)
     }
     break;
     
+    case RfidCommand::setNode:
+    {
+      Serial.println("Set Node");
+      sendResponse(NULL, 0);
+    }
+    break;
+
     case RfidCommand::setAntennaStatus:
     {   
       Serial.println("Set Antenna Status");     
@@ -469,37 +489,24 @@ Rfid::handleRequest(RfidCommand::Type funcCode, byte * preq, int len)
       Serial.print("Mifare Write for page ");
       Serial.println(page);
 
-      if(page == 6)
-      {
-        cartridge_.magicNum_ = preq[1]<<8;
-        cartridge_.magicNum_ |= preq[2];
-        cartridge_.type_ = CartridgeType::Type(preq[3]>>4);
-        cartridge_.material_ = Material::Type(preq[3] & 0x0F);
-        cartridge_.red_ = preq[4];
-        
-      }
-      else if(page == 7)
+      // Pages are staged and applied together when page 9 arrives, so a
+      // read between the writes never sees a half written tag
+      if(page >= 6 && page <= 9)
       {
-        cartridge_.green_    = preq[1];
-        cartridge_.blue_     = preq[2];
-        cartridge_.initLen_  = ((long)preq[3])<<12;
-        cartridge_.initLen_ |= ((long)preq[4])<<4;        
-      }
-      else if(page == 8)
-      {
-        cartridge_.initLen_ |= ((long)preq[1])>>4;
-        cartridge_.usedLen_  = ((long)preq[1])<<16;
-        cartridge_.usedLen_ |= ((long)preq[2])<<8;
-        cartridge_.usedLen_ |= ((long)preq[3]); 
-        cartridge_.tempPrint_ = preq[4];
-        
+        if(stagedPages_ == 0)
+        {
+          buildCartridgePayload(stage_);
+          stageMs_ = millis();
+        }
+        memcpy(&stage_[(page - 6) * 4], &preq[1], 4);
+        stagedPages_ |= 1 << (page - 6);
       }
-      else if(page == 9)
+      sendResponse(NULL, 0);
+
+      if(page == 9)
       {
-        cartridge_.tempStart_ = preq[1];
-        cartridge_.date_    = preq[2]<<8;
-        cartridge_.date_   |= preq[3];
-        cartridge_.xor_  = preq[4];  
+        applyCartridgePayload(stage_);
+        stagedPages_ = 0;
 
         Serial.print("Cartridge data received from Zim for ");
         Serial.print(name_);
@@ -516,14 +523,13 @@ Rfid::handleRequest(RfidCommand::Type funcCode, byte * preq, int len)
         int eepromLocation = cartridge_.eepromLoc_;
         EEPROM.put(eepromLocation, cartridge_);       
       }
-      
-      sendResponse(NULL, 0);
     }
     break;
     
     default:
       Serial.print("Unhandled request: 0x");
       Serial.println(funcCode, HEX);
+      sendResponse(NULL, 0, RFID_STATUS_NAK);
     break;    
   }
   Serial.println("");
@@ -535,7 +541,7 @@ Rfid::buildCartridgePayload(byte * pdata)
   int index = 0;
   pdata[index++] = cartridge_.magicNum_>>8;
   pdata[index++] = cartridge_.magicNum_ & 0xFF;
-  pdata[index++] = cartridge_.type_<<4 | cartridge_.material_ & Material::Mask;
+  pdata[index++] = cartridge_.type_<<4 | (cartridge_.material_ & Material::Mask);
   pdata[index++] = cartridge_.red_;
   pdata[index++] = cartridge_.green_;
   pdata[index++] = cartridge_.blue_;
@@ -558,6 +564,30 @@ Rfid::buildCartridgePayload(byte * pdata)
   return index;
 }
 
+// Inverse of buildCartridgePayload, sets the cartridge from a tag image
+void
+Rfid::applyCartridgePayload(const byte * pdata)
+{
+  cartridge_.magicNum_  = pdata[0]<<8;
+  cartridge_.magicNum_ |= pdata[1];
+  cartridge_.type_      = CartridgeType::Type(pdata[2]>>4);
+  cartridge_.material_  = Material::Type(pdata[2] & Material::Mask);
+  cartridge_.red_       = pdata[3];
+  cartridge_.green_     = pdata[4];
+  cartridge_.blue_      = pdata[5];
+  cartridge_.initLen_   = ((long)pdata[6])<<12;
+  cartridge_.initLen_  |= ((long)pdata[7])<<4;
+  cartridge_.initLen_  |= ((long)pdata[8]&0xF0)>>4;
+  cartridge_.usedLen_   = ((long)pdata[8]&0x0F)<<16;
+  cartridge_.usedLen_  |= ((long)pdata[9])<<8;
+  cartridge_.usedLen_  |= ((long)pdata[10]);
+  cartridge_.tempPrint_ = pdata[11];
+  cartridge_.tempStart_ = pdata[12];
+  cartridge_.date_      = pdata[13]<<8;
+  cartridge_.date_     |= pdata[14];
+  cartridge_.xor_       = pdata[15];
+}
+
 void 
 Rfid::printCartridgeData()
 {
@@ -0,0 +1,160 @@
+// Zim Cartridge Emulator
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "Cadence.h"
+
+Cadence::Cadence() :
+                                hits_(0),
+                                misses_(0),
+                                prestaged_(0),
+                                savedUs_(0),
+                                numSlots_(0),
+                                last_(CADENCE_SLOTS),
+                                predicted_(CADENCE_SLOTS),
+                                receiving_(false),
+                                startUs_(0),
+                                replyUs_(0)
+{
+  memset(slots_, 0, sizeof(slots_));
+}
+
+/// First byte of a request
+void
+Cadence::requestStarted(unsigned long nowUs)
+{
+  receiving_ = true;
+  startUs_ = nowUs;
+}
+
+/// Request dropped before it was parsed, on an RX timeout. Nothing is
+/// expected until the next reply, and the request after it isn't learnt as
+/// a successor.
+void
+Cadence::requestAbandoned()
+{
+  receiving_ = false;
+  last_ = CADENCE_SLOTS;
+  predicted_ = CADENCE_SLOTS;
+}
+
+/// Request parsed, scores the prediction and learns the successor and, if
+/// the request was that successor, the gap to it
+void
+Cadence::requestDone(uint16_t funcCode)
+{
+  byte current = slotFor(funcCode);
+  if(predicted_ != CADENCE_SLOTS)
+  {
+    if(predicted_ == current)
+      ++hits_;
+    else
+      ++misses_;
+  }
+
+  if(last_ != CADENCE_SLOTS)
+  {
+    Slot & slot = slots_[last_];
+    if(slot.next_ == current)
+    {
+      if(slot.confidence_ < 3)
+        ++slot.confidence_;
+    }
+    else if(slot.confidence_ > 0)
+    {
+      --slot.confidence_;
+    }
+    else
+    {
+      slot.next_ = current;
+      slot.timed_ = false;
+    }
+
+    unsigned long gap = startUs_ - replyUs_;
+    if(slot.next_ == current && gap <= CADENCE_MAX_GAP_MS * 1000UL)
+    {
+      if(!slot.timed_)
+      {
+        slot.gapUs_ = gap;
+        slot.jitterUs_ = 0;
+        slot.timed_ = true;
+      }
+      else
+      {
+        long error = (long)(gap - slot.gapUs_);
+        slot.gapUs_ += error / 8;
+        long deviation = (error < 0 ? -error : error) - (long)slot.jitterUs_;
+        slot.jitterUs_ += deviation / 4;
+      }
+    }
+  }
+  last_ = current;
+  predicted_ = CADENCE_SLOTS;
+}
+
+/// Reply sent, or the request needed none. Predicts the next request.
+void
+Cadence::replied(unsigned long nowUs)
+{
+  receiving_ = false;
+  replyUs_ = nowUs;
+  if(last_ != CADENCE_SLOTS && slots_[last_].confidence_ >= CADENCE_CONFIDENT)
+    predicted_ = slots_[last_].next_;
+}
+
+/// funcCode of the expected request, 0 if there is no prediction
+uint16_t
+Cadence::predicted()
+{
+  return predicted_ == CADENCE_SLOTS ? 0 : slots_[predicted_].funcCode_;
+}
+
+/// Time until the earliest the predicted request is expected, 0 while one
+/// is being received or is due, CADENCE_NO_REQUEST if nothing is expected
+/// or the request is overdue past the window
+unsigned long
+Cadence::usUntilRequest()
+{
+  if(receiving_)
+  {
+    return 0;
+  }
+  if(predicted_ == CADENCE_SLOTS || !slots_[last_].timed_)
+  {
+    return CADENCE_NO_REQUEST;
+  }
+
+  const Slot & slot = slots_[last_];
+  unsigned long margin = 2 * slot.jitterUs_ + CADENCE_GUARD_US;
+  unsigned long earliest = slot.gapUs_ > margin ? slot.gapUs_ - margin : 0;
+  unsigned long latest = slot.gapUs_ + 2 * slot.jitterUs_ + CADENCE_LATE_US;
+  unsigned long elapsed = micros() - replyUs_;
+  if(elapsed > latest)
+  {
+    return CADENCE_NO_REQUEST;
+  }
+  return elapsed < earliest ? earliest - elapsed : 0;
+}
+
+byte
+Cadence::slotFor(uint16_t funcCode)
+{
+  for(byte i=0; i<numSlots_; ++i)
+  {
+    if(slots_[i].funcCode_ == funcCode)
+      return i;
+  }
+  if(numSlots_ == CADENCE_SLOTS)
+  {
+    return CADENCE_SLOTS - 1;
+  }
+  slots_[numSlots_].funcCode_ = funcCode;
+  slots_[numSlots_].next_ = CADENCE_SLOTS - 1;
+  return numSlots_++;
+}
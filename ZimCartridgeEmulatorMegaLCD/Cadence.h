@@ -0,0 +1,65 @@
+// Zim Cartridge Emulator
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+#ifndef Cadence_h
+#define Cadence_h
+
+#include <Arduino.h>
+
+#define CADENCE_SLOTS           10          // commands tracked, the last slot takes any others
+#define CADENCE_CONFIDENT       2           // times a successor must follow before it is predicted
+#define CADENCE_MAX_GAP_MS      10000       // longer gaps are a new session, not cadence
+#define CADENCE_GUARD_US        500         // margin before the earliest expected request
+#define CADENCE_LATE_US         2000        // margin after the latest before the prediction lapses
+#define CADENCE_NO_REQUEST      0xFFFFFFFFUL // usUntilRequest() with nothing expected
+
+/// Learns the Zim's polling pattern on one port: for each command the one
+/// that usually follows it and the gap from its reply to that request, as a
+/// moving average and mean deviation. After a reply it predicts the next
+/// command and the window it should arrive in, so Rfid can build the reply
+/// ahead and the scheduler can keep deferred work out of the window.
+class Cadence
+{
+public:
+  Cadence();
+  void requestStarted(unsigned long nowUs);
+  void requestAbandoned();
+  void requestDone(uint16_t funcCode);
+  void replied(unsigned long nowUs);
+  uint16_t predicted();
+  unsigned long usUntilRequest();
+
+  unsigned long     hits_;        // requests that were the predicted command
+  unsigned long     misses_;      // requests that were not
+  unsigned long     prestaged_;   // replies sent from a prestaged frame
+  unsigned long     savedUs_;     // build time of those replies, taken off their latency
+
+private:
+  struct Slot
+  {
+    uint16_t        funcCode_;
+    byte            next_;        // slot of the usual successor
+    byte            confidence_;  // saturating, up on a repeat, down on a change
+    unsigned long   gapUs_;       // reply to the successor's first byte
+    unsigned long   jitterUs_;
+    bool            timed_;       // gapUs_ holds a sample
+  };
+
+  byte slotFor(uint16_t funcCode);
+
+  Slot              slots_[CADENCE_SLOTS];
+  byte              numSlots_;
+  byte              last_;        // slot of the last request, CADENCE_SLOTS if none
+  byte              predicted_;   // slot expected next, CADENCE_SLOTS if none
+  bool              receiving_;
+  unsigned long     startUs_;     // first byte of the request being received
+  unsigned long     replyUs_;     // end of the last reply
+};
+
+#endif
@@ -8,6 +8,7 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 // THE SOFTWARE.
 
+#include <util/crc16.h>
 #include "Cartridge.h"
 
 
@@ -66,7 +67,7 @@ ColorEnum::Type & operator++(ColorEnum::Type & color)
   
 CartridgeData::CartridgeData(int id) :
     id_(id),
-    magicNum_(0x5C12),
+    magicNum_(CARTRIDGE_MAGIC_NUMBER),
     type_(CartridgeType::refillable),
     material_(Material::PLA),
     red_(0xFF),
@@ -104,11 +105,51 @@ const char* Cartridge::Colors[]=
   "Pink"
 };
 
-Cartridge::Cartridge(int id, int eepromLoc) : data_(id),
-                                              eepromLoc_(eepromLoc)
+Cartridge::Cartridge(int id, int eepromLoc, Storage * pStorage) : data_(id),
+                                              eepromLoc_(eepromLoc),
+                                              pStorage_(pStorage)
 {                                      
 }
 
+/// Restore the cartridge from storage with a single read into the live data.
+/// Falls back to defaults and returns false if the stored crc doesn't match.
+bool
+Cartridge::load()
+{
+  int id = data_.id_;
+  uint16_t stored = 0;
+  pStorage_->get(eepromLoc_, data_);
+  pStorage_->get(eepromLoc_ + sizeof(CartridgeData), stored);
+  if(stored != crc())
+  {
+    data_ = CartridgeData(id);
+    return false;
+  }
+  return true;
+}
+
+/// Write the cartridge and its crc to storage
+void
+Cartridge::save()
+{
+  pStorage_->put(eepromLoc_, data_);
+  pStorage_->put(eepromLoc_ + sizeof(CartridgeData), crc());
+  pStorage_->commit();
+}
+
+/// CRC-CCITT of the cartridge data, seeded with the EEPROM layout version
+uint16_t
+Cartridge::crc()
+{
+  uint16_t crc = 0xFF00 | CARTRIDGE_EEPROM_VERSION;
+  const byte * p = (const byte *)&data_;
+  for(unsigned int i=0; i<sizeof(CartridgeData); ++i)
+  {
+    crc = _crc_ccitt_update(crc, p[i]);
+  }
+  return crc;
+}
+
 /// Return a color string based upon the color enum
 String
 Cartridge::getMaterialStr()
@@ -11,15 +11,22 @@
 #define Cartridge_h
 
 #include <Arduino.h>
+#include "Storage.h"
 
 
 #define NEVER_ENDING_FILAMENT       0      // If set, this will ignore filament used length writes
 #define CARTRIDGE_ID_LEFT           0x1234 // unique id for cartridge (set different for left and right)
 #define CARTRIDGE_ID_RIGHT          0x5678 // unique id for cartridge (set different for left and right)
 #define CARTRIDGE_DATA_LENGTH       16
+#define CARTRIDGE_EEPROM_SIZE       (sizeof(CartridgeData) + sizeof(uint16_t)) // data + crc
 #define CARTRIDGE_LEFT_EEPROM_LOC   0
-#define CARTRIDGE_RIGHT_EEPROM_LOC  CARTRIDGE_LEFT_EEPROM_LOC + sizeof(Cartridge)
-#define CARTRIDGE_MAGIC_NUMBER      0x5C12 // should be 0x5C12. You can change/program/changeback to reset EEPROM to defaults.
+#define CARTRIDGE_RIGHT_EEPROM_LOC  CARTRIDGE_LEFT_EEPROM_LOC + CARTRIDGE_EEPROM_SIZE
+// Seeds the eeprom crc. A stored cartridge from another version fails the crc
+// and boot runs on the defaults without writing them, they reach the eeprom
+// on the next save: the console's save, a menu save or a Zim tag write.
+#define CARTRIDGE_EEPROM_VERSION    0x01
+#define CARTRIDGE_TEMPERATURE_OFFSET 100  // tag temperatures are degrees C less this
+#define CARTRIDGE_MAGIC_NUMBER      0x5C12 // should be 0x5C12
 
 namespace CartridgeType
 {
@@ -107,7 +114,10 @@ class Cartridge
 { 
 public:
 
-  Cartridge(int id, int eepromLoc);
+  Cartridge(int id, int eepromLoc, Storage * pStorage);
+  bool load();
+  void save();
+  uint16_t crc();
   String getMaterialStr();
   Material::Type nextMaterial();
   Material::Type prevMaterial();
@@ -120,7 +130,8 @@ public:
 
   
   CartridgeData       data_;
-  int                 eepromLoc_;
+  int                 eepromLoc_;   // location in pStorage_
+  Storage *           pStorage_;
   static const char*  Materials[];
   static const char*  Colors[];
 
@@ -0,0 +1,327 @@
+// Zim Cartridge Emulator
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "Console.h"
+
+Console::Console(Rfid ** pPorts, byte numPorts, HardwareSerial * serial) :
+                                pPorts_(pPorts),
+                                numPorts_(numPorts),
+                                numCommands_(0),
+                                serial_(serial),
+                                state_(ConsoleState::idle),
+                                timeout_(0),
+                                len_(0),
+                                index_(0),
+                                xor_(0)
+{
+}
+
+/// Add a command served by another module, returns false if the table is full
+bool
+Console::addCommand(byte cmd, ConsoleHandler handler, void * pContext)
+{
+  if(numCommands_ >= CONSOLE_MAX_COMMANDS)
+  {
+    return false;
+  }
+  commands_[numCommands_].cmd_ = cmd;
+  commands_[numCommands_].handler_ = handler;
+  commands_[numCommands_].pContext_ = pContext;
+  ++numCommands_;
+  return true;
+}
+
+/// True if no frame is being received
+bool
+Console::isIdle()
+{
+  return state_ == ConsoleState::idle && !serial_->available();
+}
+
+// State machine for parsing console frames
+void
+Console::runFsm()
+{
+  if(state_ != ConsoleState::idle &&
+     (millis() - timeout_) > CONSOLE_RX_TIMEOUT)
+  {
+    state_ = ConsoleState::idle;
+  }
+
+  if(!serial_->available())
+  {
+    return;
+  }
+
+  byte rx = (byte)serial_->read();
+  switch(state_)
+  {
+    case ConsoleState::idle:
+      if(rx == 0xAA)
+      {
+        timeout_ = millis();
+        state_ = ConsoleState::start;
+      }
+      break;
+
+    case ConsoleState::start:
+      state_ = (rx == 0xBB) ? ConsoleState::len : ConsoleState::idle;
+      break;
+
+    case ConsoleState::len:
+      if(rx < 2 || rx > sizeof(frame_))
+      {
+        sendReply(0, 0, ConsoleStatus::badLength, NULL, 0);
+        state_ = ConsoleState::idle;
+        break;
+      }
+      len_ = rx;
+      xor_ = rx;
+      index_ = 0;
+      state_ = ConsoleState::data;
+      break;
+
+    case ConsoleState::data:
+      frame_[index_++] = rx;
+      xor_ ^= rx;
+      if(index_ == len_)
+      {
+        state_ = ConsoleState::xorCheck;
+      }
+      break;
+
+    case ConsoleState::xorCheck:
+      if(rx != xor_)
+      {
+        sendReply(frame_[0], frame_[1], ConsoleStatus::badXor, NULL, 0);
+      }
+      else
+      {
+        handleRequest(frame_[0], frame_[1], &frame_[2], len_ - 2);
+      }
+      state_ = ConsoleState::idle;
+      break;
+
+    default:
+      state_ = ConsoleState::idle;
+      break;
+  }
+}
+
+// Executes a console command and replies
+void
+Console::handleRequest(byte cmd, byte port, byte * preq, int len)
+{
+  byte rsp[CONSOLE_MAX_DATA];
+  int  rspLen = 0;
+
+  if(cmd == ConsoleCommand::info)
+  {
+    if(7 + 4 * numPorts_ > (int)sizeof(rsp))
+    {
+      sendReply(cmd, port, ConsoleStatus::overflow, NULL, 0);
+      return;
+    }
+    unsigned long uptime = millis();
+    rsp[rspLen++] = CONSOLE_VERSION_MAJOR;
+    rsp[rspLen++] = CONSOLE_VERSION_MINOR;
+    rsp[rspLen++] = numPorts_;
+    for(int i=0; i<4; ++i)
+    {
+      rsp[rspLen++] = (uptime >> (8*i)) & 0xFF;
+    }
+    for(int port=0; port<numPorts_; ++port)
+    {
+      for(int i=0; i<4; ++i)
+      {
+        rsp[rspLen++] = (pPorts_[port]->firstResponse_ >> (8*i)) & 0xFF;
+      }
+    }
+    sendReply(cmd, port, ConsoleStatus::ok, rsp, rspLen);
+    return;
+  }
+
+  for(int i=0; i<numCommands_; ++i)
+  {
+    if(commands_[i].cmd_ == cmd)
+    {
+      ConsoleStatus::Type status = commands_[i].handler_(commands_[i].pContext_, port,
+                                                         preq, len, rsp, sizeof(rsp), rspLen);
+      sendReply(cmd, port, status, rsp, rspLen);
+      return;
+    }
+  }
+
+  if(port >= numPorts_)
+  {
+    sendReply(cmd, port, ConsoleStatus::badPort, NULL, 0);
+    return;
+  }
+
+  Rfid * pRfid = pPorts_[port];
+  switch(cmd)
+  {
+    case ConsoleCommand::getCartridge:
+      rsp[rspLen++] = pRfid->cartridge_.data_.id_ & 0xFF;
+      rsp[rspLen++] = pRfid->cartridge_.data_.id_ >> 8;
+      rspLen += pRfid->buildCartridgePayload(&rsp[rspLen]);
+      break;
+
+    case ConsoleCommand::setCartridge:
+      if(len != CONSOLE_CARTRIDGE_LENGTH)
+      {
+        sendReply(cmd, port, ConsoleStatus::badLength, NULL, 0);
+        return;
+      }
+      pRfid->cartridge_.data_.id_ = preq[0] | preq[1]<<8;
+      pRfid->applyCartridgePayload(&preq[2]);
+      events.publish(EventType::edited, port);
+      break;
+
+    case ConsoleCommand::save:
+      pRfid->saveCartridgeData();
+      break;
+
+    case ConsoleCommand::reload:
+      pRfid->loadCartridgeData();
+      break;
+
+    case ConsoleCommand::reset:
+      pRfid->resetCartridgeData();
+      break;
+
+    case ConsoleCommand::cadence:
+    {
+      Cadence & cadence = pRfid->cadence_;
+      uint16_t predicted = cadence.predicted();
+      unsigned long values[] =
+      {
+        cadence.usUntilRequest(),
+        cadence.hits_,
+        cadence.misses_,
+        cadence.prestaged_,
+        cadence.savedUs_
+      };
+      rsp[rspLen++] = predicted & 0xFF;
+      rsp[rspLen++] = predicted >> 8;
+      for(unsigned int v=0; v<sizeof(values)/sizeof(values[0]); ++v)
+      {
+        for(int i=0; i<4; ++i)
+        {
+          rsp[rspLen++] = (values[v] >> (8*i)) & 0xFF;
+        }
+      }
+      if(len > 0 && preq[0] != 0)
+      {
+        cadence.hits_ = 0;
+        cadence.misses_ = 0;
+        cadence.prestaged_ = 0;
+        cadence.savedUs_ = 0;
+      }
+      break;
+    }
+
+    case ConsoleCommand::portStats:
+    {
+      RfidStats & stats = pRfid->stats_;
+      unsigned long meanUs = stats.requests_ ? stats.handleUs_ / stats.requests_ : 0;
+      unsigned long values[] =
+      {
+        stats.requests_,
+        stats.bytesIn_,
+        stats.bytesOut_
+      };
+      unsigned int counters[] =
+      {
+        stats.timeouts_,
+        stats.badXor_,
+        stats.oversize_,
+        stats.resyncs_,
+        stats.unhandled_,
+        meanUs < 0xFFFF ? (unsigned int)meanUs : 0xFFFF,
+        stats.maxHandleUs_
+      };
+      for(unsigned int v=0; v<sizeof(values)/sizeof(values[0]); ++v)
+      {
+        for(int i=0; i<4; ++i)
+        {
+          rsp[rspLen++] = (values[v] >> (8*i)) & 0xFF;
+        }
+      }
+      for(unsigned int c=0; c<sizeof(counters)/sizeof(counters[0]); ++c)
+      {
+        rsp[rspLen++] = counters[c] & 0xFF;
+        rsp[rspLen++] = counters[c] >> 8;
+      }
+      if(len > 0 && preq[0] != 0)
+      {
+        stats.reset();
+      }
+      break;
+    }
+
+    case ConsoleCommand::portFrames:
+    {
+      byte index = len > 0 ? preq[0] : 0;
+      if(index >= RFID_COMMANDS)
+      {
+        sendReply(cmd, port, ConsoleStatus::badLength, NULL, 0);
+        return;
+      }
+      uint16_t funcCode = Rfid::commandCode(index);
+      unsigned long frames = pRfid->stats_.frames_[index];
+      rsp[rspLen++] = RFID_COMMANDS;
+      rsp[rspLen++] = funcCode & 0xFF;
+      rsp[rspLen++] = funcCode >> 8;
+      for(int i=0; i<4; ++i)
+      {
+        rsp[rspLen++] = (frames >> (8*i)) & 0xFF;
+      }
+      break;
+    }
+
+    default:
+      sendReply(cmd, port, ConsoleStatus::badCommand, NULL, 0);
+      return;
+  }
+  sendReply(cmd, port, ConsoleStatus::ok, rsp, rspLen);
+}
+
+/// Every reply goes out here. Handlers stop at the rspMax they are passed,
+/// a longer len is still refused and sent as an overflow without its data.
+void
+Console::sendReply(byte cmd, byte port, ConsoleStatus::Type status, byte * pData, int len)
+{
+  if(len > CONSOLE_MAX_DATA)
+  {
+    status = ConsoleStatus::overflow;
+    len = 0;
+  }
+  byte hdr[4];
+  hdr[0] = len + 3;
+  hdr[1] = cmd;
+  hdr[2] = port;
+  hdr[3] = status;
+
+  byte xorVal = 0;
+  serial_->write(0xAA);
+  serial_->write(0xBB);
+  for(int i=0; i<4; ++i)
+  {
+    xorVal ^= hdr[i];
+    serial_->write(hdr[i]);
+  }
+  for(int i=0; i<len; ++i)
+  {
+    xorVal ^= pData[i];
+    serial_->write(pData[i]);
+  }
+  serial_->write(xorVal);
+}
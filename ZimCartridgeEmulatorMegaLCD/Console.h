@@ -0,0 +1,118 @@
+// Zim Cartridge Emulator 
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+#ifndef Console_h
+#define Console_h
+
+#include <Arduino.h>
+#include "Rfid.h"
+
+#define CONSOLE_VERSION_MAJOR       1
+#define CONSOLE_VERSION_MINOR       0
+#define CONSOLE_RX_TIMEOUT          500 // msecs timeout on receives
+#define CONSOLE_MAX_DATA            48 // request or reply data, the watchdog's reply is the longest
+#define CONSOLE_MAX_COMMANDS        8  // commands added by other modules
+#define CONSOLE_CARTRIDGE_LENGTH    (2 + CARTRIDGE_DATA_LENGTH) // id + tag image
+
+// Binary control protocol on the USB serial port. Frames share the port with
+// the ASCII debug output, the 0xAA sync byte never occurs in the text.
+// Request: 0xAA 0xBB - uint8 len - uint8 cmd - uint8 port - n data - uint8 XOR
+// Reply:   0xAA 0xBB - uint8 len - uint8 cmd - uint8 port - uint8 status - n data - uint8 XOR
+// len counts the bytes between itself and the XOR, the XOR covers len onwards.
+namespace ConsoleState
+{
+  enum Type
+  {
+    idle,
+    start,
+    len,
+    data,
+    xorCheck
+  };
+}
+
+namespace ConsoleCommand
+{
+  enum Type
+  {
+    info          = 0x01, // -> uint8 major, uint8 minor, uint8 ports, uint32 uptime, uint32 first response per port
+    getCartridge  = 0x10, // -> uint16 id, 16 byte tag image
+    setCartridge  = 0x11, // uint16 id, 16 byte tag image
+    save          = 0x12, // write cartridge to eeprom
+    reload        = 0x13, // restore cartridge from eeprom
+    reset         = 0x14, // restore cartridge defaults
+    power         = 0x20, // see Power.h
+    watchdog      = 0x21, // see Watchdog.h
+    tasks         = 0x22, // see Scheduler.h
+    telemetry     = 0x23, // see Telemetry.h
+    history       = 0x24, // see Telemetry.h
+    memory        = 0x25, // see Memory.h
+    cadence       = 0x26, // -> uint16 predicted funcCode, uint32 us until it is expected, uint32 hits,
+                          // uint32 misses, uint32 prestaged replies, uint32 us saved; 1 byte != 0 resets
+    pool          = 0x27, // see FramePool.h
+    portStats     = 0x28, // -> uint32 requests, uint32 bytes in, uint32 bytes out, uint16 timeouts, uint16 bad XOR,
+                          // uint16 oversize, uint16 resyncs, uint16 unhandled, uint16 mean us, uint16 max us
+                          // handling a request; 1 byte != 0 resets, frames per command included
+    portFrames    = 0x29, // uint8 command index -> uint8 commands, uint16 funcCode, uint32 requests
+    link          = 0x2A  // see Link.h
+  };
+}
+
+namespace ConsoleStatus
+{
+  enum Type
+  {
+    ok          = 0x00,
+    badCommand  = 0x01,
+    badPort     = 0x02,
+    badLength   = 0x03,
+    badXor      = 0x04,
+    overflow    = 0x05  // the reply wouldn't fit CONSOLE_MAX_DATA
+  };
+}
+
+/// Handler for a command added with Console::addCommand(). Fills prsp with
+/// up to rspMax bytes and sets rspLen, a reply that wouldn't fit returns
+/// overflow without writing it.
+typedef ConsoleStatus::Type (*ConsoleHandler)(void * pContext, byte port,
+                                              byte * preq, int len,
+                                              byte * prsp, int rspMax, int & rspLen);
+
+class Console
+{
+public:
+  Console(Rfid ** pPorts, byte numPorts, HardwareSerial * serial);
+  bool addCommand(byte cmd, ConsoleHandler handler, void * pContext);
+  bool isIdle();
+  void runFsm();
+  void handleRequest(byte cmd, byte port, byte * preq, int len);
+  void sendReply(byte cmd, byte port, ConsoleStatus::Type status, byte * pData, int len);
+
+private:
+  struct Command
+  {
+    byte            cmd_;
+    ConsoleHandler  handler_;
+    void *          pContext_;
+  };
+
+  Rfid **           pPorts_;
+  byte              numPorts_;
+  Command           commands_[CONSOLE_MAX_COMMANDS];
+  byte              numCommands_;
+  HardwareSerial *  serial_;
+  ConsoleState::Type state_;
+  unsigned long     timeout_;
+  byte              len_;
+  byte              index_;
+  byte              xor_;
+  byte              frame_[2 + CONSOLE_MAX_DATA]; // cmd, port, data
+};
+
+#endif
@@ -0,0 +1,80 @@
+// Zim Cartridge Emulator
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "EventQueue.h"
+
+EventQueue events;
+
+EventQueue::EventQueue() :
+                                head_(0),
+                                lapped_(0),
+                                numConsumers_(0)
+{
+  memset(events_, 0, sizeof(events_));
+  memset(tails_, 0, sizeof(tails_));
+}
+
+/// Returns the id to poll() with, or EVENT_NO_CONSUMER. A consumer only
+/// sees events published after it subscribed.
+byte
+EventQueue::subscribe()
+{
+  if(numConsumers_ >= EVENT_MAX_CONSUMERS)
+  {
+    return EVENT_NO_CONSUMER;
+  }
+  tails_[numConsumers_] = head_;
+  return numConsumers_++;
+}
+
+void
+EventQueue::publish(EventType::Type type, byte port)
+{
+  for(byte consumer=0; consumer<numConsumers_; ++consumer)
+  {
+    if((byte)(head_ - tails_[consumer]) >= EVENT_QUEUE_SIZE)
+    {
+      lapped_ |= 1 << consumer;
+    }
+  }
+  Event & event = events_[head_ & (EVENT_QUEUE_SIZE - 1)];
+  event.type_ = type;
+  event.port_ = port;
+  event.ms_ = millis();
+  ++head_;
+}
+
+/// Next event for the consumer, false if there is none
+bool
+EventQueue::poll(byte consumer, Event & event)
+{
+  if(!isPending(consumer))
+  {
+    return false;
+  }
+  if(lapped_ & (1 << consumer))
+  {
+    lapped_ &= ~(1 << consumer);
+    tails_[consumer] = head_;
+    event.type_ = EventType::overflow;
+    event.port_ = EVENT_ALL_PORTS;
+    event.ms_ = millis();
+    return true;
+  }
+  event = events_[tails_[consumer]++ & (EVENT_QUEUE_SIZE - 1)];
+  return true;
+}
+
+bool
+EventQueue::isPending(byte consumer)
+{
+  return consumer < numConsumers_ &&
+         (head_ != tails_[consumer] || (lapped_ & (1 << consumer)));
+}
@@ -0,0 +1,62 @@
+// Zim Cartridge Emulator
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+#ifndef EventQueue_h
+#define EventQueue_h
+
+#include <Arduino.h>
+
+#define EVENT_QUEUE_SIZE        16  // power of two
+#define EVENT_MAX_CONSUMERS     4
+#define EVENT_ALL_PORTS         0xFF
+#define EVENT_NO_CONSUMER       0xFF  // subscribe() with all consumers taken
+
+namespace EventType
+{
+  enum Type
+  {
+    none,
+    committed,      // the Zim wrote a whole tag image
+    edited,         // cartridge changed from the console, or reloaded or reset
+    saveRequested,  // the cartridge should go to eeprom in slack time
+    overflow        // events were lost, the consumer must look at every port
+  };
+}
+
+struct Event
+{
+  byte            type_;
+  byte            port_;
+  unsigned long   ms_;      // millis() when published
+};
+
+/// Fixed size ring of cartridge events. Every consumer has its own read
+/// position and sees every event. A consumer that has an event written over
+/// before reading it gets a single overflow event instead of the ones it
+/// missed, however far behind it fell.
+class EventQueue
+{
+public:
+  EventQueue();
+  byte subscribe();
+  void publish(EventType::Type type, byte port);
+  bool poll(byte consumer, Event & event);
+  bool isPending(byte consumer);
+
+private:
+  Event           events_[EVENT_QUEUE_SIZE];
+  byte            head_;                        // free running, events published
+  byte            tails_[EVENT_MAX_CONSUMERS];  // free running, events read
+  byte            lapped_;                      // bit per consumer, publish() wrote over an unread event
+  byte            numConsumers_;
+};
+
+extern EventQueue events;
+
+#endif
@@ -0,0 +1,79 @@
+// Zim Cartridge Emulator
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "Format.h"
+#include "Cartridge.h"
+
+// Writes value right aligned in digits characters ending at pEnd, zero padded
+static void writeDigits(char * pEnd, unsigned int value, byte digits)
+{
+  while(digits-- > 0)
+  {
+    *--pEnd = '0' + value % 10;
+    value /= 10;
+  }
+}
+
+/// Millimetres as metres with millimetre precision, e.g. "200.000". One 32
+/// bit division splits metres and millimetres, tag lengths then only need
+/// 16 bit ones.
+byte
+formatMetres(char * pText, int32_t mm)
+{
+  char * p = pText;
+  uint32_t value = mm;
+  if(mm < 0)
+  {
+    *p++ = '-';
+    value = 0UL - (uint32_t)mm; // -mm overflows for INT32_MIN
+  }
+
+  uint32_t metres = value / 1000;
+  unsigned int frac = value - metres * 1000;
+
+  // digits come out in reverse, 16 bit divisions once metres fits
+  char digits[10];
+  byte count = 0;
+  do
+  {
+    if(metres <= 0xFFFF)
+    {
+      unsigned int m = metres;
+      digits[count++] = '0' + m % 10;
+      metres = m / 10;
+    }
+    else
+    {
+      digits[count++] = '0' + metres % 10;
+      metres /= 10;
+    }
+  } while(metres != 0);
+
+  while(count > 0)
+  {
+    *p++ = digits[--count];
+  }
+  *p++ = '.';
+  writeDigits(p + 3, frac, 3);
+  p += 3;
+  *p = '\0';
+  return p - pText;
+}
+
+/// Tag temperature in degrees C, the tag stores it less the offset
+byte
+formatCelsius(char * pText, byte temp)
+{
+  unsigned int celsius = temp + CARTRIDGE_TEMPERATURE_OFFSET;
+  byte count = celsius >= 100 ? 3 : celsius >= 10 ? 2 : 1;
+  writeDigits(pText + count, celsius, count);
+  pText[count] = '\0';
+  return count;
+}
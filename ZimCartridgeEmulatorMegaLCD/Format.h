@@ -0,0 +1,25 @@
+// Zim Cartridge Emulator 
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+#ifndef Format_h
+#define Format_h
+
+#include <Arduino.h>
+
+#define FORMAT_METRES_SIZE    13  // "-2147483.648" plus the terminator
+#define FORMAT_CELSIUS_SIZE   4   // "355" plus the terminator
+
+// Integer only number formatting, so float printing and the soft float
+// library aren't linked in. Both write a terminated string and return its
+// length. Lengths are 32 bit as on the AVR, so the host builds fit the
+// same buffers.
+byte formatMetres(char * pText, int32_t mm);
+byte formatCelsius(char * pText, byte temp);
+
+#endif
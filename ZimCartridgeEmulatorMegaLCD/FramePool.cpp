@@ -0,0 +1,113 @@
+// Zim Cartridge Emulator
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "FramePool.h"
+
+/// pmem holds count buffers of FRAME_BUFFER_SIZE bytes
+FramePool::FramePool(byte * pmem, byte count, byte reserve) :
+                                pmem_(pmem),
+                                count_(count),
+                                reserve_(reserve),
+                                free_(0),
+                                inUse_(0),
+                                optionalInUse_(0),
+                                peak_(0),
+                                exhausted_(0),
+                                numPorts_(0)
+{
+  for(byte i=0; i<count_; ++i)
+  {
+    pmem_[i * FRAME_BUFFER_SIZE] = i + 1;
+  }
+}
+
+void
+FramePool::init(Console * pConsole, byte numPorts)
+{
+  numPorts_ = numPorts;
+  pConsole->addCommand(ConsoleCommand::pool, onConsole, this);
+}
+
+/// A free buffer, NULL if there is none or, for an optional one, if the
+/// optional ones already hold all but the reserve
+byte *
+FramePool::acquire(bool optional)
+{
+  if(free_ == count_ || (optional && optionalInUse_ + reserve_ >= count_))
+  {
+    if(!optional && exhausted_ < 0xFFFF)
+      ++exhausted_;
+    return NULL;
+  }
+  byte * pframe = &pmem_[free_ * FRAME_BUFFER_SIZE];
+  free_ = pframe[0];
+  if(optional)
+  {
+    ++optionalInUse_;
+  }
+  if(++inUse_ > peak_)
+  {
+    peak_ = inUse_;
+  }
+  return pframe;
+}
+
+/// optional as it was acquired
+void
+FramePool::release(byte * pframe, bool optional)
+{
+  pframe[0] = free_;
+  free_ = (pframe - pmem_) / FRAME_BUFFER_SIZE;
+  --inUse_;
+  if(optional)
+  {
+    --optionalInUse_;
+  }
+}
+
+byte
+FramePool::available()
+{
+  return count_ - inUse_;
+}
+
+/// Console command: -> uint8 buffers, uint8 buffer size, uint8 in use,
+/// uint8 peak, uint16 failed acquires, int16 bytes reclaimed against each
+/// port owning its buffers; 1 byte != 0 resets the peak and failures
+ConsoleStatus::Type
+FramePool::onConsole(void * pContext, byte port, byte * preq, int len,
+                     byte * prsp, int rspMax, int & rspLen)
+{
+  if(rspMax < 8)
+  {
+    rspLen = 0;
+    return ConsoleStatus::overflow;
+  }
+  FramePool * pPool = (FramePool *)pContext;
+  int reclaimed = pPool->numPorts_ * FRAME_PORT_BYTES + FRAME_STACK_BYTES -
+                  pPool->count_ * FRAME_BUFFER_SIZE;
+
+  rspLen = 0;
+  prsp[rspLen++] = pPool->count_;
+  prsp[rspLen++] = FRAME_BUFFER_SIZE;
+  prsp[rspLen++] = pPool->inUse_;
+  prsp[rspLen++] = pPool->peak_;
+  prsp[rspLen++] = pPool->exhausted_ & 0xFF;
+  prsp[rspLen++] = pPool->exhausted_ >> 8;
+  prsp[rspLen++] = reclaimed & 0xFF;
+  prsp[rspLen++] = (reclaimed >> 8) & 0xFF;
+
+  if(len > 0 && preq[0] != 0)
+  {
+    pPool->peak_ = pPool->inUse_;
+    pPool->exhausted_ = 0;
+  }
+  return ConsoleStatus::ok;
+}
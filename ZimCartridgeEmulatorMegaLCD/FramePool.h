@@ -0,0 +1,54 @@
+// Zim Cartridge Emulator
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+#ifndef FramePool_h
+#define FramePool_h
+
+#include <Arduino.h>
+#include "Console.h"
+
+#define FRAME_BUFFER_SIZE     48  // a reply frame with 16 stuffed bytes, or a request payload
+#define FRAME_POOL_SIZE       4   // the sketch's pool: a request per port, a reply, a prestaged reply
+#define FRAME_POOL_RESERVE    3   // the sketch's buffers optional acquires never take, for requests and replies
+#define FRAME_PORT_BYTES      (64 + 50) // request payload and prestaged reply each Rfid owned before the pool
+#define FRAME_STACK_BYTES     50  // reply each sendResponse() had on the stack before the pool
+
+/// Fixed pool of frame buffers shared by all ports. A port borrows one for
+/// the request it is parsing and hands it to the command handler as is, the
+/// handler writes its reply payload straight into a second one that goes
+/// out on the serial port. Free buffers form a list threaded through their
+/// first byte, so acquire() and release() are O(1). Optional acquires, for
+/// work that can be skipped, never hold more than count - reserve buffers
+/// between them, so a reserve of a request per port plus a reply always
+/// leaves every port able to answer.
+class FramePool
+{
+public:
+  FramePool(byte * pmem, byte count, byte reserve);
+  void init(Console * pConsole, byte numPorts);
+  byte * acquire(bool optional = false);
+  void release(byte * pframe, bool optional = false);
+  byte available();
+
+  static ConsoleStatus::Type onConsole(void * pContext, byte port,
+                                       byte * preq, int len,
+                                       byte * prsp, int rspMax, int & rspLen);
+
+  byte *          pmem_;
+  byte            count_;
+  byte            reserve_;
+  byte            free_;        // head of the free list, count_ if empty
+  byte            inUse_;
+  byte            optionalInUse_;
+  byte            peak_;
+  unsigned int    exhausted_;   // acquires that failed
+  byte            numPorts_;
+};
+
+#endif
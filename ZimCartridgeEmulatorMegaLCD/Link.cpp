@@ -0,0 +1,772 @@
+// Zim Cartridge Emulator
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "Link.h"
+#include "TagCodec.h"
+#include "EventQueue.h"
+
+// Cartridge id, tag image and first response of a port, the layout of
+// LinkCommand::port. The first 18 bytes are what setCartridge carries.
+static void imagePort(Rfid * pRfid, byte * pdata)
+{
+  int index = 0;
+  pdata[index++] = pRfid->cartridge_.data_.id_ & 0xFF;
+  pdata[index++] = pRfid->cartridge_.data_.id_ >> 8;
+  index += pRfid->buildCartridgePayload(&pdata[index]);
+  for(int i=0; i<4; ++i)
+  {
+    pdata[index++] = (pRfid->firstResponse_ >> (8*i)) & 0xFF;
+  }
+}
+
+// Bit per TagField whose value in data differs from the image, and
+// LINK_ID_FIELD if the id does, the image laid out as imagePort() does
+static uint16_t editedFields(const CartridgeData & data, const byte * pimage)
+{
+  CartridgeData base = data;
+  base.id_ = pimage[0] | pimage[1]<<8;
+  TagCodec::decode(&pimage[2], base);
+  uint16_t fields = data.id_ != base.id_ ? LINK_ID_FIELD : 0;
+  for(byte field=0; field<TagField::checksum; ++field)
+  {
+    if(((tagGetField(data, field) ^ tagGetField(base, field)) & tagValueMask(field)) != 0)
+    {
+      fields |= 1 << field;
+    }
+  }
+  return fields;
+}
+
+// The fields given, see editedFields(), from one cartridge into another
+static void copyFields(CartridgeData & data, const CartridgeData & from, uint16_t fields)
+{
+  if(fields & LINK_ID_FIELD)
+  {
+    data.id_ = from.id_;
+  }
+  for(byte field=0; field<TagField::checksum; ++field)
+  {
+    if(fields & (1 << field))
+    {
+      tagSetField(data, field, tagGetField(from, field));
+    }
+  }
+}
+
+static void putLong(byte * pdata, int & index, unsigned long value, byte size)
+{
+  for(byte i=0; i<size; ++i)
+  {
+    pdata[index++] = (value >> (8*i)) & 0xFF;
+  }
+}
+
+static unsigned long getLong(const byte * pdata, int & index, byte size)
+{
+  unsigned long value = 0;
+  for(byte i=0; i<size; ++i)
+  {
+    value |= (unsigned long)pdata[index++] << (8*i);
+  }
+  return value;
+}
+
+
+WireBus::WireBus(TwoWire * pWire) :
+                                pWire_(pWire)
+{
+}
+
+void
+WireBus::begin()
+{
+  pWire_->begin();
+  pWire_->setClock(LINK_CLOCK_HZ);
+}
+
+bool
+WireBus::transmit(byte address, const byte * pdata, int len)
+{
+  pWire_->beginTransmission(address);
+  pWire_->write(pdata, len);
+  return pWire_->endTransmission() == 0;
+}
+
+int
+WireBus::receive(byte address, byte * pdata, int len)
+{
+  int got = pWire_->requestFrom(address, (byte)len);
+  for(int i=0; i<got; ++i)
+  {
+    pdata[i] = pWire_->read();
+  }
+  return got;
+}
+
+
+// Wire's callbacks take no context, a board is only ever one slave
+static LinkSlave * pWireSlave = NULL;
+static TwoWire *   pSlaveWire = NULL;
+
+static void onWireReceive(int count)
+{
+  byte frame[LINK_MAX_FRAME];
+  int len = 0;
+  while(pSlaveWire->available() && len < LINK_MAX_FRAME)
+  {
+    frame[len++] = pSlaveWire->read();
+  }
+  pWireSlave->onReceive(frame, len);
+}
+
+static void onWireRequest()
+{
+  byte frame[LINK_MAX_FRAME];
+  pSlaveWire->write(frame, pWireSlave->onRequest(frame));
+}
+
+LinkSlave::LinkSlave(Rfid ** pPorts, byte numPorts, Storage * pStorage) :
+                                reads_(0),
+                                dropped_(0),
+                                pPorts_(pPorts),
+                                numPorts_(numPorts < LINK_PORTS ? numPorts : LINK_PORTS),
+                                pStorage_(pStorage),
+                                dirty_(0),
+                                statsMs_(0),
+                                readCmd_(LinkCommand::summary),
+                                readPort_(0),
+                                blockLoc_(-1),
+                                inboxLen_(0)
+{
+  memset(port_, 0, sizeof(port_));
+  memset(stats_, 0, sizeof(stats_));
+}
+
+void
+LinkSlave::begin(TwoWire * pWire, byte address)
+{
+  pWireSlave = this;
+  pSlaveWire = pWire;
+  pWire->begin(address);
+  pWire->onReceive(onWireReceive);
+  pWire->onRequest(onWireRequest);
+}
+
+/// Applies what the master wrote and refreshes the snapshot, marking the
+/// sections that changed
+void
+LinkSlave::runFsm()
+{
+  if(inboxLen_ != 0)
+  {
+    apply();
+  }
+
+  byte snap[LINK_STATS_LENGTH];
+  bool stats = millis() - statsMs_ >= LINK_STATS_MS;
+  if(stats)
+  {
+    statsMs_ = millis();
+  }
+  for(byte port=0; port<numPorts_; ++port)
+  {
+    snapPort(port, snap);
+    if(memcmp(snap, port_[port], LINK_PORT_LENGTH) != 0)
+    {
+      noInterrupts();
+      memcpy(port_[port], snap, LINK_PORT_LENGTH);
+      dirty_ |= LinkDirty::port << (2 * port);
+      interrupts();
+    }
+    if(stats)
+    {
+      snapStats(port, snap);
+      if(memcmp(snap, stats_[port], LINK_STATS_LENGTH) != 0)
+      {
+        noInterrupts();
+        memcpy(stats_[port], snap, LINK_STATS_LENGTH);
+        dirty_ |= LinkDirty::stats << (2 * port);
+        interrupts();
+      }
+    }
+  }
+}
+
+/// True while a write from the master waits, the refresh runs on the
+/// task's period
+bool
+LinkSlave::isReady()
+{
+  return inboxLen_ != 0;
+}
+
+/// A frame from the master, in the receive interrupt on the board. Reads
+/// only note what the next request answers.
+void
+LinkSlave::onReceive(const byte * pdata, int len)
+{
+  byte xorVal = 0;
+  for(int i=0; i<len - 1; ++i)
+  {
+    xorVal ^= pdata[i];
+  }
+  if(len < 3 || xorVal != pdata[len - 1])
+  {
+    ++dropped_;
+    return;
+  }
+
+  switch(pdata[0])
+  {
+    case LinkCommand::summary:
+    case LinkCommand::port:
+    case LinkCommand::stats:
+    case LinkCommand::storageBlock:
+      readCmd_ = pdata[0];
+      readPort_ = pdata[1];
+      break;
+
+    default:
+      if(inboxLen_ != 0)
+      {
+        ++dropped_;
+        return;
+      }
+      memcpy(inbox_, pdata, len - 1);
+      inboxLen_ = len - 1;
+      break;
+  }
+}
+
+/// Reply to the last read, in the request interrupt on the board. A port
+/// that doesn't exist, or a storage block before one was read, gets the
+/// XOR alone.
+int
+LinkSlave::onRequest(byte * pdata)
+{
+  int len = 0;
+  switch(readCmd_)
+  {
+    case LinkCommand::summary:
+      pdata[len++] = numPorts_;
+      pdata[len++] = inboxLen_ != 0 ? LinkFlags::busy : 0;
+      pdata[len++] = dirty_;
+      break;
+
+    case LinkCommand::port:
+      if(readPort_ < numPorts_)
+      {
+        memcpy(pdata, port_[readPort_], LINK_PORT_LENGTH);
+        len = LINK_PORT_LENGTH;
+        dirty_ &= ~(LinkDirty::port << (2 * readPort_));
+        ++reads_;
+      }
+      break;
+
+    case LinkCommand::stats:
+      if(readPort_ < numPorts_)
+      {
+        memcpy(pdata, stats_[readPort_], LINK_STATS_LENGTH);
+        len = LINK_STATS_LENGTH;
+        dirty_ &= ~(LinkDirty::stats << (2 * readPort_));
+        ++reads_;
+      }
+      break;
+
+    case LinkCommand::storageBlock:
+      if(blockLoc_ >= 0)
+      {
+        pdata[len++] = blockLoc_ & 0xFF;
+        pdata[len++] = blockLoc_ >> 8;
+        memcpy(&pdata[len], block_, LINK_STORAGE_BLOCK);
+        len += LINK_STORAGE_BLOCK;
+      }
+      break;
+
+    default:
+      break;
+  }
+
+  byte xorVal = readCmd_;
+  for(int i=0; i<len; ++i)
+  {
+    xorVal ^= pdata[i];
+  }
+  pdata[len++] = xorVal;
+  return len;
+}
+
+// Applies the write in the inbox, then frees it
+void
+LinkSlave::apply()
+{
+  byte port = inbox_[1];
+  int loc = inbox_[2] | inbox_[3]<<8;
+  switch(inbox_[0])
+  {
+    case LinkCommand::setCartridge:
+      if(port < numPorts_ && inboxLen_ >= 6 + CARTRIDGE_DATA_LENGTH)
+      {
+        Rfid * pRfid = pPorts_[port];
+        CartridgeData pushed = pRfid->cartridge_.data_;
+        pushed.id_ = inbox_[2] | inbox_[3]<<8;
+        TagCodec::decode(&inbox_[4], pushed);
+        copyFields(pRfid->cartridge_.data_, pushed,
+                   inbox_[4 + CARTRIDGE_DATA_LENGTH] | inbox_[5 + CARTRIDGE_DATA_LENGTH]<<8);
+        events.publish(EventType::edited, pRfid->port_);
+      }
+      break;
+
+    case LinkCommand::storageRead:
+      noInterrupts();
+      blockLoc_ = -1;
+      interrupts();
+      if(inboxLen_ >= 4 && loc + LINK_STORAGE_BLOCK <= pStorage_->length())
+      {
+        for(int i=0; i<LINK_STORAGE_BLOCK; ++i)
+        {
+          block_[i] = pStorage_->read(loc + i);
+        }
+        noInterrupts();
+        blockLoc_ = loc;
+        interrupts();
+      }
+      break;
+
+    case LinkCommand::storageWrite:
+      if(inboxLen_ > 4 && loc + inboxLen_ - 4 <= pStorage_->length())
+      {
+        for(int i=4; i<inboxLen_; ++i)
+        {
+          pStorage_->write(loc + i - 4, inbox_[i]);
+        }
+      }
+      break;
+
+    case LinkCommand::storageCommit:
+      pStorage_->commit();
+      break;
+
+    default:
+      ++dropped_;
+      break;
+  }
+  inboxLen_ = 0;
+}
+
+void
+LinkSlave::snapPort(byte port, byte * pdata)
+{
+  imagePort(pPorts_[port], pdata);
+}
+
+/// uint32 requests, uint32 bytes in, uint32 bytes out, uint32 us handling,
+/// uint16 max us, uint16 timeouts, bad XOR, oversize, resyncs and unhandled
+void
+LinkSlave::snapStats(byte port, byte * pdata)
+{
+  const RfidStats & stats = pPorts_[port]->stats_;
+  int index = 0;
+  putLong(pdata, index, stats.requests_, 4);
+  putLong(pdata, index, stats.bytesIn_, 4);
+  putLong(pdata, index, stats.bytesOut_, 4);
+  putLong(pdata, index, stats.handleUs_, 4);
+  putLong(pdata, index, stats.maxHandleUs_, 2);
+  putLong(pdata, index, stats.timeouts_, 2);
+  putLong(pdata, index, stats.badXor_, 2);
+  putLong(pdata, index, stats.oversize_, 2);
+  putLong(pdata, index, stats.resyncs_, 2);
+  putLong(pdata, index, stats.unhandled_, 2);
+}
+
+
+/// pPorts are the mirrors, LINK_PORTS per slave in address order
+LinkMaster::LinkMaster(LinkBus * pBus, Rfid ** pPorts, byte numPorts) :
+                                fullDumps_(false),
+                                polls_(0),
+                                bytes_(0),
+                                busUs_(0),
+                                errors_(0),
+                                online_(0),
+                                pBus_(pBus),
+                                pPorts_(pPorts),
+                                numPorts_(numPorts < LINK_SLAVES * LINK_PORTS ? numPorts : LINK_SLAVES * LINK_PORTS),
+                                numSlaves_((numPorts_ + LINK_PORTS - 1) / LINK_PORTS),
+                                pollMs_(0),
+                                nextSlave_(0)
+{
+  memset(known_, 0, sizeof(known_));
+  memset(synced_, 0, sizeof(synced_));
+}
+
+void
+LinkMaster::init(Console * pConsole)
+{
+  pConsole->addCommand(ConsoleCommand::link, onConsole, this);
+}
+
+/// Polls one slave per call, a round starts every LINK_POLL_MS
+void
+LinkMaster::runFsm()
+{
+  if(nextSlave_ == 0)
+  {
+    pollMs_ = millis();
+  }
+  poll(nextSlave_);
+  if(++nextSlave_ >= numSlaves_)
+  {
+    nextSlave_ = 0;
+  }
+}
+
+bool
+LinkMaster::isReady()
+{
+  return nextSlave_ != 0 || millis() - pollMs_ >= LINK_POLL_MS;
+}
+
+void
+LinkMaster::poll(byte slave)
+{
+  byte first = slave * LINK_PORTS;
+  byte ports = numPorts_ - first < LINK_PORTS ? numPorts_ - first : LINK_PORTS;
+  byte summary[3];
+  if(!read(slave, LinkCommand::summary, 0, NULL, 0, summary, sizeof(summary)))
+  {
+    online_ &= ~(1UL << slave);
+    return;
+  }
+  ++polls_;
+  online_ |= 1UL << slave;
+
+  byte section[LINK_STATS_LENGTH];
+  for(byte port=0; port<ports && port<summary[0]; ++port)
+  {
+    byte index = first + port;
+    bool all = fullDumps_ || !synced_[index];
+    if((all || (summary[2] & (LinkDirty::port << (2 * port)))) &&
+       read(slave, LinkCommand::port, port, NULL, 0, section, LINK_PORT_LENGTH))
+    {
+      applyPort(index, section);
+    }
+    if((all || (summary[2] & (LinkDirty::stats << (2 * port)))) &&
+       read(slave, LinkCommand::stats, port, NULL, 0, section, LINK_STATS_LENGTH))
+    {
+      applyStats(index, section);
+    }
+  }
+
+  for(byte port=0; port<ports; ++port)
+  {
+    push(slave, port);
+  }
+}
+
+// Sends the fields of a mirror's cartridge edited on the master since the
+// last sync to the slave, true if there were any
+bool
+LinkMaster::push(byte slave, byte port)
+{
+  byte index = slave * LINK_PORTS + port;
+  if(!synced_[index])
+  {
+    return false;
+  }
+  uint16_t fields = editedFields(pPorts_[index]->cartridge_.data_, known_[index]);
+  byte image[LINK_PORT_LENGTH];
+  imagePort(pPorts_[index], image);
+  image[2 + CARTRIDGE_DATA_LENGTH] = fields & 0xFF;
+  image[3 + CARTRIDGE_DATA_LENGTH] = fields >> 8;
+  if(fields == 0 ||
+     !write(slave, LinkCommand::setCartridge, port, image, 4 + CARTRIDGE_DATA_LENGTH))
+  {
+    return false;
+  }
+  memcpy(known_[index], image, 2 + CARTRIDGE_DATA_LENGTH);
+  return true;
+}
+
+// A slave's port image into its mirror, menu and telemetry hear of a change
+// as a commit. Fields edited on the master since the last sync keep the
+// master's value for push() to send.
+void
+LinkMaster::applyPort(byte index, const byte * pimage)
+{
+  Rfid * pRfid = pPorts_[index];
+  CartridgeData & data = pRfid->cartridge_.data_;
+  CartridgeData slave = data;
+  slave.id_ = pimage[0] | pimage[1]<<8;
+  TagCodec::decode(&pimage[2], slave);
+  uint16_t edited = synced_[index] ? editedFields(data, known_[index]) : 0;
+
+  byte current[LINK_PORT_LENGTH];
+  byte image[LINK_PORT_LENGTH];
+  imagePort(pRfid, current);
+  copyFields(data, slave, ~edited);
+  imagePort(pRfid, image);
+  if(memcmp(current, image, 2 + CARTRIDGE_DATA_LENGTH) != 0)
+  {
+    events.publish(EventType::committed, pRfid->port_);
+  }
+  int offset = 2 + CARTRIDGE_DATA_LENGTH;
+  pRfid->firstResponse_ = getLong(pimage, offset, 4);
+  memcpy(known_[index], pimage, LINK_PORT_LENGTH);
+  synced_[index] = true;
+}
+
+// See LinkSlave::snapStats(), frames per command stay on the slave
+void
+LinkMaster::applyStats(byte index, const byte * pstats)
+{
+  RfidStats & stats = pPorts_[index]->stats_;
+  int offset = 0;
+  stats.requests_     = getLong(pstats, offset, 4);
+  stats.bytesIn_      = getLong(pstats, offset, 4);
+  stats.bytesOut_     = getLong(pstats, offset, 4);
+  stats.handleUs_     = getLong(pstats, offset, 4);
+  stats.maxHandleUs_  = getLong(pstats, offset, 2);
+  stats.timeouts_     = getLong(pstats, offset, 2);
+  stats.badXor_       = getLong(pstats, offset, 2);
+  stats.oversize_     = getLong(pstats, offset, 2);
+  stats.resyncs_      = getLong(pstats, offset, 2);
+  stats.unhandled_    = getLong(pstats, offset, 2);
+}
+
+/// One LINK_STORAGE_BLOCK of the slave's storage from loc. The slave's
+/// loop reads it, the summary is busy until it has.
+bool
+LinkMaster::readStorage(byte slave, int loc, byte * pdata)
+{
+  byte args[2] = { (byte)(loc & 0xFF), (byte)(loc >> 8) };
+  byte reply[2 + LINK_STORAGE_BLOCK];
+  if(!write(slave, LinkCommand::storageRead, 0, args, sizeof(args)) ||
+     !waitInbox(slave) ||
+     !read(slave, LinkCommand::storageBlock, 0, NULL, 0, reply, sizeof(reply)))
+  {
+    return false;
+  }
+  if((reply[0] | reply[1]<<8) != loc)
+  {
+    ++errors_;
+    return false;
+  }
+  memcpy(pdata, &reply[2], LINK_STORAGE_BLOCK);
+  return true;
+}
+
+/// Up to LINK_STORAGE_BLOCK bytes to the slave's storage at loc
+bool
+LinkMaster::writeStorage(byte slave, int loc, const byte * pdata, int len)
+{
+  byte args[2 + LINK_STORAGE_BLOCK];
+  args[0] = loc & 0xFF;
+  args[1] = loc >> 8;
+  memcpy(&args[2], pdata, len);
+  return write(slave, LinkCommand::storageWrite, 0, args, 2 + len);
+}
+
+bool
+LinkMaster::commitStorage(byte slave)
+{
+  return write(slave, LinkCommand::storageCommit, 0, NULL, 0);
+}
+
+// Sends a read command and takes the reply, len bytes and the XOR
+bool
+LinkMaster::read(byte slave, byte cmd, byte port, const byte * pargs, int argLen,
+                 byte * pdata, int len)
+{
+  if(!transmit(slave, cmd, port, pargs, argLen))
+  {
+    return false;
+  }
+  byte reply[LINK_MAX_FRAME];
+  int got = pBus_->receive(LINK_FIRST_ADDRESS + slave, reply, len + 1);
+  count(got);
+  byte xorVal = cmd;
+  for(int i=0; i<got - 1; ++i)
+  {
+    xorVal ^= reply[i];
+  }
+  if(got != len + 1 || xorVal != reply[len])
+  {
+    ++errors_;
+    return false;
+  }
+  memcpy(pdata, reply, len);
+  return true;
+}
+
+// A write for the slave's inbox, once it has taken the last one
+bool
+LinkMaster::write(byte slave, byte cmd, byte port, const byte * pdata, int len)
+{
+  return waitInbox(slave) && transmit(slave, cmd, port, pdata, len);
+}
+
+bool
+LinkMaster::transmit(byte slave, byte cmd, byte port, const byte * pdata, int len)
+{
+  byte frame[LINK_MAX_FRAME];
+  int index = 0;
+  frame[index++] = cmd;
+  frame[index++] = port;
+  for(int i=0; i<len; ++i)
+  {
+    frame[index++] = pdata[i];
+  }
+  byte xorVal = 0;
+  for(int i=0; i<index; ++i)
+  {
+    xorVal ^= frame[i];
+  }
+  frame[index++] = xorVal;
+  count(index);
+  if(!pBus_->transmit(LINK_FIRST_ADDRESS + slave, frame, index))
+  {
+    ++errors_;
+    return false;
+  }
+  return true;
+}
+
+// True once the slave's inbox is free, false if it stays busy or the slave
+// doesn't answer
+bool
+LinkMaster::waitInbox(byte slave)
+{
+  byte summary[3];
+  for(byte i=0; i<LINK_BUSY_TRIES; ++i)
+  {
+    if(!read(slave, LinkCommand::summary, 0, NULL, 0, summary, sizeof(summary)))
+    {
+      return false;
+    }
+    if(!(summary[1] & LinkFlags::busy))
+    {
+      return true;
+    }
+    delayMicroseconds(LINK_BUSY_US);
+  }
+  return false;
+}
+
+// A transfer of len bytes plus the address, start and stop bits aside
+void
+LinkMaster::count(int len)
+{
+  bytes_ += len + 1;
+  busUs_ += (len + 1) * 9 * 1000000UL / LINK_CLOCK_HZ;
+}
+
+/// Console command: -> uint8 slaves, uint32 slaves answering, uint32 polls,
+/// uint32 bus bytes, uint32 bus us, uint16 errors; 1 byte != 0 resets
+ConsoleStatus::Type
+LinkMaster::onConsole(void * pContext, byte port, byte * preq, int len,
+                      byte * prsp, int rspMax, int & rspLen)
+{
+  if(rspMax < 19)
+  {
+    rspLen = 0;
+    return ConsoleStatus::overflow;
+  }
+  LinkMaster * pMaster = (LinkMaster *)pContext;
+  rspLen = 0;
+  prsp[rspLen++] = pMaster->numSlaves_;
+  putLong(prsp, rspLen, pMaster->online_, 4);
+  putLong(prsp, rspLen, pMaster->polls_, 4);
+  putLong(prsp, rspLen, pMaster->bytes_, 4);
+  putLong(prsp, rspLen, pMaster->busUs_, 4);
+  putLong(prsp, rspLen, pMaster->errors_, 2);
+
+  if(len > 0 && preq[0] != 0)
+  {
+    pMaster->polls_ = 0;
+    pMaster->bytes_ = 0;
+    pMaster->busUs_ = 0;
+    pMaster->errors_ = 0;
+  }
+  return ConsoleStatus::ok;
+}
+
+
+LinkStorage::LinkStorage() :
+                                pMaster_(NULL),
+                                slave_(0),
+                                blockLoc_(-1),
+                                runLoc_(0),
+                                runLen_(0)
+{
+}
+
+void
+LinkStorage::attach(LinkMaster * pMaster, byte slave)
+{
+  pMaster_ = pMaster;
+  slave_ = slave;
+}
+
+/// A byte of the slave's storage, 0xFF like erased eeprom if it can't be read
+byte
+LinkStorage::read(int loc)
+{
+  if(blockLoc_ < 0 || loc < blockLoc_ || loc >= blockLoc_ + LINK_STORAGE_BLOCK)
+  {
+    flush();
+    int blockLoc = loc < LINK_STORAGE_SIZE - LINK_STORAGE_BLOCK ? loc : LINK_STORAGE_SIZE - LINK_STORAGE_BLOCK;
+    if(!pMaster_->readStorage(slave_, blockLoc, block_))
+    {
+      blockLoc_ = -1;
+      return 0xFF;
+    }
+    blockLoc_ = blockLoc;
+  }
+  return block_[loc - blockLoc_];
+}
+
+void
+LinkStorage::write(int loc, byte value)
+{
+  blockLoc_ = -1;
+  if(runLen_ != 0 && (loc != runLoc_ + runLen_ || runLen_ == LINK_STORAGE_BLOCK))
+  {
+    flush();
+  }
+  if(runLen_ == 0)
+  {
+    runLoc_ = loc;
+  }
+  run_[runLen_++] = value;
+}
+
+int
+LinkStorage::length()
+{
+  return LINK_STORAGE_SIZE;
+}
+
+void
+LinkStorage::commit()
+{
+  flush();
+  pMaster_->commitStorage(slave_);
+}
+
+// Sends the gathered run of writes
+void
+LinkStorage::flush()
+{
+  if(runLen_ != 0)
+  {
+    pMaster_->writeStorage(slave_, runLoc_, run_, runLen_);
+    runLen_ = 0;
+  }
+}
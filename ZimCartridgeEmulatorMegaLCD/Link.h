@@ -0,0 +1,215 @@
+// Zim Cartridge Emulator
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+#ifndef Link_h
+#define Link_h
+
+#include <Arduino.h>
+#include <Wire.h>
+#include "Rfid.h"
+#include "Storage.h"
+#include "Console.h"
+
+#define LINK_NONE             0
+#define LINK_MASTER           1     // holds the menu and console, mirrors the slaves' ports
+#define LINK_SLAVE            2     // runs the Zim ports, answers the master
+#ifndef LINK_ROLE
+#define LINK_ROLE             LINK_NONE
+#endif
+#define LINK_FIRST_ADDRESS    0x20  // slave n answers at LINK_FIRST_ADDRESS + n
+#ifndef LINK_ADDRESS
+#define LINK_ADDRESS          LINK_FIRST_ADDRESS // a slave's own address
+#endif
+#ifndef LINK_SLAVES
+#define LINK_SLAVES           2     // slaves the master polls, see the mirrors in the sketch
+#endif
+#define LINK_PORTS            2     // Zim ports per slave
+#define LINK_CLOCK_HZ         400000
+#define LINK_POLL_MS          50    // master's summary poll of each slave
+#define LINK_STATS_MS         1000  // a slave looks for changed stats this often
+#define LINK_MAX_FRAME        32    // Wire's buffer, either direction
+#define LINK_STORAGE_BLOCK    16    // bytes per storage read or write
+#define LINK_STORAGE_SIZE     4096  // a slave's eeprom
+#define LINK_BUSY_TRIES       20    // summaries a write waits for the slave's inbox to drain
+#define LINK_BUSY_US          500
+#define LINK_PORT_LENGTH      (2 + CARTRIDGE_DATA_LENGTH + 4) // id, tag image, first response
+#define LINK_STATS_LENGTH     28
+#define LINK_ID_FIELD         0x8000 // setCartridge sets the id, the other bits are 1 << TagField
+
+// Master to slave over I2C, the master writes
+//   uint8 cmd - uint8 port - n data - uint8 XOR
+// and for a read then requests the reply
+//   n data - uint8 XOR
+// The write's XOR covers cmd onwards, the reply's is seeded with cmd so a
+// reply to another command doesn't pass. Reads are answered from the
+// slave's snapshot of its ports in the receive interrupt, writes go to an
+// inbox the slave's loop applies; the summary says while it is full. The
+// interrupt never touches the eeprom, a storageRead goes through the inbox
+// too and storageBlock then copies out the block the loop read.
+namespace LinkCommand
+{
+  enum Type
+  {
+    summary       = 0x01, // -> uint8 ports, uint8 flags, uint8 dirty bits, 2 per port
+    port          = 0x10, // -> see LINK_PORT_LENGTH, clears the port's dirty bit
+    stats         = 0x11, // -> see LinkSlave::snapStats(), clears the stats dirty bit
+    setCartridge  = 0x20, // uint16 id, 16 byte tag image, uint16 fields it sets, see LINK_ID_FIELD
+    storageRead   = 0x30, // uint16 loc, the slave's loop reads the block
+    storageWrite  = 0x31, // uint16 loc, n bytes
+    storageCommit = 0x32,
+    storageBlock  = 0x33  // -> uint16 loc, LINK_STORAGE_BLOCK bytes of the last storageRead
+  };
+}
+
+namespace LinkFlags
+{
+  static const byte busy = 0x01;      // inbox full, writes would be dropped
+}
+
+namespace LinkDirty
+{
+  static const byte port = 0x01;      // shifted by 2 * port
+  static const byte stats = 0x02;
+}
+
+/// The master's side of the bus. transmit() returns false on a NAK,
+/// receive() the bytes the slave sent.
+class LinkBus
+{
+public:
+  virtual bool transmit(byte address, const byte * pdata, int len) = 0;
+  virtual int  receive(byte address, byte * pdata, int len) = 0;
+};
+
+/// LinkBus on the AVR's TWI
+class WireBus : public LinkBus
+{
+public:
+  WireBus(TwoWire * pWire);
+  void begin();
+  bool transmit(byte address, const byte * pdata, int len);
+  int  receive(byte address, byte * pdata, int len);
+
+  TwoWire *         pWire_;
+};
+
+/// A slave board's end. Keeps a snapshot of each port's cartridge and
+/// stats with a dirty bit per section, so the master's poll of an unchanged
+/// board is a three byte summary. The snapshot is refreshed by the loop,
+/// the receive interrupt only copies out of it.
+class LinkSlave
+{
+public:
+  LinkSlave(Rfid ** pPorts, byte numPorts, Storage * pStorage);
+  void begin(TwoWire * pWire, byte address);
+  void runFsm();
+  bool isReady();
+  void onReceive(const byte * pdata, int len);
+  int  onRequest(byte * pdata);
+
+  unsigned long     reads_;       // sections the master read
+  unsigned int      dropped_;     // writes with a bad XOR or a full inbox
+
+private:
+  void apply();
+  void snapPort(byte port, byte * pdata);
+  void snapStats(byte port, byte * pdata);
+
+  Rfid **           pPorts_;
+  byte              numPorts_;
+  Storage *         pStorage_;
+  byte              port_[LINK_PORTS][LINK_PORT_LENGTH];
+  byte              stats_[LINK_PORTS][LINK_STATS_LENGTH];
+  volatile byte     dirty_;
+  unsigned long     statsMs_;     // last stats refresh
+  byte              readCmd_;     // command the next request answers
+  byte              readPort_;
+  byte              block_[LINK_STORAGE_BLOCK]; // storage read for the master
+  int               blockLoc_;    // -1 until a storageRead is applied
+  byte              inbox_[LINK_MAX_FRAME];
+  volatile byte     inboxLen_;    // 0 while empty
+};
+
+/// The master board's end. Each poll reads the sections the slave's summary
+/// marks dirty into the mirror Rfids, then pushes the fields of cartridges
+/// edited on the master, by the menu or the console. A field edited on both
+/// ends keeps the master's value and the others follow the slave, so a Zim
+/// write isn't undone by a stale mirror. The mirrors aren't run, they only
+/// hold what the menu, the console and telemetry look at.
+class LinkMaster
+{
+public:
+  LinkMaster(LinkBus * pBus, Rfid ** pPorts, byte numPorts);
+  void init(Console * pConsole);
+  void runFsm();
+  bool isReady();
+  bool readStorage(byte slave, int loc, byte * pdata);
+  bool writeStorage(byte slave, int loc, const byte * pdata, int len);
+  bool commitStorage(byte slave);
+
+  static ConsoleStatus::Type onConsole(void * pContext, byte port,
+                                       byte * preq, int len,
+                                       byte * prsp, int rspMax, int & rspLen);
+
+  bool              fullDumps_;   // read every section every poll, for comparison
+  unsigned long     polls_;       // summaries read
+  unsigned long     bytes_;       // on the bus, addresses included
+  unsigned long     busUs_;       // bytes_ at LINK_CLOCK_HZ, 9 bits each
+  unsigned int      errors_;      // NAKs, short replies and bad XORs
+  unsigned long     online_;      // bit per slave that answered its last poll
+
+private:
+  void poll(byte slave);
+  bool push(byte slave, byte port);
+  void applyPort(byte index, const byte * pimage);
+  void applyStats(byte index, const byte * pstats);
+  bool read(byte slave, byte cmd, byte port, const byte * pargs, int argLen,
+            byte * pdata, int len);
+  bool write(byte slave, byte cmd, byte port, const byte * pdata, int len);
+  bool transmit(byte slave, byte cmd, byte port, const byte * pdata, int len);
+  bool waitInbox(byte slave);
+  void count(int len);
+
+  LinkBus *         pBus_;
+  Rfid **           pPorts_;
+  byte              numPorts_;
+  byte              numSlaves_;
+  byte              known_[LINK_SLAVES * LINK_PORTS][LINK_PORT_LENGTH]; // last image synced either way
+  bool              synced_[LINK_SLAVES * LINK_PORTS]; // known_ holds the slave's image
+  unsigned long     pollMs_;      // start of the last round
+  byte              nextSlave_;   // polled next, 0 once a round is done
+};
+
+/// Storage of a slave, for the master's mirror cartridges. Saving or
+/// reloading a mirror programs or reads the slave's eeprom. Writes are
+/// gathered in runs of LINK_STORAGE_BLOCK bytes, reads come from a block
+/// read ahead.
+class LinkStorage : public Storage
+{
+public:
+  LinkStorage();
+  void attach(LinkMaster * pMaster, byte slave);
+  byte read(int loc);
+  void write(int loc, byte value);
+  int  length();
+  void commit();
+
+private:
+  void flush();
+
+  LinkMaster *      pMaster_;
+  byte              slave_;
+  byte              block_[LINK_STORAGE_BLOCK];
+  int               blockLoc_;    // -1 if block_ holds nothing
+  byte              run_[LINK_STORAGE_BLOCK];
+  int               runLoc_;
+  byte              runLen_;
+};
+
+#endif
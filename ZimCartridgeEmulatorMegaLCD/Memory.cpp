@@ -0,0 +1,124 @@
+// Zim Cartridge Emulator
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "Memory.h"
+
+Memory memory;
+
+#if defined(__AVR__)
+struct __freelist
+{
+  size_t              sz;
+  struct __freelist * nx;
+};
+
+extern struct __freelist *  __flp;      // avr-libc malloc free list
+extern char *               __brkval;   // heap top, 0 until the first malloc
+extern char                 __heap_start;
+extern uint8_t              __stack;
+
+#define MEMORY_STRING(x)    #x
+#define MEMORY_ASM(x)       MEMORY_STRING(x)
+
+// Runs before the stack pointer is set up, so it can't be C, and a naked
+// function may only hold basic asm. Paints __heap_start to __stack: the
+// avr-libc linker scripts put __heap_start at _end, after .noinit, so the
+// watchdog's StallRecord is left as the last run wrote it.
+void paintStack() __attribute__((naked, used, section(".init1")));
+void paintStack()
+{
+  __asm volatile ("    ldi r30,lo8(__heap_start)\n"
+                  "    ldi r31,hi8(__heap_start)\n"
+                  "    ldi r24," MEMORY_ASM(MEMORY_PAINT) "\n"
+                  "    ldi r25,hi8(__stack)\n"
+                  "    rjmp 2f\n"
+                  "1:  st Z+,r24\n"
+                  "2:  cpi r30,lo8(__stack)\n"
+                  "    cpc r31,r25\n"
+                  "    brlo 1b\n"
+                  "    breq 1b\n");
+}
+#endif
+
+void
+Memory::init(Console * pConsole)
+{
+  pConsole->addCommand(ConsoleCommand::memory, onConsole, this);
+}
+
+/// Walks the free list and scans the painted ram, a few ms on a Mega
+void
+Memory::getStats(Stats & stats)
+{
+  memset(&stats, 0, sizeof(stats));
+#if defined(__AVR__)
+  uint8_t * heapTop = __brkval ? (uint8_t *)__brkval : (uint8_t *)&__heap_start;
+  uint8_t * sp = (uint8_t *)SP;
+
+  stats.ram_ = RAMEND - RAMSTART + 1;
+  stats.static_ = (uint8_t *)&__heap_start - (uint8_t *)RAMSTART;
+  stats.heap_ = heapTop - (uint8_t *)&__heap_start;
+  for(struct __freelist * p = __flp; p != NULL; p = p->nx)
+  {
+    stats.heapFree_ += p->sz + sizeof(size_t);
+    if(p->sz > stats.largestFree_)
+      stats.largestFree_ = p->sz;
+    ++stats.fragments_;
+  }
+
+  uint8_t * p = heapTop;
+  while(p < sp && *p == MEMORY_PAINT)
+    ++p;
+  stats.freeMin_ = p - heapTop;
+  stats.stackMax_ = &__stack - p + 1;
+  stats.stack_ = &__stack - sp;
+  stats.free_ = sp - heapTop;
+#endif
+}
+
+/// Console command: -> uint16 ram, uint16 static, uint16 heap, uint16 heap
+/// free, uint16 largest free block, uint8 fragments, uint16 stack, uint16
+/// stack max, uint16 free, uint16 free min
+ConsoleStatus::Type
+Memory::onConsole(void * pContext, byte port, byte * preq, int len,
+                  byte * prsp, int rspMax, int & rspLen)
+{
+  if(rspMax < 19)
+  {
+    rspLen = 0;
+    return ConsoleStatus::overflow;
+  }
+  Stats stats;
+  ((Memory *)pContext)->getStats(stats);
+  unsigned int values[] =
+  {
+    stats.ram_,
+    stats.static_,
+    stats.heap_,
+    stats.heapFree_,
+    stats.largestFree_,
+    stats.stack_,
+    stats.stackMax_,
+    stats.free_,
+    stats.freeMin_
+  };
+
+  rspLen = 0;
+  for(unsigned int i=0; i<sizeof(values)/sizeof(values[0]); ++i)
+  {
+    prsp[rspLen++] = values[i] & 0xFF;
+    prsp[rspLen++] = values[i] >> 8;
+    if(i == 4)
+    {
+      prsp[rspLen++] = stats.fragments_;
+    }
+  }
+  return ConsoleStatus::ok;
+}
@@ -0,0 +1,49 @@
+// Zim Cartridge Emulator 
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+#ifndef Memory_h
+#define Memory_h
+
+#include <Arduino.h>
+#include "Console.h"
+
+#define MEMORY_PAINT      0xC5  // fill byte for the unused ram at boot
+
+/// SRAM usage. The ram between the static data, .noinit included, and the
+/// top of the stack is painted in .init1, before anything runs. Painted bytes that are still
+/// intact give the stack high-water mark, the heap is measured from
+/// malloc's break pointer and free list. All values are 0 on the host.
+class Memory
+{
+public:
+  struct Stats
+  {
+    unsigned int  ram_;           // total SRAM
+    unsigned int  static_;        // .data, .bss and .noinit
+    unsigned int  heap_;          // heap size, up to the break pointer
+    unsigned int  heapFree_;      // bytes on the free list
+    unsigned int  largestFree_;   // largest free list block
+    byte          fragments_;     // free list blocks
+    unsigned int  stack_;         // stack in use now
+    unsigned int  stackMax_;      // stack high-water mark
+    unsigned int  free_;          // between heap and stack now
+    unsigned int  freeMin_;       // never touched since boot
+  };
+
+  void init(Console * pConsole);
+  void getStats(Stats & stats);
+
+  static ConsoleStatus::Type onConsole(void * pContext, byte port,
+                                       byte * preq, int len,
+                                       byte * prsp, int rspMax, int & rspLen);
+};
+
+extern Memory memory;
+
+#endif
@@ -7,10 +7,13 @@
 // LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 // THE SOFTWARE.
-#include <LiquidCrystal.h>
-
 #include "Menu.h"
+
+#if ZIM_HEADLESS == 0
+#include <LiquidCrystal.h>
 #include "Rfid.h"
+#include "Memory.h"
+#include "Format.h"
 
 // LCD
 // select the pins used on the LCD panel
@@ -29,7 +32,7 @@ ItemSelectedEnum::Type & operator--(ItemSelectedEnum::Type & selected)
 
 ItemSelectedEnum::Type & operator++(ItemSelectedEnum::Type & selected) 
 { 
-  if(selected < ItemSelectedEnum::unused)
+  if(selected < ItemSelectedEnum::last - 1)
   {
     int val = static_cast<int>(selected);
     ++val;
@@ -41,15 +44,25 @@ ItemSelectedEnum::Type & operator++(ItemSelectedEnum::Type & selected)
 
 const byte Menu::TEMPERATURE_MAX = 250;
 const byte Menu::TEMPERATURE_MIN = 150;
-const byte Menu::TEMPERATURE_OFFSET = 100;
+const byte Menu::TEMPERATURE_OFFSET = CARTRIDGE_TEMPERATURE_OFFSET;
 const uint8_t Menu::BUTTON_PORT = 0;
 const unsigned long Menu::HOLD_EVENTS_START = 1200;
 const unsigned long Menu::HOLD_EVENTS_MAX = 600;
 const unsigned long Menu::HOLD_EVENTS_MIN = 50;
+const unsigned long Menu::LENGTH_HOLD_START = 400;
+const unsigned long Menu::LENGTH_HOLD_RATE = 100;
+const unsigned long Menu::LENGTH_STEP_DOUBLING = 500; // msecs of hold per doubling of the step
+const unsigned long Menu::HOLD_REDRAW_MIN = 200;      // msecs between lcd redraws while holding
+const unsigned long Menu::SPLASH_TIME = 1000;
+const unsigned long Menu::BUTTON_SAMPLE_PERIOD = 4;   // msecs between button adc reads
+const unsigned long Menu::MEMORY_REDRAW_PERIOD = 1000;
+const unsigned long Menu::LINK_REDRAW_PERIOD = 1000;
+const long Menu::LENGTH_STEP_MIN = 1000;
+const long Menu::LENGTH_STEP_MAX = 32000;
 const long Menu::FILAMENT_LENGTH_MAX = 200000;//600000;
 
 /// Ctor
-Menu::Menu(Rfid * pLeft, Rfid * pRight) : 
+Menu::Menu(Rfid ** pPorts, byte numPorts) : 
                                 adcSample_(0),
                                 adcRead_(0),
                                 filament_(FilamentSelectedEnum::left),
@@ -57,13 +70,21 @@ Menu::Menu(Rfid * pLeft, Rfid * pRight) :
                                 button_(ButtonEnum::none),
                                 buttonNow_(ButtonStateEnum::released),
                                 buttonState_(ButtonStateEnum::released),
+                                holdStart_(0),
                                 holdTimer_(0),
                                 holdRate_(HOLD_EVENTS_START),
+                                redrawTimer_(0),
+                                splashTimer_(0),
+                                sampleTimer_(0),
+                                splash_(false),
                                 edit_(false),
                                 refresh_(true),
-                                pLeft_(pLeft),
-                                pRight_(pRight),
-                                pSelected_(pLeft)
+                                redrawStep_(0),
+                                events_(EVENT_NO_CONSUMER),
+                                pPorts_(pPorts),
+                                numPorts_(numPorts),
+                                selected_(0),
+                                pSelected_(pPorts[0])
 //                                color_(ColorEnum::white),
 //                                material_(Material::PLA),
 //                                initialLength_(0),
@@ -73,7 +94,8 @@ Menu::Menu(Rfid * pLeft, Rfid * pRight) :
 {  
 }
 
-/// Should be called after EEPROM has initialized cartridge parameters
+/// Should be called after EEPROM has initialized cartridge parameters.
+/// The splash stays up for SPLASH_TIME while runFsm() keeps being called.
 void 
 Menu::init()
 {
@@ -81,9 +103,9 @@ Menu::init()
   lcd.setCursor(0,0);
   lcd.noCursor();
   lcd.print("Zim-Emu v1.0"); 
-  delay(1000);
-  updateLcd();
-  
+  splashTimer_ = millis();
+  splash_ = true;
+  events_ = events.subscribe();
 }
 
 void Menu::updateLcd()
@@ -95,11 +117,10 @@ void Menu::updateLcd()
 
 void Menu::buttonDebounce()
 {
-    byte newRead;
+    byte newRead = (int)ButtonEnum::none; // also between select and none
     static byte lastRead = (int)ButtonEnum::none;
     static byte result = (int)ButtonEnum::none;
     static byte lastResult = (int)ButtonEnum::none;
-    ButtonEnum::Type button = ButtonEnum::none;
 
     int adc = analogRead(BUTTON_PORT);
     if (adc < 50)   
@@ -139,19 +160,43 @@ void Menu::buttonDebounce()
 void 
 Menu::runFsm()
 {
-  if(pSelected_->isUpdated() == true)
+  // Only a change to the cartridge on screen needs a redraw, the events
+  // are drained during the splash too so they don't keep the loop awake
+  Event event;
+  while(events.poll(events_, event))
   {
-    updateLcd();  
+    if(event.type_ == EventType::overflow ||
+       ((event.type_ == EventType::committed || event.type_ == EventType::edited) &&
+        event.port_ == pSelected_->port_))
+    {
+      refresh_ = true;
+    }
+  }
+
+  if(splash_)
+  {
+    if(millis() - splashTimer_ < SPLASH_TIME)
+      return;
+    splash_ = false;
+    refresh_ = true;
   }
   
-  buttonDebounce(); 
+  // The debounce needs a few consistent reads, there's no point in paying
+  // for an analogRead() on every pass
+  if(millis() - sampleTimer_ >= BUTTON_SAMPLE_PERIOD)
+  {
+    sampleTimer_ = millis();
+    buttonDebounce(); 
+  }
+
   switch(buttonState_)
   {
     case ButtonStateEnum::released:
       if(buttonNow_ == ButtonStateEnum::pressed)
       {
-        holdTimer_ = millis();
-        holdRate_ = HOLD_EVENTS_START;
+        holdStart_ = millis();
+        holdTimer_ = holdStart_;
+        holdRate_ = isLengthEdit() ? LENGTH_HOLD_START : HOLD_EVENTS_START;
         buttonState_ = ButtonStateEnum::pressed;
         onButtonPressed(button_);  
       }
@@ -166,7 +211,7 @@ Menu::runFsm()
       else if(millis() - holdTimer_ > holdRate_)
       {
         holdTimer_ = millis();
-        holdRate_ = HOLD_EVENTS_MAX;
+        holdRate_ = isLengthEdit() ? LENGTH_HOLD_RATE : HOLD_EVENTS_MAX;
         buttonState_ = ButtonStateEnum::hold;
         onButtonHeld(button_);
       }
@@ -190,6 +235,95 @@ Menu::runFsm()
     default:
       break;
   }
+
+#if MENU_MEMORY_PAGE == 1
+  if(item_ == ItemSelectedEnum::memory && millis() - redrawTimer_ > MEMORY_REDRAW_PERIOD)
+  {
+    refresh_ = true;
+  }
+#endif
+#if MENU_LINK_PAGE == 1
+  if(item_ == ItemSelectedEnum::link && millis() - redrawTimer_ > LINK_REDRAW_PERIOD)
+  {
+    refresh_ = true;
+  }
+#endif
+
+  // Coalesce redraws while a button is held, the last edit is always shown
+  // once the button is released. The redraw is done a row per call, so the
+  // scheduler can serve the Zim in between.
+  if(redrawStep_ == 1)
+  {
+    showHeader();
+    redrawStep_ = 2;
+  }
+  else if(redrawStep_ == 2)
+  {
+    showItem(item_, edit_);
+    redrawStep_ = 0;
+  }
+  else if(refresh_ &&
+          (buttonState_ != ButtonStateEnum::hold ||
+           millis() - redrawTimer_ > HOLD_REDRAW_MIN))
+  {
+    refresh_ = false;
+    redrawTimer_ = millis();
+    redrawStep_ = 1;
+  }
+}
+
+/// True if no lcd redraw is pending, the splash counts as idle as it
+/// only waits for time to pass
+bool Menu::isIdle()
+{
+  return (splash_ || !refresh_) && redrawStep_ == 0 && !events.isPending(events_);
+}
+
+/// True while editing one of the filament length fields
+bool Menu::isLengthEdit()
+{
+  return edit_ &&
+         (item_ == ItemSelectedEnum::len || item_ == ItemSelectedEnum::used);
+}
+
+/// Step a filament length up or down. The step doubles for every
+/// LENGTH_STEP_DOUBLING msecs the button is held and the result is snapped
+/// to a multiple of the step, so long holds move through whole metres,
+/// then tens of metres.
+long Menu::stepLength(long len, bool up)
+{
+  if((up && len >= FILAMENT_LENGTH_MAX) || (!up && len <= 0))
+    return len;
+
+  long step = LENGTH_STEP_MIN;
+  if(buttonState_ == ButtonStateEnum::hold)
+  {
+    unsigned long held = millis() - holdStart_;
+    while(held > LENGTH_STEP_DOUBLING && step < LENGTH_STEP_MAX)
+    {
+      step <<= 1;
+      held -= LENGTH_STEP_DOUBLING;
+    }
+  }
+
+  if(step == LENGTH_STEP_MIN)
+  {
+    len += up ? step : -step;
+  }
+  else if(up)
+  {
+    len = (len / step + 1) * step;
+  }
+  else
+  {
+    len = ((len + step - 1) / step - 1) * step;
+  }
+
+  if(len > FILAMENT_LENGTH_MAX)
+    len = FILAMENT_LENGTH_MAX;
+  if(len < 0)
+    len = 0;
+  return len;
 }
 
 void Menu::onButtonPressed(ButtonEnum::Type button)
@@ -197,16 +331,21 @@ void Menu::onButtonPressed(ButtonEnum::Type button)
   switch(button)
   {
     case ButtonEnum::left:
-      filament_ = FilamentSelectedEnum::left;
+      // steps back through the ports, with one printer it is just the left
+      if(selected_ > 0)
+        --selected_;
+      filament_ = FilamentSelectedEnum::Type(selected_ & 1);
       refresh_ = true;
-      pSelected_ = pLeft_;
+      pSelected_ = pPorts_[selected_];
       //readCartridgeParams();
       break;
     
     case ButtonEnum::right:
-      filament_ = FilamentSelectedEnum::right;
+      if(selected_ < numPorts_ - 1)
+        ++selected_;
+      filament_ = FilamentSelectedEnum::Type(selected_ & 1);
       refresh_ = true;
-      pSelected_ = pRight_;
+      pSelected_ = pPorts_[selected_];
      // readCartridgeParams();
       break;
 
@@ -234,12 +373,12 @@ void Menu::onButtonPressed(ButtonEnum::Type button)
       if(edit_)
       { 
         // Select pressed while editing an item
-        pSelected_->saveCartridgeData();
+        pSelected_->requestSave();
         edit_ = false;
       }
-      else if(item_ != ItemSelectedEnum::unused)
+      else if(item_ < ItemSelectedEnum::unused)
       {
-        // Select pressed while selecting an items (can't edit "unused" item)
+        // Select pressed while selecting an items (can't edit "unused" or later items)
         edit_ = true; 
       }
       refresh_ = true;
@@ -248,12 +387,6 @@ void Menu::onButtonPressed(ButtonEnum::Type button)
     default:
       break;
   }
-
-  if(refresh_)
-  {
-    refresh_ = false;
-    updateLcd();
-  }
 }
 
 void Menu::onButtonHeld(ButtonEnum::Type button)
@@ -273,13 +406,6 @@ void Menu::onButtonHeld(ButtonEnum::Type button)
     default:
       break;
   }
-
-  if(refresh_)
-  {
-    refresh_ = false;
-    updateLcd();
-  }      
-  
 }
 
 void Menu::onButtonReleased(ButtonEnum::Type button)
@@ -316,27 +442,19 @@ void Menu::incSelected(ItemSelectedEnum::Type item)
       break;      
       
     case ItemSelectedEnum::len:
-      if(pSelected_->cartridge_.data_.initLen_ < FILAMENT_LENGTH_MAX)
-      {      
-        pSelected_->cartridge_.data_.initLen_ += 1000;
-        if(pSelected_->cartridge_.data_.initLen_ > FILAMENT_LENGTH_MAX)
-          pSelected_->cartridge_.data_.initLen_ = FILAMENT_LENGTH_MAX;
-      }
+      pSelected_->cartridge_.data_.initLen_ = 
+        stepLength(pSelected_->cartridge_.data_.initLen_, true);
       break;
 
     case ItemSelectedEnum::used:
-      if(pSelected_->cartridge_.data_.usedLen_ < FILAMENT_LENGTH_MAX)   
-      {   
-        pSelected_->cartridge_.data_.usedLen_ += 1000;    
-        if(pSelected_->cartridge_.data_.usedLen_ > FILAMENT_LENGTH_MAX)
-          pSelected_->cartridge_.data_.usedLen_ = FILAMENT_LENGTH_MAX;
-      }
+      pSelected_->cartridge_.data_.usedLen_ = 
+        stepLength(pSelected_->cartridge_.data_.usedLen_, true);
       break;
 
     default:
       break;
   }
-  updateLcd();
+  refresh_ = true;
 }
 
 /// Decrement the selected item
@@ -367,39 +485,41 @@ void Menu::decSelected(ItemSelectedEnum::Type item)
       break;       
 
     case ItemSelectedEnum::len:
-      if(pSelected_->cartridge_.data_.initLen_ > 0)
-      {      
-        pSelected_->cartridge_.data_.initLen_ -= 1000;
-        if(pSelected_->cartridge_.data_.initLen_ < 0)
-        {
-          pSelected_->cartridge_.data_.initLen_ = 0;
-        }
-      }
+      pSelected_->cartridge_.data_.initLen_ = 
+        stepLength(pSelected_->cartridge_.data_.initLen_, false);
       break;
 
     case ItemSelectedEnum::used:
-      if(pSelected_->cartridge_.data_.usedLen_ > 0)
-      {     
-        pSelected_->cartridge_.data_.usedLen_ -= 1000;
-        if(pSelected_->cartridge_.data_.usedLen_ < 0)
-        {
-          pSelected_->cartridge_.data_.usedLen_ = 0;   
-        }
-      }
+      pSelected_->cartridge_.data_.usedLen_ = 
+        stepLength(pSelected_->cartridge_.data_.usedLen_, false);
       break;
 
     default:
       break;
   }
-  updateLcd();
+  refresh_ = true;
 }
 
 /// Show the selected item on the LCD
 void
 Menu::showSelected(ItemSelectedEnum::Type item, bool edit)
+{
+  showHeader();
+  showItem(item, edit);
+}
+
+/// Clear the LCD and show the selected filament on the first row
+void
+Menu::showHeader()
 {
   lcd.clear();
   lcd.setCursor(0,0);
+  if(numPorts_ > 2)
+  {
+    // printer number, for a master showing its slaves' ports
+    lcd.print(selected_ / 2 + 1);
+    lcd.print(" ");
+  }
   if(filament_ == FilamentSelectedEnum::left)
   {  
     lcd.print("Left Filament");
@@ -408,7 +528,13 @@ Menu::showSelected(ItemSelectedEnum::Type item, bool edit)
   {
     lcd.print("Right Filament");
   } 
+}
 
+/// Show the selected item on the second row
+void
+Menu::showItem(ItemSelectedEnum::Type item, bool edit)
+{
+  char text[FORMAT_METRES_SIZE];
   lcd.setCursor(0,1);
   switch(item)
   {
@@ -424,69 +550,70 @@ Menu::showSelected(ItemSelectedEnum::Type item, bool edit)
 
     case ItemSelectedEnum::temp:
       lcd.print("Temp:");
-      lcd.print(pSelected_->cartridge_.data_.tempPrint_ + TEMPERATURE_OFFSET);      
+      formatCelsius(text, pSelected_->cartridge_.data_.tempPrint_);
+      lcd.print(text);
       lcd.print("C");
       break;
 
     case ItemSelectedEnum::tempFirst:
       lcd.print("TempFirst:");
-      lcd.print(pSelected_->cartridge_.data_.tempFirst_ + TEMPERATURE_OFFSET);
+      formatCelsius(text, pSelected_->cartridge_.data_.tempFirst_);
+      lcd.print(text);
       lcd.print("C");
       break;       
 
     case ItemSelectedEnum::len:
-      {
-        lcd.print("Length:");
-        float len = pSelected_->cartridge_.data_.initLen_/1000.0;
-        lcd.print(len);
-        lcd.print("m");
-      }
+      lcd.print("Length:");
+      formatMetres(text, pSelected_->cartridge_.data_.initLen_);
+      lcd.print(text);
+      lcd.print("m");
       break;
 
     case ItemSelectedEnum::used:
-      {
-        lcd.print("Used:");
-        float len = pSelected_->cartridge_.data_.usedLen_/1000.0;
-        lcd.print(len);
-        lcd.print("m");
-      }
+      lcd.print("Used:");
+      formatMetres(text, pSelected_->cartridge_.data_.usedLen_);
+      lcd.print(text);
+      lcd.print("m");
       break;
 
     case ItemSelectedEnum::unused:
+      lcd.print("Unused:");
+      formatMetres(text, pSelected_->cartridge_.data_.initLen_ - pSelected_->cartridge_.data_.usedLen_);
+      lcd.print(text);
+      lcd.print("m");
+      break;                        
+
+#if MENU_MEMORY_PAGE == 1
+    case ItemSelectedEnum::memory:
       {
-        lcd.print("Unused:");
-        float len = (pSelected_->cartridge_.data_.initLen_ - pSelected_->cartridge_.data_.usedLen_)/1000.0;
-        lcd.print(len);
-        lcd.print("m");
+        // free ram now / lowest ever
+        Memory::Stats stats;
+        memory.getStats(stats);
+        lcd.print("Free:");
+        lcd.print(stats.free_);
+        lcd.print("/");
+        lcd.print(stats.freeMin_);
       }
-      break;                        
+      break;
+#endif
+
+#if MENU_LINK_PAGE == 1
+    case ItemSelectedEnum::link:
+      // protocol errors / slowest request handled
+      lcd.print("Err:");
+      lcd.print(pSelected_->stats_.errors());
+      lcd.print(" Max:");
+      lcd.print(pSelected_->stats_.maxHandleUs_);
+      lcd.print("us");
+      break;
+#endif
 
     default:
       break;
   }
 
-  if(edit_ && item != ItemSelectedEnum::unused)
+  if(edit_ && item < ItemSelectedEnum::unused)
     lcd.print("*");
 }
 
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
+#endif
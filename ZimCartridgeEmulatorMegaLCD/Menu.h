@@ -14,6 +14,16 @@
 #include <Arduino.h>
 #include "Rfid.h"
 
+#define MENU_MEMORY_PAGE    1 // If set, a read only item after "Unused" shows free ram
+#define MENU_LINK_PAGE      1 // If set, a read only item at the end shows the port's protocol errors
+
+// Set to 1 for boards without the keypad shield. The menu, the LCD driver
+// and the button sampling are left out and the cartridges are configured
+// over the console with zimctl.
+#ifndef ZIM_HEADLESS
+#define ZIM_HEADLESS        0
+#endif
+
 namespace ButtonEnum
 {
   enum Type
@@ -57,7 +67,14 @@ namespace ItemSelectedEnum
     tempFirst,
     len,
     used,
-    unused
+    unused,
+#if MENU_MEMORY_PAGE == 1
+    memory,
+#endif
+#if MENU_LINK_PAGE == 1
+    link,
+#endif
+    last
   };
   static const byte Mask = 0xF0;
 }
@@ -72,22 +89,39 @@ private:
   static const unsigned long HOLD_EVENTS_START;
   static const unsigned long HOLD_EVENTS_MAX;
   static const unsigned long HOLD_EVENTS_MIN;
+  static const unsigned long LENGTH_HOLD_START;
+  static const unsigned long LENGTH_HOLD_RATE;
+  static const unsigned long LENGTH_STEP_DOUBLING;
+  static const unsigned long HOLD_REDRAW_MIN;
+  static const unsigned long SPLASH_TIME;
+  static const unsigned long BUTTON_SAMPLE_PERIOD;
+  static const unsigned long MEMORY_REDRAW_PERIOD;
+  static const unsigned long LINK_REDRAW_PERIOD;
+  static const long LENGTH_STEP_MIN;
+  static const long LENGTH_STEP_MAX;
   static const long FILAMENT_LENGTH_MAX;
     
 public:
-  Menu(Rfid * pLeft, Rfid * pRight);
+  Menu(Rfid ** pPorts, byte numPorts);
   void init();
   void updateLcd();  
   void buttonDebounce();
   void runFsm();
+  bool isIdle();
   void onButtonPressed(ButtonEnum::Type button);
   void onButtonHeld(ButtonEnum::Type button);
   void onButtonReleased(ButtonEnum::Type button);
   void incSelected(ItemSelectedEnum::Type item);
   void decSelected(ItemSelectedEnum::Type item);
   void showSelected(ItemSelectedEnum::Type item, bool edit = false);
+  void showHeader();
+  void showItem(ItemSelectedEnum::Type item, bool edit);
   
-private:  
+private:
+  bool isLengthEdit();
+  long stepLength(long len, bool up);
+
+
   int                         adcSample_;
   int                         adcRead_;
   FilamentSelectedEnum::Type  filament_;
@@ -95,14 +129,22 @@ private:
   ButtonEnum::Type            button_;
   ButtonStateEnum::Type       buttonNow_;
   ButtonStateEnum::Type       buttonState_;
+  unsigned long               holdStart_;
   unsigned long               holdTimer_;
   unsigned long               holdRate_;  
+  unsigned long               redrawTimer_;
+  unsigned long               splashTimer_;
+  unsigned long               sampleTimer_;
+  bool                        splash_;
   bool                        edit_;
   bool                        refresh_;
+  byte                        redrawStep_; // next lcd row to draw, 0 when done
+  byte                        events_;     // EventQueue consumer id
 
-  // Cartridge pointers
-  Rfid * pLeft_;
-  Rfid * pRight_;
+  // Cartridge pointers, left and right of each printer in turn
+  Rfid ** pPorts_;
+  byte numPorts_;
+  byte selected_;
   Rfid * pSelected_;
 };
 
@@ -0,0 +1,188 @@
+// Zim Cartridge Emulator
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include "Power.h"
+
+Power::Power(bool (*pIsIdle)()) :
+                                pIsIdle_(pIsIdle),
+                                statsStart_(0),
+                                asleepMs_(0),
+                                asleepUs_(0),
+                                sleeps_(0),
+                                workWakes_(0),
+                                wakeUs_(0),
+                                maxServiceUs_(0),
+                                latencyUs_(0),
+                                latencies_(0),
+                                maxLatencyUs_(0),
+                                serving_(false),
+                                woken_(false)
+{
+}
+
+void
+Power::init(Console * pConsole)
+{
+  pConsole->addCommand(ConsoleCommand::power, onConsole, this);
+  resetStats();
+}
+
+/// Sleep until the next interrupt if there is no work. The idle check runs
+/// with interrupts disabled and sei is immediately followed by sleep, so a
+/// byte arriving after the check always wakes the CPU again.
+void 
+Power::runFsm()
+{
+#if POWER_IDLE_SLEEP == 1
+  cli();
+  if(!pIsIdle_())
+  {
+    sei();
+    return;
+  }
+
+  unsigned long start = micros();
+  if(serving_)
+  {
+    unsigned long service = start - wakeUs_;
+    if(service > 0xFFFF)
+      service = 0xFFFF;
+    if(service > maxServiceUs_)
+      maxServiceUs_ = service;
+    serving_ = false;
+    woken_ = false;
+  }
+
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  sleep_enable();
+  sei();
+  sleep_cpu();
+  sleep_disable();
+
+  unsigned long now = micros();
+  asleepUs_ += now - start;
+  asleepMs_ += asleepUs_ / 1000;
+  asleepUs_ %= 1000;
+  ++sleeps_;
+
+  if(!pIsIdle_())
+  {
+    ++workWakes_;
+    wakeUs_ = now;
+    serving_ = true;
+    woken_ = true;
+  }
+#endif
+}
+
+/// Called as an Rfid port starts handling a frame, the first one after a
+/// work wake gives the wake latency
+void
+Power::frameStarted()
+{
+  if(!woken_)
+  {
+    return;
+  }
+  woken_ = false;
+  unsigned long latency = micros() - wakeUs_;
+  if(latency > 0xFFFF)
+    latency = 0xFFFF;
+  if(latency > maxLatencyUs_)
+    maxLatencyUs_ = latency;
+  latencyUs_ += latency;
+  ++latencies_;
+}
+
+void
+Power::resetStats()
+{
+  statsStart_ = millis();
+  asleepMs_ = 0;
+  asleepUs_ = 0;
+  sleeps_ = 0;
+  workWakes_ = 0;
+  maxServiceUs_ = 0;
+  latencyUs_ = 0;
+  latencies_ = 0;
+  maxLatencyUs_ = 0;
+}
+
+/// Estimated average MCU supply current in uA since the stats were reset.
+/// Only covers the AVR itself, not the regulator, USB bridge or LCD backlight.
+unsigned int
+Power::estimateCurrent()
+{
+  unsigned long window = millis() - statsStart_;
+  if(window == 0)
+  {
+    return POWER_ACTIVE_UA;
+  }
+  // asleepMs_ * 1000 overflows after 71 minutes asleep, by then dividing
+  // the window first loses nothing that shows
+  unsigned long idlePermille = window < 0xFFFFFFFFUL / 1000 ?
+                               asleepMs_ * 1000 / window :
+                               asleepMs_ / (window / 1000);
+  if(idlePermille > 1000)
+  {
+    idlePermille = 1000;
+  }
+  return (POWER_IDLE_UA * idlePermille + POWER_ACTIVE_UA * (1000 - idlePermille)) / 1000;
+}
+
+/// Console command: -> uint32 window ms, uint32 asleep ms, uint32 sleeps,
+/// uint32 work wakes, uint16 max service us, uint16 estimated uA,
+/// uint16 max wake latency us, uint16 mean wake latency us.
+/// A non zero first data byte resets the stats after reading them.
+ConsoleStatus::Type
+Power::onConsole(void * pContext, byte port, byte * preq, int len,
+                 byte * prsp, int rspMax, int & rspLen)
+{
+  if(rspMax < 24)
+  {
+    rspLen = 0;
+    return ConsoleStatus::overflow;
+  }
+  Power * pPower = (Power *)pContext;
+  unsigned long values[] =
+  {
+    millis() - pPower->statsStart_,
+    pPower->asleepMs_,
+    pPower->sleeps_,
+    pPower->workWakes_
+  };
+
+  rspLen = 0;
+  for(unsigned int i=0; i<sizeof(values)/sizeof(values[0]); ++i)
+  {
+    for(int b=0; b<4; ++b)
+    {
+      prsp[rspLen++] = (values[i] >> (8*b)) & 0xFF;
+    }
+  }
+  unsigned int current = pPower->estimateCurrent();
+  prsp[rspLen++] = pPower->maxServiceUs_ & 0xFF;
+  prsp[rspLen++] = pPower->maxServiceUs_ >> 8;
+  prsp[rspLen++] = current & 0xFF;
+  prsp[rspLen++] = current >> 8;
+  unsigned int meanLatency = pPower->latencies_ ? pPower->latencyUs_ / pPower->latencies_ : 0;
+  prsp[rspLen++] = pPower->maxLatencyUs_ & 0xFF;
+  prsp[rspLen++] = pPower->maxLatencyUs_ >> 8;
+  prsp[rspLen++] = meanLatency & 0xFF;
+  prsp[rspLen++] = meanLatency >> 8;
+
+  if(len > 0 && preq[0] != 0)
+  {
+    pPower->resetStats();
+  }
+  return ConsoleStatus::ok;
+}
@@ -0,0 +1,57 @@
+// Zim Cartridge Emulator 
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+#ifndef Power_h
+#define Power_h
+
+#include <Arduino.h>
+#include "Console.h"
+
+#define POWER_IDLE_SLEEP    1     // If set, sleep in SLEEP_MODE_IDLE when there is no work
+#define POWER_ACTIVE_UA     14000 // typical ATmega2560 supply current at 16MHz/5V, uA
+#define POWER_IDLE_UA       4000  // typical ATmega2560 supply current in idle mode, uA
+
+/// Puts the CPU in idle mode between interrupts when nothing is pending.
+/// Idle mode keeps the clocks and peripherals running, so the UART RX
+/// interrupt wakes the CPU within a few cycles and the first reply is not
+/// delayed. The timer0 tick wakes it every 1.024 ms for millis(), timeouts
+/// and the button ADC sampling. The sketch calls frameStarted() when an Rfid
+/// port starts handling a frame, which times the wake latency, from the
+/// wake that found work to that point.
+class Power
+{
+public:
+  Power(bool (*pIsIdle)());
+  void init(Console * pConsole);
+  void runFsm();
+  void frameStarted();
+  void resetStats();
+  unsigned int estimateCurrent();
+
+  static ConsoleStatus::Type onConsole(void * pContext, byte port,
+                                       byte * preq, int len,
+                                       byte * prsp, int rspMax, int & rspLen);
+
+private:
+  bool            (*pIsIdle_)();
+  unsigned long   statsStart_;    // msecs
+  unsigned long   asleepMs_;
+  unsigned int    asleepUs_;      // remainder below 1 ms
+  unsigned long   sleeps_;
+  unsigned long   workWakes_;     // wakes that found work, e.g. an RX byte
+  unsigned long   wakeUs_;        // micros() at the last work wake
+  unsigned int    maxServiceUs_;  // longest wake to idle time after a work wake
+  unsigned long   latencyUs_;     // sum of the wake to frame handling times
+  unsigned long   latencies_;
+  unsigned int    maxLatencyUs_;
+  bool            serving_;
+  bool            woken_;         // work wake not yet followed by a frame
+};
+
+#endif
@@ -8,27 +8,88 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 // THE SOFTWARE.
 
-#include <EEPROM.h>
 #include "Rfid.h"
 #include "Menu.h"
+#include "Watchdog.h"
+#include "Format.h"
+#include "Trace.h"
+#include "FramePool.h"
+#include "TagCodec.h"
 
 Payload::Payload() :
                   addr_(0),
                   len_(0),
                   funcCode_(RfidCommand::none),
                   index_(0),
-                  msb_(false)
+                  msb_(false),
+                  xor_(0),
+                  payload_(NULL)
 {
 }
 
 
-Rfid::Rfid(String name, HardwareSerial * serial, Cartridge cartridge) :  
+RfidStats::RfidStats()
+{
+  reset();
+}
+
+void
+RfidStats::reset()
+{
+  memset(frames_, 0, sizeof(frames_));
+  requests_ = 0;
+  bytesIn_ = 0;
+  bytesOut_ = 0;
+  handleUs_ = 0;
+  maxHandleUs_ = 0;
+  timeouts_ = 0;
+  badXor_ = 0;
+  oversize_ = 0;
+  resyncs_ = 0;
+  unhandled_ = 0;
+}
+
+/// Sum of the error counters
+unsigned long
+RfidStats::errors()
+{
+  return (unsigned long)timeouts_ + badXor_ + oversize_ + resyncs_ + unhandled_;
+}
+
+/// Increments an error counter, saturating
+void
+RfidStats::count(unsigned int & counter)
+{
+  if(counter < 0xFFFF)
+    ++counter;
+}
+
+
+Rfid::Rfid(String name, byte port, HardwareSerial * serial, Cartridge cartridge, FramePool * pPool) :  
                                 name_(name),
+                                port_(port),
                                 cartridge_(cartridge),
                                 state_(SerialState::idle),
+                                hunting_(false),
                                 serial_(serial),
+                                pPool_(pPool),
                                 timeout_(0),
-                                updated_(true)
+                                firstResponse_(0),
+                                commitMs_(0),
+                                stagedPages_(0),
+                                stageMs_(0),
+                                logPending_(false),
+                                logCartridge_(false),
+                                logRspLen_(0),
+                                logStatus_(RFID_STATUS_OK),
+                                logsDropped_(0),
+                                prestagePending_(false),
+                                prestage_(NULL),
+                                prestageLen_(0),
+                                prestageFuncCode_(0),
+                                prestageAddr_(0),
+                                prestageData_(cartridge.data_.id_),
+                                prestageUs_(0)
 {  
 }
 
@@ -41,22 +102,62 @@ Rfid::runFsm()
   if(state_ != SerialState::idle &&
      (millis() - timeout_) > RX_TIMEOUT)
   {
+#if TRACE_BINARY == 1
+    trace.event(TraceEvent::rxTimeout, port_);
+#else
     Serial.println("Rx timeout");
+#endif
+    RfidStats::count(stats_.timeouts_);
     state_ = SerialState::idle;
+    releasePayload();
+    cadence_.requestAbandoned();
+  }
+
+  if(isStageExpired())
+  {
+#if TRACE_BINARY == 1
+    trace.event(TraceEvent::stageDropped, port_);
+#else
+    Serial.print("Staged tag write dropped for ");
+    Serial.println(name_);
+#endif
+    stagedPages_ = 0;
   }
 
   if(serial_->available())
   {
     rx = (byte)serial_->read();
-    Serial.print(rx, HEX);
-    Serial.print(" ");
+    ++stats_.bytesIn_;
   
     switch(state_)
     {
       case SerialState::idle:
-        if(rx == 0xAA)
+        if(rx != 0xAA)
+        {
+          if(!hunting_)
+          {
+            RfidStats::count(stats_.resyncs_);
+            hunting_ = true;
+          }
+        }
+        else
         {        
+          if(logPending_)
+          {
+            // the payload is about to be overwritten
+            logPending_ = false;
+            ++logsDropped_;
+          }
+          if(payload_.payload_ == NULL)
+          {
+            payload_.payload_ = pPool_->acquire();
+            if(payload_.payload_ == NULL)
+            {
+              break; // the pool counts it, the Zim retries
+            }
+          }
           timeout_ = millis();
+          cadence_.requestStarted(micros());
           state_ = SerialState::start;
         }
         break;
@@ -64,9 +165,15 @@ Rfid::runFsm()
       case SerialState::start:
         if(rx == 0xBB)
         {
+          hunting_ = false;
           payload_.msb_ = false;
           state_ = SerialState::len;
         }
+        else if(!hunting_)
+        {
+          RfidStats::count(stats_.resyncs_);
+          hunting_ = true;
+        }
         break;
   
       case SerialState::len:
@@ -88,17 +195,20 @@ Rfid::runFsm()
         if(payload_.msb_ == false)
         {
           payload_.addr_ = rx;
+          payload_.xor_ = rx;
           payload_.msb_ = true;
         }
         else
         {
           payload_.addr_ += rx<<8;
+          payload_.xor_ ^= rx;
           payload_.msb_ = false;
           state_ = SerialState::funcCode; 
         }
         break;
         
       case SerialState::funcCode:
+        payload_.xor_ ^= rx;
         if(payload_.msb_ == false)
         {    
           payload_.funcCode_ = RfidCommand::Type(rx);
@@ -111,6 +221,10 @@ Rfid::runFsm()
           payload_.funcCode_ = RfidCommand::Type(temp);
           payload_.index_ = 0;
           payload_.msb_ = false;     
+          if(payload_.len_ < 0 || payload_.len_ > FRAME_BUFFER_SIZE)
+          {
+            RfidStats::count(stats_.oversize_);
+          }
           if(payload_.len_ == 0)
           {
             // no payload data
@@ -126,7 +240,12 @@ Rfid::runFsm()
       case SerialState::data:        
         if(payload_.index_ < payload_.len_)
         {       
-          payload_.payload_[payload_.index_++] = rx;
+          if(payload_.index_ < FRAME_BUFFER_SIZE)
+          {
+            payload_.payload_[payload_.index_] = rx;
+          }
+          payload_.xor_ ^= rx;
+          ++payload_.index_;
           break;
         }
         else
@@ -136,69 +255,95 @@ Rfid::runFsm()
         // falls through...
         
       case SerialState::xorCheck:
-        // Doesn't currently perform an XOR error check.
+        // A bad XOR is counted but the request is still served, as it
+        // always was
+        if(rx != payload_.xor_)
+        {
+          RfidStats::count(stats_.badXor_);
+        }
         state_ = SerialState::complete;
         // falls through...
       
       case SerialState::complete:  
-        Serial.print("\nReceived ");
-        Serial.print(payload_.index_);
-        Serial.print(" bytes from Zim for ");
-        Serial.println(name_);
-        Serial.print("FuncCode:");
-        Serial.println(payload_.funcCode_, HEX);
-        Serial.print("Payload Length:");
-        Serial.println(payload_.len_, HEX);      
-        Serial.print("Data:");
-        for(int i=0; i<payload_.len_; ++i)
+      {
+        logRspLen_ = 0;
+        logCartridge_ = false;
+        cadence_.requestDone(payload_.funcCode_);
+        unsigned long start = micros();
+        handleRequest(payload_.funcCode_, payload_.payload_,
+                      payload_.len_ < FRAME_BUFFER_SIZE ? payload_.len_ : FRAME_BUFFER_SIZE);
+        unsigned long now = micros();
+        unsigned long handleUs = now - start;
+        ++stats_.requests_;
+        stats_.handleUs_ += handleUs;
+        if(handleUs > stats_.maxHandleUs_)
         {
-          Serial.print("0x");
-          Serial.print(payload_.payload_[i], HEX);
-          Serial.print(" ");
+          stats_.maxHandleUs_ = handleUs < 0xFFFF ? handleUs : 0xFFFF;
         }
-        Serial.println("");
-           
-        handleRequest(payload_.funcCode_, payload_.payload_, payload_.len_);
+        cadence_.replied(now);
+        releasePrestage();
+        prestagePending_ = cadence_.predicted() != 0;
+        logPending_ = true; // printed by printLog() in slack time
         state_ = SerialState::idle;
         break;
+      }
   
       default:
         break;
     }
   }  
+  else if(prestagePending_)
+  {
+    prestage();
+  }
 }
 
-// Generates responses for Mifare protocol.
-// Format is: uint16 header (0xAABB) - uint16 len - uint16 nodeId - uint16 func code - uint8 status - uint8 n data - uint8 XOR
+// Generates payloadless responses, the NAK
 void 
-Rfid::sendResponse(byte * pPayload, int len)
+Rfid::sendResponse(byte status)
+{
+  byte frame[RFID_FRAME_HEADER + 1];
+  sendFrame(frame, buildFrame(frame, payload_.funcCode_, 0, status), status);
+}
+
+// Generates responses for Mifare protocol around the len payload bytes at
+// pframe + RFID_FRAME_HEADER, returns the frame length.
+// Format is: uint16 header (0xAABB) - uint16 len - uint16 nodeId - uint16 func code - uint8 status - uint8 n data - uint8 XOR
+int
+Rfid::buildFrame(byte * pframe, uint16_t funcCode, int len, byte status)
 {
   int  index = 0;
   int  pktLen = 0;
-  byte rsp[50];
-  int  rspLen = 0;
 
   pktLen = len + 6; // includes crc
-  rsp[index++] = 0xAA;
-  rsp[index++] = 0xBB;
-  rsp[index++] = pktLen & 0xFF;
-  rsp[index++] = pktLen>>8;
-  rsp[index++] = payload_.addr_ & 0xFF;
-  rsp[index++] = payload_.addr_>>8;
-  rsp[index++] = payload_.funcCode_ & 0xFF;
-  rsp[index++] = payload_.funcCode_>>8;
-  rsp[index++] = 0; // status: success
-
-  // stuff payload
-  if(pPayload != NULL)
+  pframe[index++] = 0xAA;
+  pframe[index++] = 0xBB;
+  pframe[index++] = pktLen & 0xFF;
+  pframe[index++] = pktLen>>8;
+  pframe[index++] = payload_.addr_ & 0xFF;
+  pframe[index++] = payload_.addr_>>8;
+  pframe[index++] = funcCode & 0xFF;
+  pframe[index++] = funcCode>>8;
+  pframe[index++] = status;
+
+  // stuff payload in place, from the end so nothing is overwritten
+  int escapes = 0;
+  for(int i=0; i<len; ++i)
   {
-    for(int i=0; i<len; ++i)
+    if(pframe[index + i] == 0xAA)
     {
-      if(pPayload[i] == 0xAA)
-      {
-        rsp[index++] = 0x00; // escape 0xAA
-      }
-      rsp[index++] = pPayload[i];    
+      ++escapes;
+    }
+  }
+  int from = index + len;
+  index = from + escapes;
+  for(int to=index; from != to; )
+  {
+    byte value = pframe[--from];
+    pframe[--to] = value;
+    if(value == 0xAA)
+    {
+      pframe[--to] = 0x00; // escape 0xAA
     }
   }
 
@@ -206,182 +351,368 @@ Rfid::sendResponse(byte * pPayload, int len)
   byte xorVal = 0;
   for(int i=6; i<index; ++i)
   {
-     xorVal ^= rsp[i];
+     xorVal ^= pframe[i];
   }
 
-  rsp[index++] = xorVal;
-  rspLen = index;
+  pframe[index++] = xorVal;
+  return index;
+}
+
+void
+Rfid::sendFrame(const byte * pframe, int len, byte status)
+{
+  logRspLen_ = len;
+  logStatus_ = status;
+  stats_.bytesOut_ += len;
 
-  Serial.print("Sending ");
-  Serial.print(rspLen);
-  Serial.print(" bytes to Zim for ");
-  Serial.println(name_);
+  for(int i=0; i<len; ++i)
+  {
+      serial_->write(pframe[i]);
+  }
 
-  for(int i=0; i<rspLen; ++i)
+  if(firstResponse_ == 0)
   {
-      serial_->write(rsp[i]);
+    firstResponse_ = millis();
+#if TRACE_BINARY == 1
+    trace.value(TraceEvent::firstResponse, port_, firstResponse_, 4);
+#else
+    Serial.print("First response for ");
+    Serial.print(name_);
+    Serial.print(" after ");
+    Serial.print(firstResponse_);
+    Serial.println(" ms");
+#endif
+  }
+}
+
+// Commands the Zim sends, looked up by handleRequest()
+static constexpr CommandEntry CommandTable[] PROGMEM =
+{
+  // funcCode                       minLen  rspLen          template                  handler                 flags
+  { RfidCommand::initPort,          0,      0,              { 0 },                    NULL,                   RFID_PRESTAGE },
+  { RfidCommand::setNode,           0,      0,              { 0 },                    NULL,                   RFID_PRESTAGE },
+  { RfidCommand::setAntennaStatus,  0,      RFID_NO_REPLY,  { 0 },                    NULL,                   0 },
+  { RfidCommand::request,           0,      2,              { 0x44, 0x00 },           NULL,                   RFID_PRESTAGE },
+  { RfidCommand::antiCollision,     0,      4,              { 0x88, 0x04, 0, 0 },     Rfid::onAntiCollision,  RFID_PRESTAGE },
+  { RfidCommand::select,            0,      1,              { 0x04 },                 NULL,                   RFID_PRESTAGE },
+  { RfidCommand::halt,              0,      0,              { 0 },                    NULL,                   RFID_PRESTAGE },
+  { RfidCommand::readData,          0,      0,              { 0 },                    Rfid::onReadData,       RFID_PRESTAGE },
+  { RfidCommand::writeData,         5,      0,              { 0 },                    Rfid::onWriteData,      0 }
+};
+
+static_assert(sizeof(CommandTable)/sizeof(CommandTable[0]) == RFID_COMMANDS,
+              "RFID_COMMANDS must match the command table");
+
+// Copies the table entry for funcCode from flash, returns its index or -1
+// if there is none
+static int findCommand(uint16_t funcCode, CommandEntry & entry)
+{
+  for(int i=0; i<RFID_COMMANDS; ++i)
+  {
+    if(pgm_read_word(&CommandTable[i].funcCode_) == funcCode)
+    {
+      memcpy_P(&entry, &CommandTable[i], sizeof(entry));
+      return i;
+    }
   }
+  return -1;
+}
+
+/// funcCode of a command table entry, index < RFID_COMMANDS
+uint16_t
+Rfid::commandCode(byte index)
+{
+  return pgm_read_word(&CommandTable[index].funcCode_);
 }
 
-// Handles Mifare requests specific to Zim, and sends appropriate responses
+// Handles Mifare requests specific to Zim, and sends appropriate responses.
+// Unknown commands and short requests get a NAK so the Zim doesn't wait for
+// a reply that never comes.
 void 
 Rfid::handleRequest(RfidCommand::Type funcCode, byte * preq, int len)
 {
-  switch(funcCode)
+  CommandEntry entry;
+  int index = findCommand(funcCode, entry);
+  if(index < 0)
+  {
+    RfidStats::count(stats_.unhandled_);
+  }
+  else
+  {
+    ++stats_.frames_[index];
+  }
+  if(index >= 0 && len >= entry.minLen_)
   {
-    case RfidCommand::initPort:
+    if(entry.rspLen_ == RFID_NO_REPLY)
     {
-   
-      Serial.println("Initialize Port");   
-      sendResponse(NULL, 0);
+      return;
     }
-    break;
-    
-    case RfidCommand::setAntennaStatus:
-    {   
-      Serial.println("Set Antenna Status");     
-      // No response
+    if(isPrestaged(funcCode))
+    {
+      sendFrame(prestage_, prestageLen_, RFID_STATUS_OK);
+      ++cadence_.prestaged_;
+      cadence_.savedUs_ += prestageUs_;
+      releasePrestage();
+      return;
     }
-    break;
-    
-    case RfidCommand::request:
+
+    // the handler writes the payload straight into the reply frame
+    byte * pframe = pPool_->acquire();
+    if(pframe == NULL)
     {
-      Serial.println("Mifare Request");
-      byte payload[] = {0x44, 0x00};
-      sendResponse(payload, sizeof(payload));
+      return; // the pool counts it, the Zim retries
     }
-    break;
-    
-    case RfidCommand::antiCollision:
+    byte * prsp = &pframe[RFID_FRAME_HEADER];
+    int rspLen = entry.rspLen_;
+    memcpy(prsp, entry.rsp_, sizeof(entry.rsp_));
+    if(entry.handler_ != NULL)
     {
-      Serial.println("Mifare Anticollision");
-      byte payload[4];
-      payload[0] = 0x88;
-      payload[1] = 0x04;
-      payload[2] = cartridge_.data_.id_>>8;
-      payload[3] = cartridge_.data_.id_ & 0xFF;
-      sendResponse(payload, sizeof(payload));
-    } 
-    break;
-
-    case RfidCommand::select:
+      rspLen = entry.handler_(*this, preq, len, prsp);
+    }
+    if(rspLen >= 0)
     {
-      Serial.println("Mifare Select");
-      byte payload[] = {0x04};
-      sendResponse(payload, sizeof(payload));
-    } 
-    break;
+      sendFrame(pframe, buildFrame(pframe, funcCode, rspLen, RFID_STATUS_OK), RFID_STATUS_OK);
+      pPool_->release(pframe);
+      return;
+    }
+    pPool_->release(pframe);
+  }
+  sendResponse(RFID_STATUS_NAK);
+}
 
-    case RfidCommand::halt:
-    {
-      Serial.println("Mifare Halt");
-      sendResponse(NULL, 0);
-    } 
-    break;
+/// Builds the reply to the request the cadence predicts, in the slack after
+/// the last reply, so handleRequest() only has to write it out
+void
+Rfid::prestage()
+{
+  prestagePending_ = false;
+  uint16_t funcCode = cadence_.predicted();
+  CommandEntry entry;
+  if(findCommand(funcCode, entry) < 0 || !(entry.flags_ & RFID_PRESTAGE))
+  {
+    return;
+  }
 
-    case RfidCommand::readData:
-    {
-      Serial.println("Mifare Read");
-      byte payload[CARTRIDGE_DATA_LENGTH];
-      int len = buildCartridgePayload(payload);
-      sendResponse(payload, len);
-    }
-    break;
+  prestage_ = pPool_->acquire(true);
+  if(prestage_ == NULL)
+  {
+    return;
+  }
 
-    case RfidCommand::writeData:
-    {
-      byte page = preq[0];
-      Serial.print("Mifare Write for page ");
-      Serial.println(page);
+  unsigned long start = micros();
+  byte * prsp = &prestage_[RFID_FRAME_HEADER];
+  int rspLen = entry.rspLen_;
+  memcpy(prsp, entry.rsp_, sizeof(entry.rsp_));
+  if(entry.handler_ != NULL)
+  {
+    rspLen = entry.handler_(*this, NULL, 0, prsp);
+  }
+  if(rspLen < 0)
+  {
+    releasePrestage();
+    return;
+  }
+  prestageLen_ = buildFrame(prestage_, funcCode, rspLen, RFID_STATUS_OK);
+  prestageFuncCode_ = funcCode;
+  prestageAddr_ = payload_.addr_;
+  memcpy(&prestageData_, &cartridge_.data_, sizeof(prestageData_));
+  prestageUs_ = micros() - start;
+}
 
-      if(page == 6)
-      {
-        cartridge_.data_.magicNum_ = preq[1]<<8;
-        cartridge_.data_.magicNum_ |= preq[2];
-        cartridge_.data_.type_ = CartridgeType::Type(preq[3]>>4);
-        cartridge_.data_.material_ = Material::Type(preq[3] & 0x0F);
-        cartridge_.data_.red_ = preq[4];
-        
-      }
-      else if(page == 7)
-      {
-        cartridge_.data_.green_    = preq[1];
-        cartridge_.data_.blue_     = preq[2];
-        cartridge_.data_.initLen_  = ((long)preq[3])<<12;
-        cartridge_.data_.initLen_ |= ((long)preq[4])<<4;        
-      }
-      else if(page == 8)
-      {
-        cartridge_.data_.initLen_ |= ((long)preq[1]&0xF0)>>4;
-        cartridge_.data_.usedLen_  = ((long)preq[1]&0x0F)<<16;
-        cartridge_.data_.usedLen_ |= ((long)preq[2])<<8;
-        cartridge_.data_.usedLen_ |= ((long)preq[3]); 
-        cartridge_.data_.tempPrint_ = preq[4];
-        
-      }
-      else if(page == 9)
-      {
-        cartridge_.data_.tempFirst_ = preq[1];
-        cartridge_.data_.date_    = preq[2]<<8;
-        cartridge_.data_.date_   |= preq[3];
-        cartridge_.data_.xor_  = preq[4];  
-
-        Serial.print("Cartridge data received from Zim for ");
-        Serial.print(name_);
-        Serial.println(":");
-        printCartridgeData();
-        
-#if NEVER_ENDING_FILAMENT == 1
-        Serial.println("Your spool runneth over");
-        cartridge_.data_.usedLen_ = 0;
-#endif
-        saveCartridgeData();
-      }
-      
-      sendResponse(NULL, 0);
+/// Returns the prestaged frame to the pool, if there is one
+void
+Rfid::releasePrestage()
+{
+  if(prestage_ != NULL)
+  {
+    pPool_->release(prestage_, true);
+    prestage_ = NULL;
+  }
+  prestageLen_ = 0;
+}
+
+/// Returns the request buffer to the pool once the frame and its log are done
+void
+Rfid::releasePayload()
+{
+  if(payload_.payload_ != NULL)
+  {
+    pPool_->release(payload_.payload_);
+    payload_.payload_ = NULL;
+  }
+}
+
+/// True if the prestaged frame answers this request. It is only built from
+/// the cartridge, so any change to the cartridge since makes it stale.
+bool
+Rfid::isPrestaged(uint16_t funcCode)
+{
+  return prestage_ != NULL &&
+         prestageFuncCode_ == funcCode &&
+         prestageAddr_ == payload_.addr_ &&
+         memcmp(&prestageData_, &cartridge_.data_, sizeof(prestageData_)) == 0;
+}
+
+int
+Rfid::onAntiCollision(Rfid & rfid, const byte * preq, int len, byte * prsp)
+{
+  prsp[2] = rfid.cartridge_.data_.id_>>8;
+  prsp[3] = rfid.cartridge_.data_.id_ & 0xFF;
+  return 4;
+}
+
+int
+Rfid::onReadData(Rfid & rfid, const byte * preq, int len, byte * prsp)
+{
+  return rfid.buildCartridgePayload(prsp);
+}
+
+int
+Rfid::onWriteData(Rfid & rfid, const byte * preq, int len, byte * prsp)
+{
+  byte page = preq[0];
+  if(page >= STAGE_FIRST_PAGE && page <= STAGE_LAST_PAGE)
+  {
+    rfid.stagePage(page, &preq[1]);
+    if(page == STAGE_LAST_PAGE)
+    {
+      rfid.commitStage();
     }
-    break;
-    
-    default:
-      Serial.print("Unhandled request: 0x");
-      Serial.println(funcCode, HEX);
-    break;    
   }
-  Serial.println("");
+  return 0;
 }
 
 int
 Rfid::buildCartridgePayload(byte * pdata)
 {
-  int index = 0;
-  pdata[index++] = cartridge_.data_.magicNum_>>8;
-  pdata[index++] = cartridge_.data_.magicNum_ & 0xFF;
-  pdata[index++] = cartridge_.data_.type_<<4 | cartridge_.data_.material_ & Material::Mask;
-  pdata[index++] = cartridge_.data_.red_;
-  pdata[index++] = cartridge_.data_.green_;
-  pdata[index++] = cartridge_.data_.blue_;
-  pdata[index++] = (cartridge_.data_.initLen_>>12) & 0xFF;
-  pdata[index++] = (cartridge_.data_.initLen_>>4) & 0xFF;
-  pdata[index++] = (cartridge_.data_.initLen_<<4 | cartridge_.data_.usedLen_>>16) & 0xFF;
-  pdata[index++] = (cartridge_.data_.usedLen_>>8) & 0xFF;
-  pdata[index++] = (cartridge_.data_.usedLen_) & 0xFF;
-  pdata[index++] = cartridge_.data_.tempPrint_;
-  pdata[index++] = cartridge_.data_.tempFirst_;
-  pdata[index++] = cartridge_.data_.date_>>8;
-  pdata[index++] = cartridge_.data_.date_ & 0xFF;
+  return TagCodec::encode(cartridge_.data_, pdata);
+}
 
-  byte xorVal = 0;
-  for(int i=0; i<index; ++i)
+// Inverse of buildCartridgePayload, sets the cartridge from a tag image
+void
+Rfid::applyCartridgePayload(const byte * pdata)
+{
+  TagCodec::decode(pdata, cartridge_.data_);
+}
+
+/// Copies a written page into the shadow image. The live cartridge is not
+/// touched until page 9 commits, so reads and the menu never see a partly
+/// written tag. The shadow starts from the live image so pages the Zim
+/// skips keep their value.
+void
+Rfid::stagePage(byte page, const byte * pdata)
+{
+  if(stagedPages_ == 0)
   {
-    xorVal ^= pdata[i];
+    buildCartridgePayload(stage_);
+    stageMs_ = millis();
   }
-  pdata[index++] = xorVal;
-  return index;
+  memcpy(&stage_[(page - STAGE_FIRST_PAGE) * 4], pdata, 4);
+  stagedPages_ |= 1 << (page - STAGE_FIRST_PAGE);
+}
+
+/// Applies the shadow image in one step. This is the only place a Zim write
+/// changes the cartridge, the menu, eeprom and telemetry all follow it.
+/// Only the fields on the pages written are decoded.
+void
+Rfid::commitStage()
+{
+  TagCodec::decode(stage_, cartridge_.data_, stagedPages_);
+  stagedPages_ = 0;
+  logCartridge_ = true;
+
+#if NEVER_ENDING_FILAMENT == 1
+#if TRACE_BINARY == 1
+  trace.event(TraceEvent::overflow, port_);
+#else
+  Serial.println("Your spool runneth over");
+#endif
+  cartridge_.data_.usedLen_ = 0;
+#endif
+  commitMs_ = millis();
+  events.publish(EventType::committed, port_);
+  requestSave();
+}
+
+/// True if pages were staged but page 9 never came
+bool
+Rfid::isStageExpired()
+{
+  return stagedPages_ != 0 && (millis() - stageMs_) > STAGE_TIMEOUT;
+}
+
+/// Dump of the last frame, deferred from runFsm() so it never holds up a reply
+void
+Rfid::printLog()
+{
+#if TRACE_BINARY == 1
+  if(logsDropped_ != 0)
+  {
+    trace.value(TraceEvent::logsDropped, port_, logsDropped_, 2);
+    logsDropped_ = 0;
+  }
+  trace.frame(port_, payload_.funcCode_, payload_.len_, logStatus_, logRspLen_,
+              logCartridge_ ? TraceFlags::cartridge : 0,
+              payload_.payload_,
+              payload_.index_ < FRAME_BUFFER_SIZE ? payload_.index_ : FRAME_BUFFER_SIZE);
+  if(logCartridge_)
+  {
+    printCartridgeData();
+  }
+#else
+  if(logsDropped_ != 0)
+  {
+    Serial.print(logsDropped_);
+    Serial.print(" frame logs dropped for ");
+    Serial.println(name_);
+    logsDropped_ = 0;
+  }
+
+  Serial.print("Received ");
+  Serial.print(payload_.index_);
+  Serial.print(" bytes from Zim for ");
+  Serial.println(name_);
+  Serial.print("FuncCode:");
+  Serial.println(payload_.funcCode_, HEX);
+  Serial.print("Payload Length:");
+  Serial.println(payload_.len_, HEX);      
+  Serial.print("Data:");
+  for(int i=0; i<payload_.len_ && i<FRAME_BUFFER_SIZE; ++i)
+  {
+    Serial.print("0x");
+    Serial.print(payload_.payload_[i], HEX);
+    Serial.print(" ");
+  }
+  Serial.println("");
+
+  if(logRspLen_ != 0)
+  {
+    Serial.print(logStatus_ == RFID_STATUS_OK ? "Sent " : "Sent NAK, ");
+    Serial.print(logRspLen_);
+    Serial.print(" bytes to Zim for ");
+    Serial.println(name_);
+  }
+
+  if(logCartridge_)
+  {
+    Serial.print("Cartridge data received from Zim for ");
+    Serial.print(name_);
+    Serial.println(":");
+    printCartridgeData();
+  }
+  Serial.println("");
+#endif
+  logPending_ = false;
+  releasePayload();
 }
 
 void 
 Rfid::printCartridgeData()
 {
+#if TRACE_BINARY == 1
+  trace.cartridge(port_, cartridge_.eepromLoc_, cartridge_.data_);
+#else
+  char text[FORMAT_METRES_SIZE];
   Serial.print("Name: ");
   Serial.println(name_);
   Serial.print("ID: 0x");
@@ -401,34 +732,74 @@ Rfid::printCartridgeData()
   Serial.print("Blue: 0x");
   Serial.println(cartridge_.data_.blue_, HEX);
   Serial.print("Initial Length: ");
-  Serial.println(cartridge_.data_.initLen_);
+  formatMetres(text, cartridge_.data_.initLen_);
+  Serial.print(text);
+  Serial.println(" m");
   Serial.print("Used Length: ");
-  Serial.println(cartridge_.data_.usedLen_);
+  formatMetres(text, cartridge_.data_.usedLen_);
+  Serial.print(text);
+  Serial.println(" m");
   Serial.print("Temp Print: ");
-  Serial.println(cartridge_.data_.tempPrint_);
+  formatCelsius(text, cartridge_.data_.tempPrint_);
+  Serial.print(text);
+  Serial.println(" C");
   Serial.print("Temp Start: ");
-  Serial.println(cartridge_.data_.tempFirst_);
+  formatCelsius(text, cartridge_.data_.tempFirst_);
+  Serial.print(text);
+  Serial.println(" C");
   Serial.print("Date: 0x");
   Serial.println(cartridge_.data_.date_, HEX);
   Serial.print("Xor: 0x");
   Serial.println(cartridge_.data_.xor_, HEX);
   Serial.println("");
+#endif
 }
 
 void Rfid::saveCartridgeData()
 {
+#if TRACE_BINARY == 1
+  trace.value(TraceEvent::save, port_, cartridge_.eepromLoc_, 2);
+#else
   Serial.print("Saving cartridge data to eeprom for: ");
   Serial.print(name_);
   Serial.print(" at location: ");
   Serial.println(cartridge_.eepromLoc_, HEX);
-  EEPROM.put(cartridge_.eepromLoc_, cartridge_.data_);
-  updated_ = true;
+#endif
+  WatchdogEntry previous = watchdog.enter(Subsystem::persistence);
+  cartridge_.save();
+  watchdog.leave(previous);
 }
 
-bool Rfid::isUpdated()
+/// Ask for a save in slack time, see saveCartridgeData()
+void Rfid::requestSave()
 {
-  bool rval = updated_;
-  updated_ = false;
-  return rval;
+  events.publish(EventType::saveRequested, port_);
 }
 
+/// True if no frame is being received or waiting to be read
+bool Rfid::isIdle()
+{
+  return state_ == SerialState::idle && !serial_->available() && !prestagePending_;
+}
+
+/// True if runFsm() has something to do, a byte to parse, a reply to
+/// prestage or a timeout to raise
+bool Rfid::isReady()
+{
+  return serial_->available() || prestagePending_ ||
+         (state_ != SerialState::idle && (millis() - timeout_) > RX_TIMEOUT) ||
+         isStageExpired();
+}
+
+bool Rfid::loadCartridgeData()
+{
+  bool loaded = cartridge_.load();
+  events.publish(EventType::edited, port_);
+  return loaded;
+}
+
+void Rfid::resetCartridgeData()
+{
+  cartridge_.data_ = CartridgeData(cartridge_.data_.id_);
+  events.publish(EventType::edited, port_);
+}
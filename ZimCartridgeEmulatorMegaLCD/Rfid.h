@@ -12,9 +12,20 @@
 
 #include <Arduino.h>
 #include "Cartridge.h"
+#include "EventQueue.h"
+#include "Cadence.h"
 
 #define RFID_BAUD_RATE              19200 // don't change
 #define RX_TIMEOUT                  2000 // msecs timeout on receives
+#define STAGE_TIMEOUT               2000 // msecs from the first page write to page 9 before the staged pages are dropped
+#define STAGE_FIRST_PAGE            6    // first tag page holding the cartridge image
+#define RFID_STATUS_OK              0x00
+#define RFID_STATUS_NAK             0x01 // unknown command or short request
+#define RFID_NO_REPLY               0xFF // CommandEntry::rspLen_ for commands the Zim doesn't expect a reply to
+#define RFID_FRAME_HEADER           9    // aa bb len16 node16 funcCode16 status, the payload follows
+#define RFID_PRESTAGE               0x01 // CommandEntry::flags_, reply doesn't depend on the request
+#define RFID_COMMANDS               9    // entries in the command table, see Rfid.cpp
+#define STAGE_LAST_PAGE             (STAGE_FIRST_PAGE + CARTRIDGE_DATA_LENGTH/4 - 1) // its write commits the image
 
 namespace SerialState
 {
@@ -59,29 +70,115 @@ public:
   RfidCommand::Type funcCode_;
   int               index_;
   bool              msb_;
-  byte              payload_[64];
+  byte              xor_;       // of node to data, as received
+  byte *            payload_;   // pool buffer from the first byte until the log is printed, else NULL
 };
 
 
+/// Protocol health of one port, read with ConsoleCommand::portStats and
+/// portFrames and shown on the menu's link page
+class RfidStats
+{
+public:
+  RfidStats();
+  void reset();
+  unsigned long errors();
+  static void count(unsigned int & counter);
+
+  unsigned long     frames_[RFID_COMMANDS]; // requests per command table entry
+  unsigned long     requests_;    // all requests, unhandled ones included
+  unsigned long     bytesIn_;
+  unsigned long     bytesOut_;
+  unsigned long     handleUs_;    // total time from the last request byte to the reply written
+  unsigned int      maxHandleUs_;
+  unsigned int      timeouts_;    // requests abandoned after RX_TIMEOUT
+  unsigned int      badXor_;      // requests whose XOR didn't match, still handled
+  unsigned int      oversize_;    // length field past the frame buffer or short of the header
+  unsigned int      resyncs_;     // times bytes were dropped looking for aa bb
+  unsigned int      unhandled_;   // requests with a funcCode not in the table
+};
+
+
+class Rfid;
+class FramePool;
+
+/// Fills or completes the response in prsp, which holds the entry's
+/// template. Returns the response length or -1 for a NAK.
+typedef int (*RfidHandler)(Rfid & rfid, const byte * preq, int len, byte * prsp);
+
+/// Entry of the command table in flash. Adding a command only adds an entry,
+/// handleRequest() doesn't change.
+struct CommandEntry
+{
+  uint16_t      funcCode_;
+  byte          minLen_;    // request payload bytes the handler reads
+  byte          rspLen_;    // template length or RFID_NO_REPLY
+  byte          rsp_[4];    // response template
+  RfidHandler   handler_;   // NULL sends the template as is
+  byte          flags_;
+};
+
 class Rfid
 {
 public:
-  Rfid(String name, HardwareSerial * serial, Cartridge cartridge);
+  Rfid(String name, byte port, HardwareSerial * serial, Cartridge cartridge, FramePool * pPool);
   void runFsm();
   void handleRequest(RfidCommand::Type funcCode, byte * preq, int len);
-  void sendResponse(byte * pPayload, int len);
+  void sendResponse(byte status);
+  int  buildFrame(byte * pframe, uint16_t funcCode, int len, byte status);
+  void sendFrame(const byte * pframe, int len, byte status);
+  void prestage();
+  void releasePrestage();
+  void releasePayload();
+  bool isPrestaged(uint16_t funcCode);
   int  buildCartridgePayload(byte * pdata);
+  void applyCartridgePayload(const byte * pdata);
+  void stagePage(byte page, const byte * pdata);
+  void commitStage();
+  bool isStageExpired();
   void printCartridgeData();
   void saveCartridgeData();
-  bool isUpdated();
+  void requestSave();
+  void printLog();
+  bool loadCartridgeData();
+  void resetCartridgeData();
+  bool isIdle();
+  bool isReady();
+
+  static uint16_t commandCode(byte index);
+
+  static int onAntiCollision(Rfid & rfid, const byte * preq, int len, byte * prsp);
+  static int onReadData(Rfid & rfid, const byte * preq, int len, byte * prsp);
+  static int onWriteData(Rfid & rfid, const byte * preq, int len, byte * prsp);
 
   String name_;
+  byte port_;                   // index in the trace records
   Cartridge cartridge_;
   SerialState::Type state_;
   Payload payload_;
+  RfidStats stats_;
+  bool hunting_;                // dropping bytes until the next aa bb
   HardwareSerial * serial_;
+  FramePool * pPool_;
   unsigned long timeout_; 
-  bool updated_;
+  unsigned long firstResponse_; // msecs from start to the first reply, 0 until then
+  unsigned long commitMs_;      // msecs at the last complete tag write
+  byte          stage_[CARTRIDGE_DATA_LENGTH]; // tag image being written by the Zim
+  byte          stagedPages_;   // bit per page written since the last commit
+  unsigned long stageMs_;       // msecs at the first staged page
+  bool logPending_;
+  bool logCartridge_;
+  int  logRspLen_;
+  byte logStatus_;
+  unsigned int logsDropped_;
+  Cadence       cadence_;       // learns when the Zim polls and with what
+  bool          prestagePending_; // reply to the predicted request still to build
+  byte *        prestage_;      // pool buffer with the reply frame built ahead, or NULL
+  int           prestageLen_;
+  uint16_t      prestageFuncCode_;
+  int           prestageAddr_;
+  CartridgeData prestageData_;  // cartridge the frame was built from
+  unsigned long prestageUs_;    // time building it took
 };
 
 #endif
@@ -0,0 +1,217 @@
+// Zim Cartridge Emulator
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "Scheduler.h"
+
+Scheduler::Scheduler(bool (*pSlackAllowed)(), unsigned long (*pUsUntilRequest)()) :
+                                pSlackAllowed_(pSlackAllowed),
+                                pUsUntilRequest_(pUsUntilRequest),
+                                numTasks_(0)
+{
+}
+
+void
+Scheduler::init(Console * pConsole)
+{
+  pConsole->addCommand(ConsoleCommand::tasks, onConsole, this);
+}
+
+/// Add a task, earlier tasks win ties between equally urgent ones.
+/// A periodMs of 0 leaves readiness to the ready function alone.
+bool
+Scheduler::addTask(const char * name, TaskFunction run, TaskReady ready, void * pContext,
+                   TaskPriority::Type priority, Subsystem::Type subsystem,
+                   unsigned int periodMs, unsigned long deadlineUs)
+{
+  if(numTasks_ >= SCHEDULER_MAX_TASKS)
+  {
+    return false;
+  }
+  Task & task = tasks_[numTasks_++];
+  task.name_ = name;
+  task.run_ = run;
+  task.ready_ = ready;
+  task.pContext_ = pContext;
+  task.priority_ = priority;
+  task.subsystem_ = subsystem;
+  task.periodMs_ = periodMs;
+  task.deadlineUs_ = deadlineUs;
+  task.lastRunMs_ = millis();
+  task.readySinceUs_ = 0;
+  task.waiting_ = false;
+  task.runs_ = 0;
+  task.misses_ = 0;
+  task.maxLateUs_ = 0;
+  task.runUs_ = 0;
+  task.lastRunUs_ = 0;
+  task.deferrals_ = 0;
+  return true;
+}
+
+bool
+Scheduler::isReady(Task & task, unsigned long nowMs)
+{
+  if(task.periodMs_ != 0 && nowMs - task.lastRunMs_ >= task.periodMs_)
+  {
+    return true;
+  }
+  return task.ready_ != NULL && task.ready_(task.pContext_);
+}
+
+/// Run one slice of the most urgent ready task. Returns false if nothing
+/// was ready, the caller may then idle.
+bool
+Scheduler::runFsm()
+{
+  unsigned long nowMs = millis();
+  unsigned long nowUs = micros();
+  bool slackAllowed = pSlackAllowed_();
+  unsigned long untilRequestUs = pUsUntilRequest_();
+  Task * pNext = NULL;
+
+  for(int i=0; i<numTasks_; ++i)
+  {
+    Task & task = tasks_[i];
+    if((task.priority_ == TaskPriority::slack && !slackAllowed) ||
+       !isReady(task, nowMs))
+    {
+      task.waiting_ = false;
+      continue;
+    }
+
+    if(!task.waiting_)
+    {
+      task.waiting_ = true;
+      task.readySinceUs_ = nowUs;
+    }
+
+    if(task.priority_ != TaskPriority::realtime &&
+       sliceUs(task) > untilRequestUs &&
+       nowUs - task.readySinceUs_ < task.deadlineUs_)
+    {
+      if(task.deferrals_ < 0xFFFF)
+        ++task.deferrals_;
+      continue;
+    }
+
+    // most urgent first, then the one that has waited longest
+    if(pNext == NULL ||
+       task.priority_ < pNext->priority_ ||
+       (task.priority_ == pNext->priority_ &&
+        nowUs - task.readySinceUs_ > nowUs - pNext->readySinceUs_))
+    {
+      pNext = &task;
+    }
+  }
+
+  if(pNext == NULL)
+  {
+    return false;
+  }
+
+  unsigned long late = nowUs - pNext->readySinceUs_;
+  if(late > pNext->maxLateUs_)
+  {
+    pNext->maxLateUs_ = late;
+  }
+  if(late > pNext->deadlineUs_ && pNext->misses_ < 0xFFFF)
+  {
+    ++pNext->misses_;
+  }
+  pNext->waiting_ = false;
+  pNext->lastRunMs_ = nowMs;
+  ++pNext->runs_;
+
+  WatchdogEntry previous = watchdog.enter(pNext->subsystem_);
+  pNext->run_(pNext->pContext_);
+  watchdog.leave(previous);
+  pNext->lastRunUs_ = micros() - nowUs;
+  if(pNext->runs_ == 1)
+  {
+    pNext->runUs_ = pNext->lastRunUs_;
+  }
+  else
+  {
+    long error = (long)pNext->lastRunUs_ - (long)pNext->runUs_;
+    pNext->runUs_ += error / 4;
+  }
+  return true;
+}
+
+/// The slice a task is expected to take, the average lags a task whose
+/// slices just got longer so the last one counts if it is longer
+unsigned long
+Scheduler::sliceUs(Task & task)
+{
+  if(task.runs_ == 0)
+  {
+    return SCHEDULER_UNMEASURED_US;
+  }
+  return task.lastRunUs_ > task.runUs_ ? task.lastRunUs_ : task.runUs_;
+}
+
+/// Console command, the port byte selects the task:
+/// -> uint8 priority, uint32 runs, uint16 deadline misses, uint32 max late us,
+/// uint32 deadline us, uint16 mean run us, uint16 deferrals, name. Reports
+/// badPort past the last task.
+ConsoleStatus::Type
+Scheduler::onConsole(void * pContext, byte port, byte * preq, int len,
+                     byte * prsp, int rspMax, int & rspLen)
+{
+  Scheduler * pScheduler = (Scheduler *)pContext;
+  if(port >= pScheduler->numTasks_)
+  {
+    rspLen = 0;
+    return ConsoleStatus::badPort;
+  }
+
+  if(rspMax < 19)
+  {
+    rspLen = 0;
+    return ConsoleStatus::overflow;
+  }
+  Task & task = pScheduler->tasks_[port];
+  rspLen = 0;
+  prsp[rspLen++] = task.priority_;
+  for(int b=0; b<4; ++b)
+  {
+    prsp[rspLen++] = (task.runs_ >> (8*b)) & 0xFF;
+  }
+  prsp[rspLen++] = task.misses_ & 0xFF;
+  prsp[rspLen++] = task.misses_ >> 8;
+  for(int b=0; b<4; ++b)
+  {
+    prsp[rspLen++] = (task.maxLateUs_ >> (8*b)) & 0xFF;
+  }
+  for(int b=0; b<4; ++b)
+  {
+    prsp[rspLen++] = (task.deadlineUs_ >> (8*b)) & 0xFF;
+  }
+  unsigned int runUs = task.runUs_ > 0xFFFF ? 0xFFFF : task.runUs_;
+  prsp[rspLen++] = runUs & 0xFF;
+  prsp[rspLen++] = runUs >> 8;
+  prsp[rspLen++] = task.deferrals_ & 0xFF;
+  prsp[rspLen++] = task.deferrals_ >> 8;
+  for(int i=0; task.name_[i] != '\0' && rspLen < rspMax; ++i)
+  {
+    prsp[rspLen++] = task.name_[i];
+  }
+
+  if(len > 0 && preq[0] != 0)
+  {
+    task.runs_ = 0;
+    task.misses_ = 0;
+    task.maxLateUs_ = 0;
+    task.runUs_ = 0;
+    task.lastRunUs_ = 0;
+    task.deferrals_ = 0;
+  }
+  return ConsoleStatus::ok;
+}
@@ -0,0 +1,88 @@
+// Zim Cartridge Emulator 
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+#ifndef Scheduler_h
+#define Scheduler_h
+
+#include <Arduino.h>
+#include "Console.h"
+#include "Watchdog.h"
+
+#define SCHEDULER_MAX_TASKS     8
+#define SCHEDULER_UNMEASURED_US 0xFFFFFFFEUL // slice of a task that hasn't run, held back for any expected request
+
+namespace TaskPriority
+{
+  enum Type
+  {
+    realtime,   // Zim frame handling
+    normal,     // menu, lcd and console
+    slack       // persistence and logging, only while no frame is in progress
+  };
+}
+
+typedef void (*TaskFunction)(void * pContext);
+typedef bool (*TaskReady)(void * pContext);
+
+/// Cooperative scheduler. Each call to runFsm() runs one slice of the most
+/// urgent ready task, so a realtime task that becomes ready waits at most
+/// for the slice that is already running. Tasks are ready when their
+/// period has elapsed or their ready function says so. The time from a
+/// task first being seen ready to it running is checked against its
+/// deadline, misses are counted per task. Tasks that aren't realtime are
+/// held back while a slice of their usual length, the average or the last
+/// one if that was longer, would run into the next request the Zim is
+/// expected to send, until holding them any longer would miss their
+/// deadline.
+class Scheduler
+{
+public:
+  Scheduler(bool (*pSlackAllowed)(), unsigned long (*pUsUntilRequest)());
+  void init(Console * pConsole);
+  bool addTask(const char * name, TaskFunction run, TaskReady ready, void * pContext,
+               TaskPriority::Type priority, Subsystem::Type subsystem,
+               unsigned int periodMs, unsigned long deadlineUs);
+  bool runFsm();
+
+  static ConsoleStatus::Type onConsole(void * pContext, byte port,
+                                       byte * preq, int len,
+                                       byte * prsp, int rspMax, int & rspLen);
+
+private:
+  struct Task
+  {
+    const char *        name_;
+    TaskFunction        run_;
+    TaskReady           ready_;
+    void *              pContext_;
+    TaskPriority::Type  priority_;
+    Subsystem::Type     subsystem_;
+    unsigned int        periodMs_;
+    unsigned long       deadlineUs_;
+    unsigned long       lastRunMs_;
+    unsigned long       readySinceUs_;
+    bool                waiting_;       // seen ready but not run yet
+    unsigned long       runs_;
+    unsigned int        misses_;
+    unsigned long       maxLateUs_;
+    unsigned long       runUs_;         // moving average of the slices, seeded by the first
+    unsigned long       lastRunUs_;
+    unsigned int        deferrals_;     // slices held back for an expected request
+  };
+
+  bool isReady(Task & task, unsigned long nowMs);
+  unsigned long sliceUs(Task & task);
+
+  bool                (*pSlackAllowed_)();
+  unsigned long       (*pUsUntilRequest_)();
+  Task                tasks_[SCHEDULER_MAX_TASKS];
+  byte                numTasks_;
+};
+
+#endif
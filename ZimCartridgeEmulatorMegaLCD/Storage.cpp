@@ -0,0 +1,69 @@
+// Zim Cartridge Emulator
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <EEPROM.h>
+#include "Storage.h"
+
+byte
+EepromStorage::read(int loc)
+{
+  return EEPROM.read(loc);
+}
+
+/// Erase and program only if the byte differs, 3.4 ms each
+void
+EepromStorage::write(int loc, byte value)
+{
+  EEPROM.update(loc, value);
+}
+
+int
+EepromStorage::length()
+{
+  return EEPROM.length();
+}
+
+/// The memory starts erased like an EEPROM
+RamStorage::RamStorage(byte * pmem, int size) :
+                                pmem_(pmem),
+                                size_(size),
+                                writes_(0),
+                                commits_(0)
+{
+  memset(pmem_, 0xFF, size_);
+}
+
+byte
+RamStorage::read(int loc)
+{
+  return loc < size_ ? pmem_[loc] : 0xFF;
+}
+
+void
+RamStorage::write(int loc, byte value)
+{
+  if(loc < size_ && pmem_[loc] != value)
+  {
+    pmem_[loc] = value;
+    ++writes_;
+  }
+}
+
+int
+RamStorage::length()
+{
+  return size_;
+}
+
+void
+RamStorage::commit()
+{
+  ++commits_;
+}
@@ -0,0 +1,74 @@
+// Zim Cartridge Emulator
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+#ifndef Storage_h
+#define Storage_h
+
+#include <Arduino.h>
+
+/// Byte addressed non-volatile store. Cartridge and Telemetry keep their
+/// records at fixed locations in it, the sketch picks the backend. write()
+/// only programs bytes that change, commit() ends a record, backends that
+/// buffer make everything written before it durable.
+class Storage
+{
+public:
+  virtual byte read(int loc) = 0;
+  virtual void write(int loc, byte value) = 0;
+  virtual int  length() = 0;
+  virtual void commit() {}
+
+  template<typename T> T & get(int loc, T & t)
+  {
+    byte * p = (byte *)&t;
+    for(unsigned int i=0; i<sizeof(T); ++i)
+    {
+      p[i] = read(loc + i);
+    }
+    return t;
+  }
+
+  template<typename T> const T & put(int loc, const T & t)
+  {
+    const byte * p = (const byte *)&t;
+    for(unsigned int i=0; i<sizeof(T); ++i)
+    {
+      write(loc + i, p[i]);
+    }
+    return t;
+  }
+};
+
+/// The AVR's EEPROM, a write is durable when it returns
+class EepromStorage : public Storage
+{
+public:
+  byte read(int loc);
+  void write(int loc, byte value);
+  int  length();
+};
+
+/// Caller's RAM, nothing survives a reset. For the host tools and tests,
+/// it counts the bytes a real backend would have programmed.
+class RamStorage : public Storage
+{
+public:
+  RamStorage(byte * pmem, int size);
+  byte read(int loc);
+  void write(int loc, byte value);
+  int  length();
+  void commit();
+
+  byte *          pmem_;
+  int             size_;
+  unsigned long   writes_;    // bytes changed
+  unsigned long   commits_;
+};
+
+#endif
@@ -0,0 +1,278 @@
+// Zim Cartridge Emulator
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+#ifndef TagCodec_h
+#define TagCodec_h
+
+#include <Arduino.h>
+#include "Cartridge.h"
+
+#define TAG_PAGE_BYTES        4     // bytes per tag page, page 0 of the image is STAGE_FIRST_PAGE
+#define TAG_INLINE            inline __attribute__((always_inline)) // -Os would call the unrolled steps
+
+namespace TagField
+{
+  enum Type
+  {
+    magicNum,
+    type,
+    material,
+    red,
+    green,
+    blue,
+    initLen,
+    usedLen,
+    tempPrint,
+    tempFirst,
+    date,
+    checksum,     // XOR of the bytes before it, computed by encode()
+    count
+  };
+}
+
+/// Where a field sits in the tag image: the byte it starts in, the bit in
+/// that byte counting from the msb, and its width. Fields are big endian
+/// and may straddle bytes and pages.
+struct TagFieldDesc
+{
+  byte      field_;
+  byte      offset_;
+  byte      bit_;
+  byte      width_;
+};
+
+// The tag image, in TagField order
+constexpr TagFieldDesc TagLayout[TagField::count] =
+{
+  // field                  offset  bit   width
+  { TagField::magicNum,     0,      0,    16 },
+  { TagField::type,         2,      0,    4  },
+  { TagField::material,     2,      4,    4  },
+  { TagField::red,          3,      0,    8  },
+  { TagField::green,        4,      0,    8  },
+  { TagField::blue,         5,      0,    8  },
+  { TagField::initLen,      6,      0,    20 },
+  { TagField::usedLen,      8,      4,    20 },
+  { TagField::tempPrint,    11,     0,    8  },
+  { TagField::tempFirst,    12,     0,    8  },
+  { TagField::date,         13,     0,    16 },
+  { TagField::checksum,     15,     0,    8  }
+};
+
+// Bit positions in the image, msb of byte 0 first
+constexpr unsigned int tagFirst(byte field)
+{
+  return TagLayout[field].offset_ * 8 + TagLayout[field].bit_;
+}
+
+constexpr unsigned int tagLast(byte field)
+{
+  return tagFirst(field) + TagLayout[field].width_ - 1;
+}
+
+constexpr uint32_t tagValueMask(byte field)
+{
+  return TagLayout[field].width_ >= 32 ? 0xFFFFFFFFUL : (1UL << TagLayout[field].width_) - 1;
+}
+
+// Bits of image byte index the field covers
+constexpr byte tagByteMask(byte field, byte index)
+{
+  return (0xFF >> ((tagFirst(field) > index * 8u ? tagFirst(field) : index * 8u) - index * 8u)) &
+         (0xFF << (index * 8u + 7 - (tagLast(field) < index * 8u + 7 ? tagLast(field) : index * 8u + 7))) &
+         0xFF;
+}
+
+// Left shift from the field's value to image byte index, negative for a
+// right shift
+constexpr int tagShift(byte field, byte index)
+{
+  return (int)(index * 8 + 7) - (int)tagLast(field);
+}
+
+// Image byte index's bits of a field value
+constexpr byte tagPutByte(byte field, byte index, uint32_t value)
+{
+  return (byte)((tagShift(field, index) >= 0 ?
+                  (value & tagValueMask(field)) << tagShift(field, index) :
+                  (value & tagValueMask(field)) >> -tagShift(field, index)) &
+                 tagByteMask(field, index));
+}
+
+// A field value's bits from image byte index
+constexpr uint32_t tagGetByte(byte field, byte index, byte data)
+{
+  return tagShift(field, index) >= 0 ?
+         (uint32_t)(data & tagByteMask(field, index)) >> tagShift(field, index) :
+         (uint32_t)(data & tagByteMask(field, index)) << -tagShift(field, index);
+}
+
+// Bit per image page the field has bytes on
+constexpr byte tagPageMask(byte field)
+{
+  return ((1 << (tagLast(field) / (8 * TAG_PAGE_BYTES) + 1)) - 1) &
+         ~((1 << (tagFirst(field) / (8 * TAG_PAGE_BYTES))) - 1);
+}
+
+// The fields are in order and cover every bit of the image exactly once
+constexpr bool tagLayoutTiles(byte field)
+{
+  return field == TagField::count ?
+           tagLast(TagField::count - 1) == CARTRIDGE_DATA_LENGTH * 8 - 1 :
+           TagLayout[field].field_ == field &&
+           TagLayout[field].width_ > 0 && TagLayout[field].width_ <= 32 &&
+           tagFirst(field) == (field == 0 ? 0 : tagLast(field - 1) + 1) &&
+           tagLayoutTiles(field + 1);
+}
+
+static_assert(tagLayoutTiles(0), "TagLayout must tile the tag image in TagField order");
+
+// The bytes the hand written packing produced for the lengths straddling
+// bytes 6 to 10, initLen 0x12345 and usedLen 0xABCDE
+static_assert(tagPutByte(TagField::initLen, 6, 0x12345) == 0x12 &&
+              tagPutByte(TagField::initLen, 7, 0x12345) == 0x34 &&
+              (tagPutByte(TagField::initLen, 8, 0x12345) | tagPutByte(TagField::usedLen, 8, 0xABCDE)) == 0x5A &&
+              tagPutByte(TagField::usedLen, 9, 0xABCDE) == 0xBC &&
+              tagPutByte(TagField::usedLen, 10, 0xABCDE) == 0xDE,
+              "lengths must pack as the Zim expects");
+static_assert((tagGetByte(TagField::usedLen, 8, 0x5A) | tagGetByte(TagField::usedLen, 9, 0xBC) |
+               tagGetByte(TagField::usedLen, 10, 0xDE)) == 0xABCDE &&
+              (tagGetByte(TagField::initLen, 6, 0x12) | tagGetByte(TagField::initLen, 7, 0x34) |
+               tagGetByte(TagField::initLen, 8, 0x5A)) == 0x12345,
+              "lengths must unpack as the Zim wrote them");
+static_assert(tagPageMask(TagField::initLen) == 0x06 && tagPageMask(TagField::usedLen) == 0x04 &&
+              tagPageMask(TagField::checksum) == 0x08,
+              "page masks must follow the layout");
+
+/// Packs and unpacks one field, a statement per byte it spans with the
+/// masks and shifts as constants
+template<byte Field, byte Index = tagFirst(Field) / 8, bool Done = (Index > tagLast(Field) / 8)>
+struct TagBytes
+{
+  static constexpr uint32_t valueMask = tagValueMask(Field);
+  static constexpr byte     byteMask  = tagByteMask(Field, Index);
+  static constexpr byte     left      = tagShift(Field, Index) > 0 ? tagShift(Field, Index) : 0;
+  static constexpr byte     right     = tagShift(Field, Index) < 0 ? -tagShift(Field, Index) : 0;
+
+  static TAG_INLINE void put(byte * pdata, uint32_t value)
+  {
+    pdata[Index] = (pdata[Index] & (byte)~byteMask) | ((((value & valueMask) << left) >> right) & byteMask);
+    TagBytes<Field, Index + 1>::put(pdata, value);
+  }
+
+  static TAG_INLINE uint32_t get(const byte * pdata)
+  {
+    return (((uint32_t)(pdata[Index] & byteMask) >> left) << right) | TagBytes<Field, Index + 1>::get(pdata);
+  }
+};
+
+template<byte Field, byte Index>
+struct TagBytes<Field, Index, true>
+{
+  static TAG_INLINE void put(byte * pdata, uint32_t value)  {}
+  static TAG_INLINE uint32_t get(const byte * pdata)        { return 0; }
+};
+
+// A cartridge's value for a field, the switch folds away for a constant one
+TAG_INLINE uint32_t tagGetField(const CartridgeData & data, byte field)
+{
+  switch(field)
+  {
+    case TagField::magicNum:  return data.magicNum_;
+    case TagField::type:      return data.type_;
+    case TagField::material:  return data.material_;
+    case TagField::red:       return data.red_;
+    case TagField::green:     return data.green_;
+    case TagField::blue:      return data.blue_;
+    case TagField::initLen:   return data.initLen_;
+    case TagField::usedLen:   return data.usedLen_;
+    case TagField::tempPrint: return data.tempPrint_;
+    case TagField::tempFirst: return data.tempFirst_;
+    case TagField::date:      return data.date_;
+    default:                  return data.xor_;
+  }
+}
+
+TAG_INLINE void tagSetField(CartridgeData & data, byte field, uint32_t value)
+{
+  switch(field)
+  {
+    case TagField::magicNum:  data.magicNum_  = value; break;
+    case TagField::type:      data.type_      = CartridgeType::Type(value); break;
+    case TagField::material:  data.material_  = Material::Type(value); break;
+    case TagField::red:       data.red_       = value; break;
+    case TagField::green:     data.green_     = value; break;
+    case TagField::blue:      data.blue_      = value; break;
+    case TagField::initLen:   data.initLen_   = value; break;
+    case TagField::usedLen:   data.usedLen_   = value; break;
+    case TagField::tempPrint: data.tempPrint_ = value; break;
+    case TagField::tempFirst: data.tempFirst_ = value; break;
+    case TagField::date:      data.date_      = value; break;
+    default:                  data.xor_       = value; break;
+  }
+}
+
+/// Every field from Field on, unrolled at compile time
+template<byte Field = 0>
+struct TagImage
+{
+  static TAG_INLINE void encode(const CartridgeData & data, byte * pdata)
+  {
+    if(Field != TagField::checksum)
+    {
+      TagBytes<Field>::put(pdata, tagGetField(data, Field));
+    }
+    TagImage<Field + 1>::encode(data, pdata);
+  }
+
+  static TAG_INLINE void decode(const byte * pdata, byte pages, CartridgeData & data)
+  {
+    if(pages & tagPageMask(Field))
+    {
+      tagSetField(data, Field, TagBytes<Field>::get(pdata));
+    }
+    TagImage<Field + 1>::decode(pdata, pages, data);
+  }
+};
+
+template<>
+struct TagImage<TagField::count>
+{
+  static TAG_INLINE void encode(const CartridgeData & data, byte * pdata)               {}
+  static TAG_INLINE void decode(const byte * pdata, byte pages, CartridgeData & data)   {}
+};
+
+/// Tag image of a cartridge, generated from TagLayout. Values wider than
+/// their field are cut to it rather than spilling into the next one.
+namespace TagCodec
+{
+  static const byte allPages = (1 << (CARTRIDGE_DATA_LENGTH / TAG_PAGE_BYTES)) - 1;
+
+  /// The image with its XOR, returns its length
+  inline int encode(const CartridgeData & data, byte * pdata)
+  {
+    TagImage<>::encode(data, pdata);
+    byte xorVal = 0;
+    for(int i=0; i<CARTRIDGE_DATA_LENGTH - 1; ++i)
+    {
+      xorVal ^= pdata[i];
+    }
+    pdata[CARTRIDGE_DATA_LENGTH - 1] = xorVal;
+    return CARTRIDGE_DATA_LENGTH;
+  }
+
+  /// Sets the fields with bytes on the pages given, a bit per image page,
+  /// and leaves the others
+  inline void decode(const byte * pdata, CartridgeData & data, byte pages = allPages)
+  {
+    TagImage<>::decode(pdata, pages, data);
+  }
+}
+
+#endif
@@ -0,0 +1,335 @@
+// Zim Cartridge Emulator
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "Telemetry.h"
+
+Telemetry::Telemetry(Rfid ** pPorts, byte numPorts, Storage * pStorage) :
+                                pPorts_(pPorts),
+                                numPorts_(numPorts),
+                                pStorage_(pStorage),
+                                head_(0),
+                                count_(0),
+                                seq_(0),
+                                events_(EVENT_NO_CONSUMER)
+{
+  if(numPorts_ > TELEMETRY_MAX_PORTS)
+  {
+    numPorts_ = TELEMETRY_MAX_PORTS;
+  }
+  memset(jobs_, 0, sizeof(jobs_));
+  memset(history_, 0, sizeof(history_));
+}
+
+/// Call after the cartridges are loaded, their usedLen_ is the baseline of
+/// the first job
+void
+Telemetry::init(Console * pConsole)
+{
+  for(byte port=0; port<numPorts_; ++port)
+  {
+    jobs_[port].lastUsed_ = pPorts_[port]->cartridge_.data_.usedLen_;
+  }
+  events_ = events.subscribe();
+  load();
+  pConsole->addCommand(ConsoleCommand::telemetry, onTelemetry, this);
+  pConsole->addCommand(ConsoleCommand::history, onHistory, this);
+}
+
+/// True if a port committed a tag write or a job has run out of time
+bool
+Telemetry::isReady()
+{
+  if(events.isPending(events_))
+  {
+    return true;
+  }
+  unsigned long now = millis();
+  for(byte port=0; port<numPorts_; ++port)
+  {
+    if(jobs_[port].active_ && now - jobs_[port].lastMs_ > TELEMETRY_JOB_GAP)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+void
+Telemetry::runFsm()
+{
+  // one event per slice, the usedLen_ read is the latest, which is what a
+  // later commit would have reported anyway
+  Event event;
+  if(events.poll(events_, event))
+  {
+    if(event.type_ == EventType::committed && event.port_ < numPorts_)
+    {
+      onCommit(event.port_, pPorts_[event.port_]->cartridge_.data_.usedLen_, event.ms_);
+    }
+    else if(event.type_ == EventType::overflow)
+    {
+      for(byte port=0; port<numPorts_; ++port)
+      {
+        onCommit(port, pPorts_[port]->cartridge_.data_.usedLen_, pPorts_[port]->commitMs_);
+      }
+    }
+    return;
+  }
+
+  unsigned long now = millis();
+  for(byte port=0; port<numPorts_; ++port)
+  {
+    Job & job = jobs_[port];
+    if(job.active_ && now - job.lastMs_ > TELEMETRY_JOB_GAP)
+    {
+      closeJob(port);
+      return;
+    }
+  }
+}
+
+void
+Telemetry::onCommit(byte port, unsigned long used, unsigned long ms)
+{
+  Job & job = jobs_[port];
+  if(used == job.lastUsed_)
+  {
+    return;
+  }
+
+  if(used < job.lastUsed_)
+  {
+    // new spool or the length was reset, the next write starts a job
+    if(job.active_)
+    {
+      closeJob(port);
+    }
+    job.lastUsed_ = used;
+    return;
+  }
+
+  unsigned long delta = used - job.lastUsed_;
+  job.totalMm_ += delta;
+  if(!job.active_)
+  {
+    job.active_ = true;
+    job.startMs_ = ms;
+    job.baseUsed_ = job.lastUsed_;
+    job.firstUsed_ = used;
+    job.rateQ8_ = 0;
+    job.peakQ8_ = 0;
+  }
+  else
+  {
+    // first order low pass: rate += (sample - rate) / 2^shift
+    unsigned long sampleQ8 = (unsigned long)ratePerMin(delta, ms - job.lastMs_) << 8;
+    if(job.rateQ8_ == 0)
+      job.rateQ8_ = sampleQ8;
+    else if(sampleQ8 > job.rateQ8_)
+      job.rateQ8_ += (sampleQ8 - job.rateQ8_) >> TELEMETRY_RATE_SHIFT;
+    else
+      job.rateQ8_ -= (job.rateQ8_ - sampleQ8) >> TELEMETRY_RATE_SHIFT;
+    if(job.rateQ8_ > job.peakQ8_)
+      job.peakQ8_ = job.rateQ8_;
+  }
+  job.lastUsed_ = used;
+  job.lastMs_ = ms;
+}
+
+/// Moves the active job of a port to the history
+void
+Telemetry::closeJob(byte port)
+{
+  Job & job = jobs_[port];
+  JobRecord & record = history_[head_];
+
+  record.seq_ = seq_;
+  record.port_ = port;
+  record.usedMm_ = job.lastUsed_ - job.baseUsed_;
+  record.durationS_ = (job.lastMs_ - job.startMs_) / 1000;
+  record.avgRate_ = ratePerMin(job.lastUsed_ - job.firstUsed_, job.lastMs_ - job.startMs_);
+  record.peakRate_ = job.peakQ8_ >> 8;
+  record.check_ = check(record);
+
+  job.active_ = false;
+  ++job.jobs_;
+  if(++seq_ == 0xFFFF)
+  {
+    seq_ = 0;
+  }
+
+  Serial.print(pPorts_[port]->name_);
+  Serial.print(" job: ");
+  Serial.print(record.usedMm_);
+  Serial.print(" mm in ");
+  Serial.print(record.durationS_);
+  Serial.print(" s, ");
+  Serial.print(record.avgRate_);
+  Serial.println(" mm/min");
+
+  store(head_);
+  head_ = (head_ + 1) % TELEMETRY_HISTORY;
+  if(count_ < TELEMETRY_HISTORY)
+  {
+    ++count_;
+  }
+}
+
+/// Restores the history ring, the newest valid slot gives the write position
+void
+Telemetry::load()
+{
+#if TELEMETRY_EEPROM == 1
+  int newest = -1;
+  for(byte slot=0; slot<TELEMETRY_HISTORY; ++slot)
+  {
+    JobRecord & record = history_[slot];
+    pStorage_->get(TELEMETRY_EEPROM_LOC + slot * sizeof(JobRecord), record);
+    if(record.seq_ == 0xFFFF || record.check_ != check(record))
+    {
+      record.seq_ = 0xFFFF;
+      continue;
+    }
+    ++count_;
+    if(newest < 0 || (int16_t)(record.seq_ - history_[newest].seq_) > 0)
+    {
+      newest = slot;
+    }
+  }
+  if(newest >= 0)
+  {
+    head_ = (newest + 1) % TELEMETRY_HISTORY;
+    seq_ = history_[newest].seq_ + 1;
+    if(seq_ == 0xFFFF)
+    {
+      seq_ = 0;
+    }
+  }
+#endif
+}
+
+void
+Telemetry::store(byte slot)
+{
+#if TELEMETRY_EEPROM == 1
+  pStorage_->put(TELEMETRY_EEPROM_LOC + slot * sizeof(JobRecord), history_[slot]);
+  pStorage_->commit();
+#endif
+}
+
+byte
+Telemetry::check(const JobRecord & record)
+{
+  const byte * p = (const byte *)&record;
+  byte xorVal = 0x5A; // an all zero slot is not valid
+  for(unsigned int i=0; i<sizeof(JobRecord); ++i)
+  {
+    if(p + i != &record.check_)
+    {
+      xorVal ^= p[i];
+    }
+  }
+  return xorVal;
+}
+
+/// mm over ms as mm/min, saturating. Scaled by 100 ms so the product fits
+/// 32 bits for any 20 bit length.
+unsigned int
+Telemetry::ratePerMin(unsigned long mm, unsigned long ms)
+{
+  if(ms < 100)
+  {
+    return mm ? 0xFFFF : 0;
+  }
+  unsigned long rate = mm * 600 / (ms / 100);
+  return rate > 0xFFFF ? 0xFFFF : rate;
+}
+
+/// Console command, port is the rfid port: -> uint8 active, uint32 job mm,
+/// uint32 job secs, uint16 rate mm/min, uint16 peak mm/min, uint32 total mm,
+/// uint16 jobs. A non zero first data byte resets the totals after reading.
+ConsoleStatus::Type
+Telemetry::onTelemetry(void * pContext, byte port, byte * preq, int len,
+                       byte * prsp, int rspMax, int & rspLen)
+{
+  Telemetry * pTelemetry = (Telemetry *)pContext;
+  if(port >= pTelemetry->numPorts_)
+  {
+    return ConsoleStatus::badPort;
+  }
+
+  if(rspMax < 21)
+  {
+    rspLen = 0;
+    return ConsoleStatus::overflow;
+  }
+  Job & job = pTelemetry->jobs_[port];
+  unsigned long used = job.active_ ? job.lastUsed_ - job.baseUsed_ : 0;
+  unsigned long secs = job.active_ ? (job.lastMs_ - job.startMs_) / 1000 : 0;
+  unsigned int rate = job.active_ ? job.rateQ8_ >> 8 : 0;
+  unsigned int peak = job.active_ ? job.peakQ8_ >> 8 : 0;
+
+  rspLen = 0;
+  prsp[rspLen++] = job.active_;
+  for(int b=0; b<4; ++b)
+    prsp[rspLen++] = (used >> (8*b)) & 0xFF;
+  for(int b=0; b<4; ++b)
+    prsp[rspLen++] = (secs >> (8*b)) & 0xFF;
+  prsp[rspLen++] = rate & 0xFF;
+  prsp[rspLen++] = rate >> 8;
+  prsp[rspLen++] = peak & 0xFF;
+  prsp[rspLen++] = peak >> 8;
+  for(int b=0; b<4; ++b)
+    prsp[rspLen++] = (job.totalMm_ >> (8*b)) & 0xFF;
+  prsp[rspLen++] = job.jobs_ & 0xFF;
+  prsp[rspLen++] = job.jobs_ >> 8;
+
+  if(len > 0 && preq[0] != 0)
+  {
+    job.totalMm_ = 0;
+    job.jobs_ = 0;
+  }
+  return ConsoleStatus::ok;
+}
+
+/// Console command, port is the history index, 0 is the newest job:
+/// -> uint16 seq, uint8 rfid port, uint32 mm, uint32 secs, uint16 avg mm/min,
+/// uint16 peak mm/min
+ConsoleStatus::Type
+Telemetry::onHistory(void * pContext, byte port, byte * preq, int len,
+                     byte * prsp, int rspMax, int & rspLen)
+{
+  Telemetry * pTelemetry = (Telemetry *)pContext;
+  if(port >= pTelemetry->count_)
+  {
+    return ConsoleStatus::badPort;
+  }
+
+  if(rspMax < 17)
+  {
+    rspLen = 0;
+    return ConsoleStatus::overflow;
+  }
+  byte slot = (pTelemetry->head_ + TELEMETRY_HISTORY - 1 - port) % TELEMETRY_HISTORY;
+  JobRecord & record = pTelemetry->history_[slot];
+  rspLen = 0;
+  prsp[rspLen++] = record.seq_ & 0xFF;
+  prsp[rspLen++] = record.seq_ >> 8;
+  prsp[rspLen++] = record.port_;
+  for(int b=0; b<4; ++b)
+    prsp[rspLen++] = (record.usedMm_ >> (8*b)) & 0xFF;
+  for(int b=0; b<4; ++b)
+    prsp[rspLen++] = (record.durationS_ >> (8*b)) & 0xFF;
+  prsp[rspLen++] = record.avgRate_ & 0xFF;
+  prsp[rspLen++] = record.avgRate_ >> 8;
+  prsp[rspLen++] = record.peakRate_ & 0xFF;
+  prsp[rspLen++] = record.peakRate_ >> 8;
+  return ConsoleStatus::ok;
+}
@@ -0,0 +1,96 @@
+// Zim Cartridge Emulator 
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+#ifndef Telemetry_h
+#define Telemetry_h
+
+#include <Arduino.h>
+#include "Console.h"
+#include "Rfid.h"
+#include "Storage.h"
+#include "EventQueue.h"
+#include "Link.h"
+
+#if LINK_ROLE == LINK_MASTER
+#define TELEMETRY_MAX_PORTS     (LINK_SLAVES * LINK_PORTS) // a job per slave port
+#else
+#define TELEMETRY_MAX_PORTS     2
+#endif
+#define TELEMETRY_HISTORY       8         // finished jobs kept, newest overwrites oldest
+#define TELEMETRY_EEPROM        1         // If set, the history is kept in eeprom across resets
+#define TELEMETRY_EEPROM_LOC    (CARTRIDGE_RIGHT_EEPROM_LOC + CARTRIDGE_EEPROM_SIZE)
+#define TELEMETRY_JOB_GAP       600000UL  // msecs without filament use that end a job
+#define TELEMETRY_RATE_SHIFT    2         // rate filter weight, 1/4 per write
+
+/// One finished print job, also the eeprom slot layout
+struct JobRecord
+{
+  unsigned int    seq_;       // 0xFFFF marks an erased slot
+  byte            port_;
+  byte            check_;     // xor of the other bytes
+  unsigned long   usedMm_;
+  unsigned long   durationS_;
+  unsigned int    avgRate_;   // mm/min
+  unsigned int    peakRate_;  // mm/min, filtered
+};
+
+/// Derives per job filament use and extrusion rate from the usedLen_ values
+/// the Zim writes. A job starts with the first write that changes usedLen_
+/// and ends after TELEMETRY_JOB_GAP without a change, or when usedLen_ goes
+/// down (new spool or reset). Rates are kept in mm/min with 8 fractional
+/// bits, no floating point is used.
+class Telemetry
+{
+public:
+  Telemetry(Rfid ** pPorts, byte numPorts, Storage * pStorage);
+  void init(Console * pConsole);
+  bool isReady();
+  void runFsm();
+
+  static ConsoleStatus::Type onTelemetry(void * pContext, byte port,
+                                         byte * preq, int len,
+                                         byte * prsp, int rspMax, int & rspLen);
+  static ConsoleStatus::Type onHistory(void * pContext, byte port,
+                                       byte * preq, int len,
+                                       byte * prsp, int rspMax, int & rspLen);
+
+private:
+  struct Job
+  {
+    bool            active_;
+    unsigned long   startMs_;   // first write of the job
+    unsigned long   lastMs_;    // last write that changed usedLen_
+    unsigned long   baseUsed_;  // usedLen_ before the job
+    unsigned long   firstUsed_; // usedLen_ at the first write
+    unsigned long   lastUsed_;
+    unsigned long   rateQ8_;    // mm/min << 8
+    unsigned long   peakQ8_;
+    unsigned long   totalMm_;   // since the stats were reset
+    unsigned int    jobs_;
+  };
+
+  void onCommit(byte port, unsigned long used, unsigned long ms);
+  void closeJob(byte port);
+  void load();
+  void store(byte slot);
+  static byte check(const JobRecord & record);
+  static unsigned int ratePerMin(unsigned long mm, unsigned long ms);
+
+  Rfid **         pPorts_;
+  byte            numPorts_;
+  Storage *       pStorage_;
+  Job             jobs_[TELEMETRY_MAX_PORTS];
+  JobRecord       history_[TELEMETRY_HISTORY];
+  byte            head_;      // next slot to write
+  byte            count_;
+  unsigned int    seq_;       // sequence number of the next record
+  byte            events_;    // EventQueue consumer id
+};
+
+#endif
@@ -0,0 +1,135 @@
+// Zim Cartridge Emulator
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "Trace.h"
+
+Trace trace(&Serial);
+
+Trace::Trace(Print * pOut) :
+                                pOut_(pOut),
+                                high_(0),
+                                timeSent_(false),
+                                xor_(0)
+{
+}
+
+/// Record without fields
+void
+Trace::event(TraceEvent::Type event, byte port)
+{
+  begin(event, port, 0);
+  end();
+}
+
+/// Record with one little endian field of size bytes
+void
+Trace::value(TraceEvent::Type event, byte port, unsigned long value, byte size)
+{
+  begin(event, port, size);
+  add(value, size);
+  end();
+}
+
+/// One Zim request, the payload bytes received and how it was answered
+void
+Trace::frame(byte port, unsigned int funcCode, byte len, byte status,
+             byte rspLen, byte flags, const byte * pdata, byte count)
+{
+  begin(TraceEvent::frame, port, 6 + count);
+  add(funcCode, 2);
+  add(len);
+  add(status);
+  add(rspLen);
+  add(flags);
+  for(byte i=0; i<count; ++i)
+  {
+    add(pdata[i]);
+  }
+  end();
+}
+
+/// The cartridge fields as stored, not the tag image, which drops bits:
+/// uint16 eeprom location, uint16 id, uint16 magic, uint8 type, uint8 material,
+/// uint8 red, green, blue, uint32 initLen, uint32 usedLen, uint8 tempPrint,
+/// uint8 tempFirst, uint16 date, uint8 xor
+void
+Trace::cartridge(byte port, int eepromLoc, const CartridgeData & data)
+{
+  begin(TraceEvent::cartridge, port, TRACE_CARTRIDGE_LENGTH);
+  add(eepromLoc, 2);
+  add(data.id_, 2);
+  add(data.magicNum_, 2);
+  add(data.type_);
+  add(data.material_);
+  add(data.red_);
+  add(data.green_);
+  add(data.blue_);
+  add(data.initLen_, 4);
+  add(data.usedLen_, 4);
+  add(data.tempPrint_);
+  add(data.tempFirst_);
+  add(data.date_, 2);
+  add(data.xor_);
+  end();
+}
+
+void
+Trace::begin(TraceEvent::Type event, byte port, byte len)
+{
+  unsigned long now = millis();
+  if(!timeSent_ || (now >> 16) != high_)
+  {
+    high_ = now >> 16;
+    timeSent_ = true;
+    begin(TraceEvent::time, 0, 4);
+    add(now, 4);
+    end();
+  }
+
+  pOut_->write(TRACE_SYNC);
+  xor_ = 0;
+  add(port << TRACE_PORT_SHIFT | event);
+  add(now, 2);
+  add(len);
+}
+
+void
+Trace::add(byte value)
+{
+  xor_ ^= value;
+  put(value);
+}
+
+void
+Trace::add(unsigned long value, byte size)
+{
+  for(byte i=0; i<size; ++i)
+  {
+    add((byte)(value >> (8*i)));
+  }
+}
+
+void
+Trace::end()
+{
+  put(xor_);
+}
+
+// Writes one byte, escaping the sync bytes
+void
+Trace::put(byte value)
+{
+  if(value == TRACE_SYNC || value == TRACE_ESCAPE || value == 0xAA)
+  {
+    pOut_->write(TRACE_ESCAPE);
+    value ^= TRACE_ESCAPE_XOR;
+  }
+  pOut_->write(value);
+}
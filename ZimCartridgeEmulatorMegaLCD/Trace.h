@@ -0,0 +1,78 @@
+// Zim Cartridge Emulator
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+#ifndef Trace_h
+#define Trace_h
+
+#include <Arduino.h>
+#include "Cartridge.h"
+
+#define TRACE_BINARY        1     // 0 prints the frame logs as text, zimtrace decodes the binary ones
+#define TRACE_SYNC          0xA5
+#define TRACE_ESCAPE        0xA6
+#define TRACE_ESCAPE_XOR    0x20
+#define TRACE_CARTRIDGE_LENGTH  24  // see Trace::cartridge()
+#define TRACE_PORT_SHIFT    6     // ports 0 to 3 share the event byte
+
+// Binary debug records on the USB serial port, interleaved with the text
+// output and the console frames:
+//   0xA5 - uint8 port<<6 | event - uint16 msecs - uint8 len - n fields - uint8 XOR
+// Multi-byte fields are little endian, the XOR covers the event onwards. After
+// the sync byte 0xA5, 0xA6 and 0xAA are sent as 0xA6 followed by the byte
+// XOR 0x20, so a record never holds a console frame or record start. The
+// msecs are the low 16 bits of millis(), a time record with all 32 bits
+// goes out first whenever the high half has changed.
+namespace TraceEvent
+{
+  enum Type
+  {
+    time          = 0x01, // uint32 msecs
+    rxTimeout     = 0x10, // -
+    stageDropped  = 0x11, // -
+    logsDropped   = 0x12, // uint16 frame logs lost
+    frame         = 0x13, // uint16 funcCode, uint8 payload length, uint8 status, uint8 rspLen, uint8 flags, n bytes received
+    cartridge     = 0x14, // see Trace::cartridge()
+    firstResponse = 0x15, // uint32 msecs
+    save          = 0x16, // uint16 eeprom location
+    overflow      = 0x17  // -, NEVER_ENDING_FILAMENT reset the used length
+  };
+}
+
+namespace TraceFlags
+{
+  static const byte cartridge = 0x01; // a cartridge record for the same port follows
+}
+
+/// Encoder for the binary debug records, see zimtrace in the host tools
+class Trace
+{
+public:
+  Trace(Print * pOut);
+  void event(TraceEvent::Type event, byte port);
+  void value(TraceEvent::Type event, byte port, unsigned long value, byte size);
+  void frame(byte port, unsigned int funcCode, byte len, byte status,
+             byte rspLen, byte flags, const byte * pdata, byte count);
+  void cartridge(byte port, int eepromLoc, const CartridgeData & data);
+
+private:
+  void begin(TraceEvent::Type event, byte port, byte len);
+  void add(byte value);
+  void add(unsigned long value, byte size);
+  void end();
+  void put(byte value);
+
+  Print *           pOut_;
+  unsigned int      high_;      // msecs >> 16 of the last time record
+  bool              timeSent_;
+  byte              xor_;
+};
+
+extern Trace trace;
+
+#endif
@@ -0,0 +1,214 @@
+// Zim Cartridge Emulator
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <avr/interrupt.h>
+#include "Watchdog.h"
+
+Watchdog watchdog;
+
+// Not cleared by the C runtime, so it survives a watchdog reset
+static StallRecord stallRecord __attribute__((section(".noinit")));
+
+#if defined(__AVR__)
+// After a watchdog reset the watchdog stays enabled at its shortest timeout,
+// turn it off before the C runtime and setup() get a chance to run.
+void clearResetFlags() __attribute__((naked, used, section(".init3")));
+void clearResetFlags()
+{
+  MCUSR = 0;
+  wdt_disable();
+}
+
+ISR(WDT_vect)
+{
+  watchdog.onTimeout();
+}
+#endif
+
+const char* Watchdog::Names[]=
+{
+  "none",
+  "rfidLeft",
+  "rfidRight",
+  "menu",
+  "console",
+  "persistence",
+  "logging",
+  "telemetry",
+  "link"
+};
+
+// Soft deadlines in msecs, a miss is counted but doesn't reset
+const unsigned int Watchdog::Deadlines[]=
+{
+  0,
+  10,   // rfidLeft
+  10,   // rfidRight
+  30,   // menu, an lcd clear plus two lines
+  10,   // console
+  200,  // persistence, eeprom writes take 3.3 ms a byte
+  50,   // logging
+  100,  // telemetry, one history slot written to eeprom
+  20    // link, a master's poll of one slave or a slave applying a write
+};
+static_assert(sizeof(Watchdog::Names)/sizeof(Watchdog::Names[0]) == Subsystem::count &&
+              sizeof(Watchdog::Deadlines)/sizeof(Watchdog::Deadlines[0]) == Subsystem::count,
+              "a name and a deadline for each subsystem");
+
+Watchdog::Watchdog() : 
+                    current_(Subsystem::none),
+                    enterMs_(0),
+                    stalled_(false)
+{
+  for(int i=0; i<Subsystem::count; ++i)
+  {
+    misses_[i] = 0;
+    worstMs_[i] = 0;
+  }
+}
+
+/// Report a stall from before the last reset and start the watchdog
+void
+Watchdog::init(Console * pConsole)
+{
+  pConsole->addCommand(ConsoleCommand::watchdog, onConsole, this);
+
+  stalled_ = (stallRecord.magic_ == WATCHDOG_MAGIC &&
+              stallRecord.subsystem_ < Subsystem::count);
+  if(stalled_)
+  {
+    Serial.print("Watchdog reset: ");
+    Serial.print(Names[stallRecord.subsystem_]);
+    Serial.print(" stalled for ");
+    Serial.print(stallRecord.elapsed_);
+    Serial.print(" ms at ");
+    Serial.print(stallRecord.uptime_);
+    Serial.print(" ms uptime, ");
+    Serial.print(stallRecord.resets_);
+    Serial.println(" watchdog resets since power up");
+  }
+  else
+  {
+    stallRecord.resets_ = 0;
+  }
+  // The record stays readable over the console, the magic is cleared so a
+  // later normal reset isn't mistaken for a stall
+  stallRecord.magic_ = 0;
+
+#if WATCHDOG_ENABLED == 1
+  wdt_enable(WATCHDOG_TIMEOUT);
+#if defined(__AVR__)
+  WDTCSR |= _BV(WDIE); // interrupt first, the reset follows
+#endif
+#endif
+}
+
+/// Called once per loop pass
+void
+Watchdog::kick()
+{
+#if WATCHDOG_ENABLED == 1
+  wdt_reset();
+#endif
+}
+
+/// Mark the start of a subsystem, returns the one to restore with leave()
+WatchdogEntry
+Watchdog::enter(Subsystem::Type subsystem)
+{
+  WatchdogEntry previous;
+  previous.subsystem_ = Subsystem::Type(current_);
+  previous.enterMs_ = enterMs_;
+  current_ = subsystem;
+  enterMs_ = millis();
+  return previous;
+}
+
+/// Check the soft deadline of the current subsystem and restore the previous
+/// one, still timed from its own enter() so a nested subsystem doesn't hide
+/// its stall
+void
+Watchdog::leave(const WatchdogEntry & previous)
+{
+  unsigned long elapsed = millis() - enterMs_;
+  byte subsystem = current_;
+  if(elapsed > Deadlines[subsystem])
+  {
+    if(misses_[subsystem] < 0xFFFF)
+      ++misses_[subsystem];
+    if(elapsed > worstMs_[subsystem])
+      worstMs_[subsystem] = elapsed > 0xFFFF ? 0xFFFF : elapsed;
+  }
+  current_ = previous.subsystem_;
+  enterMs_ = previous.enterMs_;
+}
+
+/// Runs from the watchdog interrupt, records the stall and resets
+void
+Watchdog::onTimeout()
+{
+  unsigned long elapsed = millis() - enterMs_;
+  stallRecord.uptime_ = millis();
+  stallRecord.elapsed_ = elapsed > 0xFFFF ? 0xFFFF : elapsed;
+  stallRecord.subsystem_ = current_;
+  ++stallRecord.resets_;
+  stallRecord.magic_ = WATCHDOG_MAGIC;
+
+  wdt_enable(WDTO_15MS);
+  for(;;)
+  {
+  }
+}
+
+#define WATCHDOG_REPLY_LENGTH (9 + 4 * (Subsystem::count - 1))
+static_assert(WATCHDOG_REPLY_LENGTH <= CONSOLE_MAX_DATA,
+              "the watchdog's console reply must fit CONSOLE_MAX_DATA");
+
+/// Console command: -> uint8 stalled, uint8 subsystem, uint32 uptime ms,
+/// uint16 elapsed ms, uint8 resets, then per subsystem uint16 misses and
+/// uint16 worst ms. A non zero first data byte clears the miss counters.
+ConsoleStatus::Type
+Watchdog::onConsole(void * pContext, byte port, byte * preq, int len,
+                    byte * prsp, int rspMax, int & rspLen)
+{
+  if(rspMax < WATCHDOG_REPLY_LENGTH)
+  {
+    rspLen = 0;
+    return ConsoleStatus::overflow;
+  }
+  Watchdog * pWatchdog = (Watchdog *)pContext;
+  rspLen = 0;
+  prsp[rspLen++] = pWatchdog->stalled_;
+  prsp[rspLen++] = stallRecord.subsystem_;
+  for(int b=0; b<4; ++b)
+  {
+    prsp[rspLen++] = (stallRecord.uptime_ >> (8*b)) & 0xFF;
+  }
+  prsp[rspLen++] = stallRecord.elapsed_ & 0xFF;
+  prsp[rspLen++] = stallRecord.elapsed_ >> 8;
+  prsp[rspLen++] = stallRecord.resets_;
+  for(int i=Subsystem::rfidLeft; i<Subsystem::count; ++i)
+  {
+    prsp[rspLen++] = pWatchdog->misses_[i] & 0xFF;
+    prsp[rspLen++] = pWatchdog->misses_[i] >> 8;
+    prsp[rspLen++] = pWatchdog->worstMs_[i] & 0xFF;
+    prsp[rspLen++] = pWatchdog->worstMs_[i] >> 8;
+  }
+
+  if(len > 0 && preq[0] != 0)
+  {
+    for(int i=0; i<Subsystem::count; ++i)
+    {
+      pWatchdog->misses_[i] = 0;
+      pWatchdog->worstMs_[i] = 0;
+    }
+  }
+  return ConsoleStatus::ok;
+}
@@ -0,0 +1,86 @@
+// Zim Cartridge Emulator 
+//  
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+#ifndef Watchdog_h
+#define Watchdog_h
+
+#include <Arduino.h>
+#include <avr/wdt.h>
+#include "Console.h"
+
+#define WATCHDOG_ENABLED    1       // Old Mega2560 bootloaders hang after a watchdog reset, set to 0 on those
+#define WATCHDOG_TIMEOUT    WDTO_1S
+#define WATCHDOG_MAGIC      0x5354414CUL
+
+namespace Subsystem
+{
+  enum Type
+  {
+    none,
+    rfidLeft,
+    rfidRight,
+    menu,
+    console,
+    persistence,
+    logging,
+    telemetry,
+    link,         // the I2C link between boards, see Link.h
+    count
+  };
+}
+
+/// Stall information that survives the watchdog reset
+struct StallRecord
+{
+  unsigned long     magic_;
+  unsigned long     uptime_;    // msecs at the stall
+  unsigned int      elapsed_;   // msecs spent in the subsystem
+  byte              subsystem_;
+  byte              resets_;    // watchdog resets since power up
+};
+
+/// What enter() interrupted, leave() restores it with its own start time
+struct WatchdogEntry
+{
+  Subsystem::Type   subsystem_;
+  unsigned long     enterMs_;
+};
+
+/// Hardware watchdog plus a software stall detector. Each subsystem is run
+/// between enter() and leave(), leave() counts soft deadline misses. If the
+/// loop stops kicking the watchdog, its interrupt stores the subsystem that
+/// was running in no-init RAM before the reset, init() reports it on the
+/// next boot.
+class Watchdog
+{
+public:
+  Watchdog();
+  void init(Console * pConsole);
+  void kick();
+  WatchdogEntry enter(Subsystem::Type subsystem);
+  void leave(const WatchdogEntry & previous);
+  void onTimeout();
+
+  static ConsoleStatus::Type onConsole(void * pContext, byte port,
+                                       byte * preq, int len,
+                                       byte * prsp, int rspMax, int & rspLen);
+  static const char *           Names[];
+  static const unsigned int     Deadlines[];
+
+private:
+  volatile byte             current_;
+  volatile unsigned long    enterMs_;
+  bool                      stalled_;     // last reset was a stall
+  unsigned int              misses_[Subsystem::count];
+  unsigned int              worstMs_[Subsystem::count];
+};
+
+extern Watchdog watchdog;
+
+#endif
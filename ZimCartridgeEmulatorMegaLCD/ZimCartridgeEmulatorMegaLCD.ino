@@ -8,68 +8,258 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 // THE SOFTWARE.
 
-#include <EEPROM.h>
-#include <LiquidCrystal.h>
 #include "Menu.h"
+#if ZIM_HEADLESS == 0
+#include <LiquidCrystal.h>
+#endif
 #include "Rfid.h"
 #include "Cartridge.h"
+#include "Console.h"
+#include "Power.h"
+#include "Watchdog.h"
+#include "Scheduler.h"
+#include "Telemetry.h"
+#include "Memory.h"
+#include "EventQueue.h"
+#include "Storage.h"
+#include "FramePool.h"
+#include "Link.h"
 
-Cartridge cartridgeLeft(CARTRIDGE_ID_LEFT, CARTRIDGE_LEFT_EEPROM_LOC);
-Cartridge cartridgeRight(CARTRIDGE_ID_RIGHT, CARTRIDGE_RIGHT_EEPROM_LOC);
-Rfid rfidLeft("Left Cartridge", &Serial1, cartridgeLeft);
-Rfid rfidRight("Right Cartridge", &Serial2, cartridgeRight);
-Menu menu(&rfidLeft, &rfidRight);
+EepromStorage storage;
+#if LINK_ROLE == LINK_MASTER
+// The ports are mirrors of the slaves' ports. The link keeps them current,
+// their cartridges are saved to and reloaded from the slaves' eeprom.
+WireBus linkBus(&Wire);
+LinkStorage linkStorage[LINK_SLAVES];
+Rfid mirrors[] =
+{
+  Rfid("Left Cartridge 1",  0, NULL, Cartridge(CARTRIDGE_ID_LEFT,  CARTRIDGE_LEFT_EEPROM_LOC,  &linkStorage[0]), NULL),
+  Rfid("Right Cartridge 1", 1, NULL, Cartridge(CARTRIDGE_ID_RIGHT, CARTRIDGE_RIGHT_EEPROM_LOC, &linkStorage[0]), NULL),
+  Rfid("Left Cartridge 2",  2, NULL, Cartridge(CARTRIDGE_ID_LEFT,  CARTRIDGE_LEFT_EEPROM_LOC,  &linkStorage[1]), NULL),
+  Rfid("Right Cartridge 2", 3, NULL, Cartridge(CARTRIDGE_ID_RIGHT, CARTRIDGE_RIGHT_EEPROM_LOC, &linkStorage[1]), NULL)
+};
+static_assert(sizeof(mirrors)/sizeof(mirrors[0]) == LINK_SLAVES * LINK_PORTS,
+              "a mirror for each slave port");
+Rfid * ports[] = {&mirrors[0], &mirrors[1], &mirrors[2], &mirrors[3]};
+LinkMaster linkMaster(&linkBus, ports, sizeof(ports)/sizeof(ports[0]));
+#else
+byte frameBuffers[FRAME_POOL_SIZE * FRAME_BUFFER_SIZE];
+FramePool framePool(frameBuffers, FRAME_POOL_SIZE, FRAME_POOL_RESERVE);
+Cartridge cartridgeLeft(CARTRIDGE_ID_LEFT, CARTRIDGE_LEFT_EEPROM_LOC, &storage);
+Cartridge cartridgeRight(CARTRIDGE_ID_RIGHT, CARTRIDGE_RIGHT_EEPROM_LOC, &storage);
+Rfid rfidLeft("Left Cartridge", 0, &Serial1, cartridgeLeft, &framePool);
+Rfid rfidRight("Right Cartridge", 1, &Serial2, cartridgeRight, &framePool);
+Rfid * ports[] = {&rfidLeft, &rfidRight};
+#if LINK_ROLE == LINK_SLAVE
+LinkSlave linkSlave(ports, sizeof(ports)/sizeof(ports[0]), &storage);
+#endif
+#endif
+#if ZIM_HEADLESS == 0
+Menu menu(ports, sizeof(ports)/sizeof(ports[0]));
+#endif
+Console console(ports, sizeof(ports)/sizeof(ports[0]), &Serial);
+Telemetry telemetry(ports, sizeof(ports)/sizeof(ports[0]), &storage);
+static_assert(sizeof(ports)/sizeof(ports[0]) <= TELEMETRY_MAX_PORTS,
+              "telemetry for each port");
 
-void setup()  
-{ 
-  Serial.begin(57600);
-  Serial.println("Zim Cartridge Emulator Mega v1.0\n");
+bool isIdle()
+{
+#if ZIM_HEADLESS == 0
+  if(!menu.isIdle())
+    return false;
+#endif
+#if LINK_ROLE == LINK_MASTER
+  return !linkMaster.isReady() && console.isIdle();
+#elif LINK_ROLE == LINK_SLAVE
+  return rfidLeft.isIdle() && rfidRight.isIdle() && console.isIdle() && !linkSlave.isReady();
+#else
+  return rfidLeft.isIdle() && rfidRight.isIdle() && console.isIdle();
+#endif
+}
+Power power(isIdle);
 
-  // Load cartridge data from eeprom or initialize if never set
-  Serial.println("Checking eeprom");
-  Cartridge temp(CARTRIDGE_ID_LEFT, CARTRIDGE_LEFT_EEPROM_LOC);
-  EEPROM.get(CARTRIDGE_LEFT_EEPROM_LOC, temp);
-  if(temp.data_.magicNum_ != CARTRIDGE_MAGIC_NUMBER)
+// Slack tasks only run between frames
+bool isSlackAllowed()
+{
+#if LINK_ROLE == LINK_MASTER
+  return true;
+#else
+  return rfidLeft.isIdle() && rfidRight.isIdle();
+#endif
+}
+// Time until either port expects a request, see Cadence
+unsigned long usUntilRequest()
+{
+  unsigned long us = CADENCE_NO_REQUEST;
+  for(byte port=0; port<sizeof(ports)/sizeof(ports[0]); ++port)
   {
-     Serial.println("Reinitializing eeprom");
-     EEPROM.put(CARTRIDGE_LEFT_EEPROM_LOC, rfidLeft.cartridge_.data_);
-     EEPROM.put(CARTRIDGE_RIGHT_EEPROM_LOC, rfidRight.cartridge_.data_);
+    unsigned long portUs = ports[port]->cadence_.usUntilRequest();
+    if(portUs < us)
+      us = portUs;
   }
-  else
+  return us;
+}
+Scheduler scheduler(isSlackAllowed, usUntilRequest);
+
+// Task adapters
+void runRfid(void * pContext)       { power.frameStarted(); ((Rfid *)pContext)->runFsm(); }
+bool isRfidReady(void * pContext)   { return ((Rfid *)pContext)->isReady(); }
+#if ZIM_HEADLESS == 0
+void runMenu(void * pContext)       { menu.runFsm(); }
+bool isMenuReady(void * pContext)   { return !menu.isIdle(); }
+#endif
+void runConsole(void * pContext)    { console.runFsm(); }
+bool isConsoleReady(void * pContext){ return !console.isIdle(); }
+#if LINK_ROLE == LINK_MASTER
+void runLink(void * pContext)       { linkMaster.runFsm(); }
+bool isLinkReady(void * pContext)   { return linkMaster.isReady(); }
+#elif LINK_ROLE == LINK_SLAVE
+void runLink(void * pContext)       { linkSlave.runFsm(); }
+bool isLinkReady(void * pContext)   { return linkSlave.isReady(); }
+#endif
+
+byte persistenceEvents = EVENT_NO_CONSUMER;
+byte savesPending = 0;  // bit per port
+
+void runPersistence(void * pContext)
+{
+  Event event;
+  while(events.poll(persistenceEvents, event))
   {
-    EEPROM.get(CARTRIDGE_LEFT_EEPROM_LOC, rfidLeft.cartridge_.data_);
-    EEPROM.get(CARTRIDGE_RIGHT_EEPROM_LOC, rfidRight.cartridge_.data_);
-    Serial.println("Cartridge data restored from eeprom");
-    rfidLeft.printCartridgeData();
-    rfidRight.printCartridgeData();
+    if(event.type_ == EventType::saveRequested)
+      savesPending |= 1 << event.port_;
+    else if(event.type_ == EventType::overflow)
+      savesPending = (1 << sizeof(ports)/sizeof(ports[0])) - 1;
   }
 
-  rfidLeft.serial_->begin(RFID_BAUD_RATE);
-  rfidRight.serial_->begin(RFID_BAUD_RATE); 
-  menu.init();
+  // one eeprom write per slice
+  for(byte port=0; port<sizeof(ports)/sizeof(ports[0]); ++port)
+  {
+    if(savesPending & (1 << port))
+    {
+      savesPending &= ~(1 << port);
+      ports[port]->saveCartridgeData();
+      return;
+    }
+  }
 }
 
-
-// This is called repeatedly
-void loop()
+bool isPersistenceReady(void * pContext)
 {
-  rfidLeft.runFsm();
-  rfidRight.runFsm();
-  menu.runFsm();  
+  return savesPending != 0 || events.isPending(persistenceEvents);
 }
 
+void runLogging(void * pContext)
+{
+  for(byte port=0; port<sizeof(ports)/sizeof(ports[0]); ++port)
+  {
+    if(ports[port]->logPending_)
+    {
+      ports[port]->printLog();
+      return;
+    }
+  }
+}
 
+bool isLoggingReady(void * pContext)
+{
+  for(byte port=0; port<sizeof(ports)/sizeof(ports[0]); ++port)
+  {
+    if(ports[port]->logPending_)
+      return true;
+  }
+  return false;
+}
 
+void runTelemetry(void * pContext)    { telemetry.runFsm(); }
+bool isTelemetryReady(void * pContext){ return telemetry.isReady(); }
 
+void setup()  
+{ 
+  Serial.begin(57600);
 
+#if LINK_ROLE == LINK_MASTER
+  // The mirrors fill from the first poll of each slave
+  linkBus.begin();
+  for(byte slave=0; slave<LINK_SLAVES; ++slave)
+  {
+    linkStorage[slave].attach(&linkMaster, slave);
+  }
+#else
+  // Single read of each cartridge straight into the live data, the ports are
+  // opened right after so the Zim's first request is answered from loop()
+  bool leftRestored = rfidLeft.loadCartridgeData();
+  bool rightRestored = rfidRight.loadCartridgeData();
+  rfidLeft.serial_->begin(RFID_BAUD_RATE);
+  rfidRight.serial_->begin(RFID_BAUD_RATE); 
+#if LINK_ROLE == LINK_SLAVE
+  linkSlave.begin(&Wire, LINK_ADDRESS);
+#endif
+#endif
+#if ZIM_HEADLESS == 0
+  menu.init();
+#endif
+  power.init(&console);
+  scheduler.init(&console);
+  telemetry.init(&console);
+  memory.init(&console);
+#if LINK_ROLE == LINK_MASTER
+  linkMaster.init(&console);
+#else
+  framePool.init(&console, sizeof(ports)/sizeof(ports[0]));
+#endif
+  persistenceEvents = events.subscribe();
 
+  // A task past SCHEDULER_MAX_TASKS would never run
+  bool tasksAdded = true;
+  //                              name           run             ready               context     priority                 subsystem               period  deadline us
+#if LINK_ROLE != LINK_MASTER
+  tasksAdded &= scheduler.addTask("rfidLeft",    runRfid,        isRfidReady,        &rfidLeft,  TaskPriority::realtime,  Subsystem::rfidLeft,    0,      1000);
+  tasksAdded &= scheduler.addTask("rfidRight",   runRfid,        isRfidReady,        &rfidRight, TaskPriority::realtime,  Subsystem::rfidRight,   0,      1000);
+#endif
+#if LINK_ROLE != LINK_NONE
+  tasksAdded &= scheduler.addTask("link",        runLink,        isLinkReady,        NULL,       TaskPriority::normal,    Subsystem::link,        10,     20000);
+#endif
+#if ZIM_HEADLESS == 0
+  tasksAdded &= scheduler.addTask("menu",        runMenu,        isMenuReady,        NULL,       TaskPriority::normal,    Subsystem::menu,        4,      20000);
+#endif
+  tasksAdded &= scheduler.addTask("console",     runConsole,     isConsoleReady,     NULL,       TaskPriority::normal,    Subsystem::console,     0,      20000);
+  tasksAdded &= scheduler.addTask("persistence", runPersistence, isPersistenceReady, NULL,       TaskPriority::slack,     Subsystem::persistence, 0,      1000000);
+  tasksAdded &= scheduler.addTask("logging",     runLogging,     isLoggingReady,     NULL,       TaskPriority::slack,     Subsystem::logging,     0,      1000000);
+  tasksAdded &= scheduler.addTask("telemetry",   runTelemetry,   isTelemetryReady,   NULL,       TaskPriority::slack,     Subsystem::telemetry,   0,      1000000);
 
+#if ZIM_HEADLESS == 0
+  Serial.println("Zim Cartridge Emulator Mega v1.0\n");
+#else
+  Serial.println("Zim Cartridge Emulator Mega v1.0 headless\n");
+#endif
+#if LINK_ROLE == LINK_MASTER
+  Serial.print("Link master of ");
+  Serial.print(LINK_SLAVES);
+  Serial.println(" slaves");
+#else
+  Serial.println(leftRestored ? "Left cartridge restored from eeprom" :
+                                "Left cartridge eeprom invalid, using defaults");
+  Serial.println(rightRestored ? "Right cartridge restored from eeprom" :
+                                 "Right cartridge eeprom invalid, using defaults");
+#endif
+  if(!tasksAdded)
+  {
+    Serial.println("Too many tasks, raise SCHEDULER_MAX_TASKS");
+  }
+  Serial.print("Setup done after ");
+  Serial.print(millis());
+  Serial.println(" ms");
+  watchdog.init(&console);
+}
 
 
-
-
-
-
-
-
-
+// This is called repeatedly
+void loop()
+{
+  watchdog.kick();
+  if(!scheduler.runFsm())
+  {
+    power.runFsm();
+  }
+}